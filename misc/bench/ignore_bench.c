@@ -0,0 +1,125 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "ignore.h"
+
+/* x/X lookups: the trie in src/ignore.c against the linear list of
+ * PATH_MAX buffers it replaced, for 1 to 10000 rules. the time to build
+ * each candidate path is measured apart and taken off both */
+
+/* macros and defines */
+
+#define LOOKUPS 200000
+
+
+
+/* type defintions */
+
+struct linear_ent {
+    char path[PATH_MAX];
+    size_t length;
+    bool contents;
+};
+
+
+
+/* private functions */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+__attribute__((nonnull))
+static void candidate(char *buf, size_t len, int k)
+{
+    snprintf(buf, len, "/run/service-%d/sockex%d", k % 977, k);
+}
+
+__attribute__((nonnull, warn_unused_result))
+static bool linear_match(const struct linear_ent *ents, int count, const char *path)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (ents[i].contents && !strncmp(path, ents[i].path, ents[i].length))
+            return true;
+        else if (!strcmp(path, ents[i].path))
+            return true;
+    }
+
+    return false;
+}
+
+
+
+/* public functions */
+
+int main(void)
+{
+    static const int sizes[] = { 1, 10, 100, 1000, 10000 };
+    volatile unsigned long hits = 0;
+    struct linear_ent *ents;
+    char buf[256];
+    double start, linear, trie, build;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        struct ignore_set set = { 0 };
+        const int count = sizes[s];
+
+        if ((ents = calloc(count, sizeof(struct linear_ent))) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            snprintf(ents[i].path, PATH_MAX, "/run/service-%d/socket", i);
+            ents[i].length = strlen(ents[i].path);
+            ents[i].contents = i & 1;
+
+            if (ignore_add(&set, ents[i].path, ents[i].contents)) {
+                perror("ignore_add");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        start = now();
+        for (int k = 0; k < LOOKUPS; k++)
+        {
+            candidate(buf, sizeof(buf), k);
+            hits += linear_match(ents, count, buf);
+        }
+        linear = (now() - start) / LOOKUPS * 1e9;
+
+        start = now();
+        for (int k = 0; k < LOOKUPS; k++)
+        {
+            candidate(buf, sizeof(buf), k);
+            hits += ignore_match(&set, buf);
+        }
+        trie = (now() - start) / LOOKUPS * 1e9;
+
+        start = now();
+        for (int k = 0; k < LOOKUPS; k++)
+            candidate(buf, sizeof(buf), k);
+        build = (now() - start) / LOOKUPS * 1e9;
+
+        printf("rules=%5d linear=%8.1f ns trie=%6.1f ns nodes=%u\n",
+                count, linear - build, trie - build, set.nnodes);
+
+        ignore_clear(&set);
+        free(ents);
+    }
+
+    exit(EXIT_SUCCESS);
+}
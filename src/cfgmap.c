@@ -0,0 +1,181 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cfgmap.h"
+
+/* private functions */
+
+/* for anything that cannot be mapped, such as a pipe */
+__attribute__((nonnull, warn_unused_result))
+static int read_all(struct cfgmap *map, int fd)
+{
+    size_t cap = 0;
+    ssize_t cnt;
+
+    while (true)
+    {
+        if (map->len + 1 >= cap) {
+            size_t new_cap = cap ? cap * 2 : 4096;
+            char *new_data;
+
+            if ((new_data = realloc(map->data, new_cap)) == NULL)
+                return -1;
+
+            map->data = new_data;
+            cap = new_cap;
+        }
+
+        if ((cnt = read(fd, map->data + map->len, cap - map->len - 1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (cnt == 0)
+            break;
+
+        map->len += cnt;
+    }
+
+    map->data[map->len] = '\0';
+    return 0;
+}
+
+
+
+/* public functions */
+
+int cfgmap_open(struct cfgmap *map, const char *path)
+{
+    struct stat sb;
+    int fd, rc = 0;
+
+    memset(map, 0, sizeof(struct cfgmap));
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+        return -1;
+
+    if (fstat(fd, &sb) == -1) {
+        rc = -1;
+    } else if (S_ISREG(sb.st_mode) && sb.st_size == 0) {
+        /* nothing to map */
+    } else if (S_ISREG(sb.st_mode) && (map->data = mmap(NULL, sb.st_size,
+                    PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        map->len = sb.st_size;
+        map->mapped = true;
+        posix_madvise(map->data, map->len, POSIX_MADV_SEQUENTIAL);
+    } else {
+        map->data = NULL;
+        if (read_all(map, fd)) {
+            free(map->data);
+            map->data = NULL;
+            rc = -1;
+        }
+    }
+
+    if (rc == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+void cfgmap_close(struct cfgmap *map)
+{
+    if (map->mapped)
+        munmap(map->data, map->len);
+    else
+        free(map->data);
+
+    free(map->tail);
+    memset(map, 0, sizeof(struct cfgmap));
+}
+
+/* returns the next line that is not blank or a comment, with surrounding
+ * white space removed, or NULL at the end of the file */
+char *cfgmap_next_line(struct cfgmap *map)
+{
+    char *line, *end, *eol;
+
+    while (map->pos < map->len)
+    {
+        line = map->data + map->pos;
+
+        if ((eol = memchr(line, '\n', map->len - map->pos)) != NULL) {
+            *eol = '\0';
+            map->pos = eol + 1 - map->data;
+            end = eol;
+        } else if (map->mapped) {
+            /* there may be no room past the end of the mapping for a NUL */
+            size_t len = map->len - map->pos;
+
+            map->pos = map->len;
+            free(map->tail);
+            if ((map->tail = malloc(len + 1)) == NULL)
+                return NULL;
+            memcpy(map->tail, line, len);
+            map->tail[len] = '\0';
+            line = map->tail;
+            end = line + len;
+        } else {
+            end = map->data + map->len;
+            map->pos = map->len;
+        }
+
+        while (end > line && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+
+        while (isspace((unsigned char)*line))
+            line++;
+
+        if (*line && *line != '#')
+            return line;
+    }
+
+    return NULL;
+}
+
+/* splits line in place at white space into at most max fields, the last of
+ * which is the remainder of the line. returns the number of fields */
+int cfgmap_split(char *line, char **fields, int max)
+{
+    int cnt = 0;
+
+    while (isspace((unsigned char)*line))
+        line++;
+
+    while (*line && cnt < max)
+    {
+        fields[cnt++] = line;
+
+        if (cnt == max)
+            break;
+
+        while (*line && !isspace((unsigned char)*line))
+            line++;
+
+        if (*line == '\0')
+            break;
+
+        *line++ = '\0';
+
+        while (isspace((unsigned char)*line))
+            line++;
+    }
+
+    return cnt;
+}
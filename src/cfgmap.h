@@ -0,0 +1,30 @@
+#ifndef CFGMAP_H
+#define CFGMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* a config file mapped privately into memory, so that it can be split into
+ * lines and fields in place, without a copy or allocation for each one.
+ *
+ * the returned strings point into the mapping, and so are only valid until
+ * cfgmap_close() */
+
+struct cfgmap {
+    char *data;
+    size_t len;
+    size_t pos;
+    bool mapped;    /* else data was read(2) into the heap */
+    char *tail;     /* a copy of a last line with no newline */
+};
+
+extern int cfgmap_open(struct cfgmap *map, const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern void cfgmap_close(struct cfgmap *map)
+    __attribute__((nonnull));
+extern char *cfgmap_next_line(struct cfgmap *map)
+    __attribute__((nonnull, warn_unused_result));
+extern int cfgmap_split(char *line, char **fields, int max)
+    __attribute__((nonnull, warn_unused_result));
+
+#endif
@@ -0,0 +1,381 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cleanidx.h"
+
+extern int mkpath(char *dir, mode_t mode) __attribute__((nonnull));
+
+/* macros and defines */
+
+#define CIDX_MAGIC   "TMPFIDX1"
+#define CIDX_INITIAL 256
+
+
+
+/* type defintions */
+
+/* an open addressed hash table of entries, keyed by st_dev/st_ino */
+struct clean_index {
+    struct cidx_entry **slots;
+    size_t cap;
+    size_t count;
+};
+
+/* the fixed part of an entry on disk, followed by nchildren of a uint16_t
+ * length and the name (without a NUL) */
+struct cidx_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    int64_t oldest;
+    uint64_t fingerprint;
+    uint32_t nchildren;
+};
+
+
+
+/* private functions */
+
+static size_t cidx_hash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (size_t)h;
+}
+
+static void cidx_entry_free(struct cidx_entry *ent)
+{
+    for (uint32_t i = 0; i < ent->nchildren; i++)
+        free(ent->children[i]);
+
+    free(ent->children);
+    free(ent);
+}
+
+__attribute__((nonnull, warn_unused_result))
+static struct cidx_entry **cidx_slot(struct clean_index *idx, uint64_t dev, uint64_t ino)
+{
+    size_t pos = cidx_hash(dev, ino) & (idx->cap - 1);
+
+    while (idx->slots[pos] &&
+            (idx->slots[pos]->dev != dev || idx->slots[pos]->ino != ino))
+        pos = (pos + 1) & (idx->cap - 1);
+
+    return &idx->slots[pos];
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int cidx_grow(struct clean_index *idx)
+{
+    struct cidx_entry **old = idx->slots;
+    const size_t old_cap = idx->cap;
+    const size_t new_cap = old_cap ? old_cap * 2 : CIDX_INITIAL;
+
+    if ((idx->slots = calloc(new_cap, sizeof(struct cidx_entry *))) == NULL) {
+        idx->slots = old;
+        return -1;
+    }
+
+    idx->cap = new_cap;
+
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i])
+            *cidx_slot(idx, old[i]->dev, old[i]->ino) = old[i];
+
+    free(old);
+    return 0;
+}
+
+/* takes ownership of ent */
+__attribute__((nonnull, warn_unused_result))
+static int cidx_insert(struct clean_index *idx, struct cidx_entry *ent)
+{
+    struct cidx_entry **slot;
+
+    if ((idx->count + 1) * 4 > idx->cap * 3 && cidx_grow(idx))
+        return -1;
+
+    slot = cidx_slot(idx, ent->dev, ent->ino);
+
+    if (*slot)
+        cidx_entry_free(*slot);
+    else
+        idx->count++;
+
+    *slot = ent;
+    return 0;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static struct cidx_entry *cidx_read_entry(FILE *fp)
+{
+    struct cidx_record rec;
+    struct cidx_entry *ent;
+    uint16_t len;
+
+    if (fread(&rec, sizeof(rec), 1, fp) != 1)
+        return NULL;
+
+    if ((ent = calloc(1, sizeof(struct cidx_entry))) == NULL)
+        return NULL;
+
+    ent->dev         = rec.dev;
+    ent->ino         = rec.ino;
+    ent->mtime_sec   = rec.mtime_sec;
+    ent->mtime_nsec  = rec.mtime_nsec;
+    ent->ctime_sec   = rec.ctime_sec;
+    ent->ctime_nsec  = rec.ctime_nsec;
+    ent->oldest      = rec.oldest;
+    ent->fingerprint = rec.fingerprint;
+
+    if (rec.nchildren &&
+            (ent->children = calloc(rec.nchildren, sizeof(char *))) == NULL)
+        goto fail;
+
+    for (; ent->nchildren < rec.nchildren; ent->nchildren++)
+    {
+        char *name;
+
+        if (fread(&len, sizeof(len), 1, fp) != 1 || len == 0)
+            goto fail;
+
+        if ((name = malloc(len + 1)) == NULL)
+            goto fail;
+
+        if (fread(name, len, 1, fp) != 1) {
+            free(name);
+            goto fail;
+        }
+
+        name[len] = '\0';
+        ent->children[ent->nchildren] = name;
+    }
+
+    return ent;
+
+fail:
+    cidx_entry_free(ent);
+    return NULL;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int cidx_write_entry(FILE *fp, const struct cidx_entry *ent)
+{
+    const struct cidx_record rec = {
+        .dev         = ent->dev,
+        .ino         = ent->ino,
+        .mtime_sec   = ent->mtime_sec,
+        .mtime_nsec  = ent->mtime_nsec,
+        .ctime_sec   = ent->ctime_sec,
+        .ctime_nsec  = ent->ctime_nsec,
+        .oldest      = ent->oldest,
+        .fingerprint = ent->fingerprint,
+        .nchildren   = ent->nchildren,
+    };
+
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+        return -1;
+
+    for (uint32_t i = 0; i < ent->nchildren; i++)
+    {
+        const uint16_t len = strlen(ent->children[i]);
+
+        if (fwrite(&len, sizeof(len), 1, fp) != 1 ||
+                fwrite(ent->children[i], len, 1, fp) != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+
+/* public functions */
+
+/* a missing or unreadable index is not an error, it is just empty */
+struct clean_index *cidx_load(const char *path)
+{
+    struct clean_index *idx;
+    struct cidx_entry *ent;
+    char magic[sizeof(CIDX_MAGIC) - 1];
+    uint64_t count;
+    FILE *fp;
+
+    if ((idx = calloc(1, sizeof(struct clean_index))) == NULL)
+        return NULL;
+
+    if (cidx_grow(idx)) {
+        free(idx);
+        return NULL;
+    }
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT)
+            warn("cidx_load: fopen: <%s>", path);
+        return idx;
+    }
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+            memcmp(magic, CIDX_MAGIC, sizeof(magic)) ||
+            fread(&count, sizeof(count), 1, fp) != 1) {
+        warnx("cidx_load: <%s>: not a clean index, ignoring", path);
+        goto done;
+    }
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if ((ent = cidx_read_entry(fp)) == NULL) {
+            warnx("cidx_load: <%s>: truncated, ignoring the rest", path);
+            break;
+        }
+
+        if (cidx_insert(idx, ent)) {
+            cidx_entry_free(ent);
+            break;
+        }
+    }
+
+done:
+    fclose(fp);
+    return idx;
+}
+
+/* only entries visited by this run are written, so directories which have
+ * gone, or are no longer cleaned, drop out */
+int cidx_save(struct clean_index *idx, const char *path)
+{
+    const size_t len = strlen(path) + 5;
+    uint64_t count = 0;
+    char *tmp, *dir;
+    FILE *fp;
+
+    if ((tmp = malloc(len)) == NULL)
+        return -1;
+
+    snprintf(tmp, len, "%s.tmp", path);
+
+    if ((dir = strdup(path)) != NULL) {
+        mkpath(dirname(dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+        free(dir);
+    }
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < idx->cap; i++)
+        if (idx->slots[i] && idx->slots[i]->visited)
+            count++;
+
+    if (fwrite(CIDX_MAGIC, sizeof(CIDX_MAGIC) - 1, 1, fp) != 1 ||
+            fwrite(&count, sizeof(count), 1, fp) != 1)
+        goto fail;
+
+    for (size_t i = 0; i < idx->cap; i++)
+        if (idx->slots[i] && idx->slots[i]->visited &&
+                cidx_write_entry(fp, idx->slots[i]))
+            goto fail;
+
+    if (fclose(fp)) {
+        fp = NULL;
+        goto fail;
+    }
+    fp = NULL;
+
+    if (rename(tmp, path) == -1)
+        goto fail;
+
+    free(tmp);
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        if (fp)
+            fclose(fp);
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+void cidx_free(struct clean_index *idx)
+{
+    for (size_t i = 0; i < idx->cap; i++)
+        if (idx->slots[i])
+            cidx_entry_free(idx->slots[i]);
+
+    free(idx->slots);
+    free(idx);
+}
+
+/* returns the entry for the directory sb, if any, and marks it as visited */
+struct cidx_entry *cidx_lookup(struct clean_index *idx, const struct stat *sb)
+{
+    struct cidx_entry *ent;
+
+    if ((ent = *cidx_slot(idx, sb->st_dev, sb->st_ino)) != NULL)
+        ent->visited = true;
+
+    return ent;
+}
+
+/* checks the directory sb has not changed since ent was recorded, and was
+ * cleaned with the same ignores */
+bool cidx_unchanged(const struct cidx_entry *ent, const struct stat *sb,
+        uint64_t fingerprint)
+{
+    return ent->mtime_sec   == (int64_t)sb->st_mtim.tv_sec &&
+           ent->mtime_nsec  == (int64_t)sb->st_mtim.tv_nsec &&
+           ent->ctime_sec   == (int64_t)sb->st_ctim.tv_sec &&
+           ent->ctime_nsec  == (int64_t)sb->st_ctim.tv_nsec &&
+           ent->fingerprint == fingerprint;
+}
+
+/* records the directory sb after it has been cleaned, taking ownership of
+ * children (which must be allocated with malloc(3)) */
+int cidx_update(struct clean_index *idx, const struct stat *sb,
+        int64_t oldest, uint64_t fingerprint, char **children, uint32_t nchildren)
+{
+    struct cidx_entry *ent;
+
+    if ((ent = calloc(1, sizeof(struct cidx_entry))) == NULL)
+        return -1;
+
+    ent->dev         = sb->st_dev;
+    ent->ino         = sb->st_ino;
+    ent->mtime_sec   = sb->st_mtim.tv_sec;
+    ent->mtime_nsec  = sb->st_mtim.tv_nsec;
+    ent->ctime_sec   = sb->st_ctim.tv_sec;
+    ent->ctime_nsec  = sb->st_ctim.tv_nsec;
+    ent->oldest      = oldest;
+    ent->fingerprint = fingerprint;
+    ent->children    = children;
+    ent->nchildren   = nchildren;
+    ent->visited     = true;
+
+    if (cidx_insert(idx, ent)) {
+        ent->children = NULL;
+        ent->nchildren = 0;
+        cidx_entry_free(ent);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef CLEANIDX_H
+#define CLEANIDX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* the clean index records, for each directory an aged clean has read, what
+ * it looked like afterwards: its identity and timestamps, the oldest mtime
+ * of the entries that were left in it and the names of its sub-directories.
+ *
+ * if a directory is unchanged on the next run and its oldest entry is not
+ * yet due, there is no need to read it, only to visit its sub-directories */
+
+#define CIDX_NEVER INT64_MAX
+
+struct clean_index;
+
+struct cidx_entry {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    int64_t oldest;
+    uint64_t fingerprint;
+    uint32_t nchildren;
+    char **children;
+    bool visited;
+};
+
+extern struct clean_index *cidx_load(const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern int cidx_save(struct clean_index *idx, const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern void cidx_free(struct clean_index *idx)
+    __attribute__((nonnull));
+extern struct cidx_entry *cidx_lookup(struct clean_index *idx, const struct stat *sb)
+    __attribute__((nonnull, warn_unused_result));
+extern bool cidx_unchanged(const struct cidx_entry *ent, const struct stat *sb,
+        uint64_t fingerprint)
+    __attribute__((nonnull, warn_unused_result));
+extern int cidx_update(struct clean_index *idx, const struct stat *sb,
+        int64_t oldest, uint64_t fingerprint, char **children, uint32_t nchildren)
+    __attribute__((nonnull(1,2), warn_unused_result));
+
+#endif
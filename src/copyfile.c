@@ -0,0 +1,787 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
+#include "copyfile.h"
+#include "workpool.h"
+
+/* macros and defines */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* what an entry is created as until it is complete, see copy_tmpname() */
+#define COPY_TMP_PREFIX ".#tmpfilesd."
+
+
+
+/* type defintions */
+
+/* a directory being copied by copy_tree(). it is finished, and so given the
+ * mode and times of its source, once the last reference is put, which is
+ * after everything below it has been */
+struct copy_node {
+    struct copy_node *parent;
+    atomic_uint refs;
+    int src_fd;
+    int dst_fd;
+    struct stat sb;         /* of the source */
+    struct workpool *pool;
+    bool top;               /* the destination given, which is left alone */
+    char tmp[32];           /* the name in the parent until it is finished */
+    char name[];            /* in the source, or the whole path if top */
+};
+
+
+
+/* private global variables */
+
+static atomic_uint_fast64_t copied[COPY_MECHANISMS];
+static atomic_ulong copied_files;
+static atomic_ulong copied_dirs;
+static atomic_ulong tmp_seq;
+
+/* directories queued on the pool before they are copied inline, which bounds
+ * the descriptors held open by those waiting */
+static const size_t max_queued = 256;
+
+
+
+/* private functions */
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* errors that mean copy_file_range(2) cannot be used for these files, rather
+ * than that the copy failed */
+static bool range_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+        err == EBADF || err == EPERM;
+}
+#endif
+
+/* copies len bytes at off in src to the same offset in dst. *use_range is
+ * cleared once copy_file_range(2) is found not to work for them */
+__attribute__((nonnull, warn_unused_result))
+static int copy_extent(int src, int dst, off_t off, off_t len, bool *use_range)
+{
+    char buf[BUFSIZ * 4];
+    ssize_t rd, wr;
+
+    while (len > 0)
+    {
+#ifdef HAVE_COPY_FILE_RANGE
+        if (*use_range) {
+            loff_t in = off, out = off;
+            ssize_t cnt;
+
+            if ((cnt = copy_file_range(src, &in, dst, &out, len, 0)) > 0) {
+                atomic_fetch_add(&copied[COPY_RANGE], cnt);
+                off += cnt;
+                len -= cnt;
+                continue;
+            }
+
+            /* src is shorter than it was */
+            if (cnt == 0)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+            if (!range_unsupported(errno))
+                return -1;
+
+            *use_range = false;
+        }
+#else
+        (void)use_range;
+#endif
+
+        if ((rd = pread(src, buf, MIN(len, (off_t)sizeof(buf)), off)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (rd == 0)
+            return 0;
+
+        /* write(2) may write less than asked */
+        for (ssize_t done = 0; done < rd; done += wr)
+            if ((wr = pwrite(dst, buf + done, rd - done, off + done)) == -1) {
+                if (errno != EINTR)
+                    return -1;
+                wr = 0;
+            }
+
+        atomic_fetch_add(&copied[COPY_READ_WRITE], rd);
+        off += rd;
+        len -= rd;
+    }
+
+    return 0;
+}
+
+/* the full source path of name in node, for messages */
+__attribute__((nonnull(1), warn_unused_result))
+static char *copy_path(const struct copy_node *node, const char *name)
+{
+    const struct copy_node *ptr;
+    size_t len = name ? strlen(name) + 1 : 0;
+    char *buf, *end;
+
+    for (ptr = node; ptr; ptr = ptr->parent)
+        len += strlen(ptr->name) + 1;
+
+    if ((buf = malloc(len)) == NULL)
+        return NULL;
+
+    end = buf + len - 1;
+    *end = '\0';
+
+    if (name) {
+        end -= strlen(name);
+        memcpy(end, name, strlen(name));
+        *--end = '/';
+    }
+
+    for (ptr = node; ptr; ptr = ptr->parent) {
+        end -= strlen(ptr->name);
+        memcpy(end, ptr->name, strlen(ptr->name));
+        if (ptr->parent)
+            *--end = '/';
+    }
+
+    return buf;
+}
+
+__attribute__((nonnull(1, 3), format(printf, 3, 4)))
+static void copy_warn(const struct copy_node *node, const char *name,
+        const char *fmt, ...)
+{
+    int saved = errno;
+    char *path = copy_path(node, name);
+    char msg[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    errno = saved;
+    warn("copy_tree: %s: %s", msg, path ? path : node->name);
+    free(path);
+}
+
+/* a name for an entry of dst that nothing else will be using */
+__attribute__((nonnull))
+static void copy_tmpname(char buf[32])
+{
+    snprintf(buf, 32, COPY_TMP_PREFIX "%u.%lu", (unsigned)getpid(),
+            atomic_fetch_add(&tmp_seq, 1));
+}
+
+/* is name one of copy_tmpname()'s, left by a process that has since gone */
+__attribute__((nonnull, warn_unused_result))
+static bool copy_tmp_stale(const char *name)
+{
+    unsigned long pid;
+    char *end;
+
+    if (strncmp(name, COPY_TMP_PREFIX, sizeof(COPY_TMP_PREFIX) - 1))
+        return false;
+
+    errno = 0;
+    pid = strtoul(name + sizeof(COPY_TMP_PREFIX) - 1, &end, 10);
+    if (errno || *end != '.' || pid == 0 || pid > INT_MAX || (pid_t)pid == getpid())
+        return false;
+
+    return kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+}
+
+/* deletes name in dirfd, and everything below it */
+__attribute__((nonnull))
+static void copy_unlink_tree(int dirfd, const char *name)
+{
+    struct dirent *ent;
+    DIR *dirp;
+    int fd;
+
+    if (unlinkat(dirfd, name, 0) == 0 || (errno != EISDIR && errno != EPERM))
+        return;
+
+    if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        return;
+
+    if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dirp)) != NULL)
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        copy_unlink_tree(fd, ent->d_name);
+    }
+
+    closedir(dirp);
+
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) == -1 && errno != ENOENT)
+        warn("copy: rmdir %s", name);
+}
+
+/* removes what an interrupted copy left in dirfd: the temporary entries of
+ * processes that are no longer running. only the top of a copy need be
+ * looked at, as anything below was made inside one of these */
+static void copy_clean_stale(int dirfd)
+{
+    struct dirent *ent;
+    DIR *dirp;
+    int fd;
+
+    if ((fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+        return;
+
+    if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dirp)) != NULL)
+        if (copy_tmp_stale(ent->d_name))
+            copy_unlink_tree(dirfd, ent->d_name);
+
+    closedir(dirp);
+}
+
+/* errors from setting metadata that only mean it cannot be kept here: not
+ * root, or a file system without xattrs */
+static bool meta_unsupported(int err)
+{
+    return err == EPERM || err == ENOTSUP || err == EOPNOTSUPP || err == EINVAL;
+}
+
+/* copies the extended attributes (and so any ACLs) of src to dst */
+__attribute__((warn_unused_result))
+static int copy_xattrs(int src, int dst)
+{
+    char *names, *value = NULL;
+    ssize_t len, vlen;
+    size_t vcap = 0;
+    int rc = -1;
+
+    if ((len = flistxattr(src, NULL, 0)) == -1)
+        return meta_unsupported(errno) ? 0 : -1;
+
+    if (len == 0)
+        return 0;
+
+    if ((names = malloc(len)) == NULL)
+        return -1;
+
+    if ((len = flistxattr(src, names, len)) == -1)
+        goto done;
+
+    for (char *name = names; name < names + len; name += strlen(name) + 1)
+    {
+        if ((vlen = fgetxattr(src, name, NULL, 0)) == -1) {
+            if (errno == ENODATA)
+                continue;
+            goto done;
+        }
+
+        if ((size_t)vlen > vcap) {
+            char *tmp;
+
+            if ((tmp = realloc(value, vlen)) == NULL)
+                goto done;
+            value = tmp;
+            vcap = vlen;
+        }
+
+        if ((vlen = fgetxattr(src, name, value, vcap)) == -1) {
+            if (errno == ENODATA)
+                continue;
+            goto done;
+        }
+
+        if (fsetxattr(dst, name, value, vlen, 0) == -1 && !meta_unsupported(errno))
+            goto done;
+    }
+
+    rc = 0;
+
+done:
+    free(names);
+    free(value);
+    return rc;
+}
+
+/* gives dst the owner and xattrs of the source described by sb. the mode is
+ * set after the owner, as fchown(2) may clear S_ISUID and S_ISGID */
+__attribute__((nonnull, warn_unused_result))
+static int copy_owner(int src, int dst, const struct stat *sb)
+{
+    if (fchown(dst, sb->st_uid, sb->st_gid) == -1 && !meta_unsupported(errno))
+        return -1;
+
+    return copy_xattrs(src, dst);
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int copy_mode_times(int dst, const struct stat *sb)
+{
+    const struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+
+    if (fchmod(dst, sb->st_mode & 07777) == -1)
+        return -1;
+
+    return futimens(dst, times);
+}
+
+/* gives tmp in dirfd the name name, unless something already has it.
+ * linkat(2) fails rather than replace, where the file system has links */
+__attribute__((nonnull, warn_unused_result))
+static int copy_publish(int dirfd, const char *tmp, const char *name, bool isdir)
+{
+    if (!isdir) {
+        if (linkat(dirfd, tmp, dirfd, name, 0) == 0 || errno == EEXIST) {
+            int saved = errno;
+
+            if (unlinkat(dirfd, tmp, 0) == -1 && errno != ENOENT)
+                return -1;
+            errno = saved;
+            return 0;
+        }
+
+        if (errno != EPERM && errno != ENOTSUP && errno != EOPNOTSUPP &&
+                errno != EMLINK && errno != EXDEV)
+            return -1;
+    }
+
+    return renameat(dirfd, tmp, dirfd, name);
+}
+
+/* copies the regular file name in srcdir, described by sb, as dst_name in
+ * dstdir. if publish it is written as a temporary name first, so that
+ * dst_name is only ever the whole file */
+__attribute__((nonnull, warn_unused_result))
+static int copy_reg(int srcdir, const char *name, const struct stat *sb,
+        int dstdir, const char *dst_name, bool publish, bool follow)
+{
+    char tmp[32];
+    const char *target = dst_name;
+    int src, dst = -1;
+
+    if ((src = openat(srcdir, name, O_RDONLY|O_CLOEXEC|(follow ? 0 : O_NOFOLLOW))) == -1)
+        return -1;
+
+    if (publish) {
+        copy_tmpname(tmp);
+        target = tmp;
+    }
+
+    if ((dst = openat(dstdir, target, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+                    S_IRUSR|S_IWUSR)) == -1)
+        goto fail;
+
+    if (copy_fd(src, dst, sb->st_size) ||
+            copy_owner(src, dst, sb) ||
+            copy_mode_times(dst, sb))
+        goto fail_unlink;
+
+    close(src);
+    src = -1;
+
+    if (close(dst) == -1) {
+        dst = -1;
+        goto fail_unlink;
+    }
+    dst = -1;
+
+    if (publish && copy_publish(dstdir, tmp, dst_name, false))
+        goto fail_unlink;
+
+    atomic_fetch_add(&copied_files, 1);
+    return 0;
+
+fail_unlink:
+    {
+        int saved = errno;
+        unlinkat(dstdir, target, 0);
+        errno = saved;
+    }
+fail:
+    {
+        int saved = errno;
+        if (src != -1)
+            close(src);
+        if (dst != -1)
+            close(dst);
+        errno = saved;
+    }
+    return -1;
+}
+
+/* symbolic links are copied as links, with their owner and times */
+__attribute__((nonnull, warn_unused_result))
+static int copy_symlink(int srcdir, const char *name, const struct stat *sb,
+        int dstdir, bool publish)
+{
+    const struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+    char target[PATH_MAX], tmp[32];
+    const char *dst_name = name;
+    ssize_t len;
+
+    if ((len = readlinkat(srcdir, name, target, sizeof(target) - 1)) == -1)
+        return -1;
+    target[len] = '\0';
+
+    if (publish) {
+        copy_tmpname(tmp);
+        dst_name = tmp;
+    }
+
+    if (symlinkat(target, dstdir, dst_name) == -1)
+        return -1;
+
+    if ((fchownat(dstdir, dst_name, sb->st_uid, sb->st_gid, AT_SYMLINK_NOFOLLOW) == -1 &&
+                !meta_unsupported(errno)) ||
+            utimensat(dstdir, dst_name, times, AT_SYMLINK_NOFOLLOW) == -1 ||
+            (publish && copy_publish(dstdir, tmp, name, false))) {
+        int saved = errno;
+        unlinkat(dstdir, dst_name, 0);
+        errno = saved;
+        return -1;
+    }
+
+    atomic_fetch_add(&copied_files, 1);
+    return 0;
+}
+
+__attribute__((nonnull(2)))
+static struct copy_node *copy_node_new(struct copy_node *parent, const char *name,
+        int src_fd, int dst_fd)
+{
+    struct copy_node *node;
+    size_t len = strlen(name);
+
+    if ((node = calloc(1, sizeof(struct copy_node) + len + 1)) == NULL)
+        return NULL;
+
+    memcpy(node->name, name, len + 1);
+    node->parent = parent;
+    node->src_fd = src_fd;
+    node->dst_fd = dst_fd;
+    atomic_init(&node->refs, 1);
+
+    if (parent) {
+        node->pool = parent->pool;
+        atomic_fetch_add(&parent->refs, 1);
+    }
+
+    return node;
+}
+
+/* a directory is finished when nothing below it is still being copied: its
+ * mode and times are set only then, so neither stops nor changes with the
+ * copying of its entries, and then it is given its name */
+static void copy_node_put(struct copy_node *node)
+{
+    struct copy_node *parent;
+
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1)
+    {
+        parent = node->parent;
+
+        if (!node->top) {
+            if (copy_mode_times(node->dst_fd, &node->sb))
+                copy_warn(node, NULL, "mode or times");
+            if (copy_publish(parent->dst_fd, node->tmp, node->name, true))
+                copy_warn(node, NULL, "rename");
+            else
+                atomic_fetch_add(&copied_dirs, 1);
+        }
+
+        if (node->src_fd != -1)
+            close(node->src_fd);
+        close(node->dst_fd);
+        free(node);
+        node = parent;
+    }
+}
+
+static void copy_dir(struct copy_node *node);
+
+static void copy_dir_task(void *arg)
+{
+    copy_dir(arg);
+}
+
+/* creates name in the directory of node, as a temporary name, and copies the
+ * source directory into it, on the pool if it is not already busy */
+__attribute__((nonnull))
+static void copy_subdir(struct copy_node *node, int srcdir, const char *name,
+        const struct stat *sb)
+{
+    struct copy_node *sub;
+    char tmp[32];
+    int src_fd, dst_fd;
+
+    if ((src_fd = openat(srcdir, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+        copy_warn(node, name, "open");
+        return;
+    }
+
+    copy_tmpname(tmp);
+
+    /* writable until finished, whatever the mode of the source */
+    if (mkdirat(node->dst_fd, tmp, S_IRWXU) == -1) {
+        copy_warn(node, name, "mkdir");
+        close(src_fd);
+        return;
+    }
+
+    if ((dst_fd = openat(node->dst_fd, tmp, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 ||
+            (sub = copy_node_new(node, name, src_fd, dst_fd)) == NULL) {
+        copy_warn(node, name, "open");
+        if (dst_fd != -1)
+            close(dst_fd);
+        close(src_fd);
+        unlinkat(node->dst_fd, tmp, AT_REMOVEDIR);
+        return;
+    }
+
+    memcpy(sub->tmp, tmp, sizeof(tmp));
+    sub->sb = *sb;
+
+    if (copy_owner(src_fd, dst_fd, sb))
+        copy_warn(node, name, "owner or xattrs");
+
+    if (sub->pool && workpool_queued(sub->pool) < max_queued &&
+            !workpool_submit(sub->pool, copy_dir_task, sub))
+        return;
+
+    copy_dir(sub);
+}
+
+/* copies the entries of node's source into its destination. entries of the
+ * top directory that are already there are left alone, below it everything
+ * is new */
+static void copy_dir(struct copy_node *node)
+{
+    struct dirent *ent;
+    struct stat sb;
+    DIR *dirp;
+
+    if ((dirp = fdopendir(node->src_fd)) == NULL) {
+        copy_warn(node, NULL, "opendir");
+        copy_node_put(node);
+        return;
+    }
+
+    /* closed with dirp */
+    node->src_fd = -1;
+
+    while ((ent = readdir(dirp)) != NULL)
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        if (fstatat(dirfd(dirp), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno != ENOENT)
+                copy_warn(node, ent->d_name, "stat");
+            continue;
+        }
+
+        if (node->top) {
+            struct stat dsb;
+
+            if (fstatat(node->dst_fd, ent->d_name, &dsb, AT_SYMLINK_NOFOLLOW) == 0)
+                continue;
+            if (errno != ENOENT) {
+                copy_warn(node, ent->d_name, "stat destination");
+                continue;
+            }
+        }
+
+        if (S_ISDIR(sb.st_mode))
+            copy_subdir(node, dirfd(dirp), ent->d_name, &sb);
+        else if (S_ISREG(sb.st_mode)) {
+            if (copy_reg(dirfd(dirp), ent->d_name, &sb, node->dst_fd,
+                        ent->d_name, node->top, false))
+                copy_warn(node, ent->d_name, "copy");
+        } else if (S_ISLNK(sb.st_mode)) {
+            if (copy_symlink(dirfd(dirp), ent->d_name, &sb, node->dst_fd, node->top))
+                copy_warn(node, ent->d_name, "symlink");
+        } else {
+            errno = EBADF;
+            copy_warn(node, ent->d_name, "not a file, directory or link");
+        }
+    }
+
+    closedir(dirp);
+    copy_node_put(node);
+}
+
+
+
+/* public functions */
+
+int copy_fd(int src, int dst, off_t size)
+{
+    bool use_range = true;
+    off_t off = 0, data, hole;
+
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) {
+        atomic_fetch_add(&copied[COPY_CLONE], size);
+        return 0;
+    }
+#endif
+
+    while (off < size)
+    {
+        if ((data = lseek(src, off, SEEK_DATA)) == -1) {
+            /* only a hole from off to the end */
+            if (errno == ENXIO)
+                break;
+            if (errno != EINVAL)
+                return -1;
+
+            /* no SEEK_DATA, so all of it */
+            data = off;
+            hole = size;
+        } else if ((hole = lseek(src, data, SEEK_HOLE)) == -1)
+            hole = size;
+
+        if (data >= size)
+            break;
+
+        if (copy_extent(src, dst, data, MIN(hole, size) - data, &use_range))
+            return -1;
+
+        off = hole;
+    }
+
+    /* so that a hole at the end is kept */
+    return ftruncate(dst, size);
+}
+
+void copy_stats(uint64_t bytes[COPY_MECHANISMS])
+{
+    for (int i = 0; i < COPY_MECHANISMS; i++)
+        bytes[i] = atomic_load(&copied[i]);
+}
+
+int copy_file(const char *src, const char *dst)
+{
+    struct stat sb;
+    char *dir, *name, *slash;
+    int dirfd, rc = -1;
+
+    if (stat(src, &sb) == -1)
+        return -1;
+
+    if (!S_ISREG(sb.st_mode)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((dir = strdup(dst)) == NULL)
+        return -1;
+
+    if ((slash = strrchr(dir, '/')) == NULL) {
+        name = dir;
+        dirfd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    } else {
+        *slash = '\0';
+        name = slash + 1;
+        dirfd = open(slash == dir ? "/" : dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    }
+
+    if (dirfd == -1)
+        goto done;
+
+    if (!*name) {
+        errno = EISDIR;
+        goto done;
+    }
+
+    copy_clean_stale(dirfd);
+
+    /* the source may be a symbolic link to the file, which is followed */
+    rc = copy_reg(AT_FDCWD, src, &sb, dirfd, name, true, true);
+
+done:
+    {
+        int saved = errno;
+        if (dirfd != -1)
+            close(dirfd);
+        free(dir);
+        errno = saved;
+    }
+    return rc;
+}
+
+int copy_tree(const char *src, const char *dst, struct workpool *pool)
+{
+    struct copy_node *top;
+    int src_fd, dst_fd;
+
+    if ((src_fd = open(src, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+        return -1;
+
+    if ((dst_fd = open(dst, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+        int saved = errno;
+        close(src_fd);
+        errno = saved;
+        return -1;
+    }
+
+    if ((top = copy_node_new(NULL, src, src_fd, dst_fd)) == NULL) {
+        close(src_fd);
+        close(dst_fd);
+        return -1;
+    }
+
+    top->top = true;
+    top->pool = pool;
+
+    copy_clean_stale(dst_fd);
+
+    /* this thread copies the top level, the pool anything below it */
+    copy_dir(top);
+    if (pool)
+        workpool_wait(pool);
+
+    return 0;
+}
+
+void copy_counts(unsigned long *files, unsigned long *dirs)
+{
+    *files = atomic_load(&copied_files);
+    *dirs = atomic_load(&copied_dirs);
+}
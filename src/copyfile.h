@@ -0,0 +1,49 @@
+#ifndef COPYFILE_H
+#define COPYFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* copies the data of one regular file into another: as a reflink where the
+ * file system can share the blocks (btrfs, xfs), else by copy_file_range(2)
+ * so the data stays in the kernel, else by read(2) and write(2).
+ *
+ * only the data of a sparse file is copied, so the holes are kept. the
+ * bytes copied each way are counted for the run, and may be read with
+ * copy_stats() from any thread.
+ *
+ * copy_file() and copy_tree() copy with the mode, owner, times and xattrs
+ * of the source, the owner and xattrs only where permitted. each new entry
+ * of the destination is written under a temporary name (".#tmpfilesd.*")
+ * and then renamed, so that it is only ever seen whole, and anything that
+ * is already there is left alone. symbolic links are copied as links.
+ * temporary names left in the destination by a copy whose process has gone
+ * are removed first */
+
+struct workpool;
+
+typedef enum {
+    COPY_CLONE = 0,
+    COPY_RANGE,
+    COPY_READ_WRITE,
+    COPY_MECHANISMS,
+} copy_mechanism_t;
+
+/* size is that of src, as found by fstat(2), which dst is truncated to */
+extern int copy_fd(int src, int dst, off_t size)
+    __attribute__((warn_unused_result));
+/* dst must not exist */
+extern int copy_file(const char *src, const char *dst)
+    __attribute__((nonnull, warn_unused_result));
+/* copies what is in the directory src into the directory dst. with a pool,
+ * sub-directories are copied on it, and it is waited for. errors below the
+ * top are warned of and the rest copied */
+extern int copy_tree(const char *src, const char *dst, struct workpool *pool)
+    __attribute__((nonnull(1,2), warn_unused_result));
+extern void copy_stats(uint64_t bytes[COPY_MECHANISMS])
+    __attribute__((nonnull));
+/* the files (and links) and directories copied by the above */
+extern void copy_counts(unsigned long *files, unsigned long *dirs)
+    __attribute__((nonnull));
+
+#endif
@@ -0,0 +1,107 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "expiry.h"
+
+/* private functions */
+
+__attribute__((nonnull))
+static void sift_up(struct expiry_heap *heap, size_t pos)
+{
+    const struct expiry ent = heap->items[pos];
+
+    while (pos)
+    {
+        size_t parent = (pos - 1) / 2;
+
+        if (heap->items[parent].due <= ent.due)
+            break;
+
+        heap->items[pos] = heap->items[parent];
+        pos = parent;
+    }
+
+    heap->items[pos] = ent;
+}
+
+__attribute__((nonnull))
+static void sift_down(struct expiry_heap *heap, size_t pos)
+{
+    const struct expiry ent = heap->items[pos];
+
+    while (true)
+    {
+        size_t child = pos * 2 + 1;
+
+        if (child >= heap->count)
+            break;
+
+        if (child + 1 < heap->count &&
+                heap->items[child + 1].due < heap->items[child].due)
+            child++;
+
+        if (ent.due <= heap->items[child].due)
+            break;
+
+        heap->items[pos] = heap->items[child];
+        pos = child;
+    }
+
+    heap->items[pos] = ent;
+}
+
+
+
+/* public functions */
+
+int expiry_push(struct expiry_heap *heap, const struct expiry *ent)
+{
+    if (heap->count == heap->cap) {
+        size_t new_cap = heap->cap ? heap->cap * 2 : 256;
+        struct expiry *new_items;
+
+        if ((new_items = realloc(heap->items, new_cap * sizeof(struct expiry))) == NULL)
+            return -1;
+
+        heap->items = new_items;
+        heap->cap = new_cap;
+    }
+
+    heap->items[heap->count] = *ent;
+    sift_up(heap, heap->count++);
+
+    return 0;
+}
+
+int expiry_pop(struct expiry_heap *heap, struct expiry *ent)
+{
+    if (heap->count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *ent = heap->items[0];
+
+    if (--heap->count) {
+        heap->items[0] = heap->items[heap->count];
+        sift_down(heap, 0);
+    }
+
+    return 0;
+}
+
+void expiry_clear(struct expiry_heap *heap)
+{
+    for (size_t i = 0; i < heap->count; i++)
+        free(heap->items[i].path);
+
+    free(heap->items);
+    heap->items = NULL;
+    heap->count = 0;
+    heap->cap = 0;
+}
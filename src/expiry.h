@@ -0,0 +1,36 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* files left behind by an aged clean, ordered by when they fall due, as a
+ * binary min-heap so the next one due is always at the top */
+
+struct expiry {
+    time_t due;
+    time_t age;
+    uint64_t dev;       /* of the directory the file was found in */
+    uint64_t ino;
+    char *path;
+    size_t name_off;    /* offset of the file's name in path */
+    uint64_t bytes;     /* allocated to the file */
+};
+
+struct expiry_heap {
+    struct expiry *items;
+    size_t count;
+    size_t cap;
+};
+
+/* takes ownership of ent->path on success */
+extern int expiry_push(struct expiry_heap *heap, const struct expiry *ent)
+    __attribute__((nonnull, warn_unused_result));
+/* the caller takes ownership of ent->path */
+extern int expiry_pop(struct expiry_heap *heap, struct expiry *ent)
+    __attribute__((nonnull, warn_unused_result));
+extern void expiry_clear(struct expiry_heap *heap)
+    __attribute__((nonnull));
+
+#endif
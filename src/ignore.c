@@ -0,0 +1,187 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ignore.h"
+
+/* macros and defines */
+
+#define IGN_PREFIX (1<<0)
+#define IGN_EXACT  (1<<1)
+
+#define NODE_NONE  0
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+
+
+/* type defintions */
+
+/* nodes are kept in one array, linked first-child/next-sibling by index.
+ * index 0 is the root, so it doubles as "no node" for the links */
+struct ignore_node {
+    uint32_t child;
+    uint32_t sibling;
+    unsigned char byte;
+    uint8_t flags;
+};
+
+
+
+/* private functions */
+
+__attribute__((nonnull, warn_unused_result))
+static uint32_t find_child(const struct ignore_set *set, uint32_t node, unsigned char byte)
+{
+    uint32_t idx;
+
+    for (idx = set->nodes[node].child; idx != NODE_NONE; idx = set->nodes[idx].sibling)
+        if (set->nodes[idx].byte == byte)
+            return idx;
+
+    return NODE_NONE;
+}
+
+/* returns the index of a new node, or NODE_NONE on failure */
+__attribute__((nonnull, warn_unused_result))
+static uint32_t new_node(struct ignore_set *set, unsigned char byte)
+{
+    if (set->nnodes == set->cap) {
+        uint32_t new_cap = set->cap ? set->cap * 2 : 64;
+        struct ignore_node *new_nodes;
+
+        if ((new_nodes = realloc(set->nodes, new_cap * sizeof(struct ignore_node))) == NULL)
+            return NODE_NONE;
+
+        set->nodes = new_nodes;
+        set->cap = new_cap;
+    }
+
+    set->nodes[set->nnodes].child = NODE_NONE;
+    set->nodes[set->nnodes].sibling = NODE_NONE;
+    set->nodes[set->nnodes].byte = byte;
+    set->nodes[set->nnodes].flags = 0;
+
+    return set->nnodes++;
+}
+
+
+
+/* public functions */
+
+int ignore_add(struct ignore_set *set, const char *path, bool contents)
+{
+    uint32_t node = 0, next;
+
+    if (set->nnodes == 0 && new_node(set, '\0') != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (const unsigned char *ptr = (const unsigned char *)path; *ptr; ptr++)
+    {
+        if ((next = find_child(set, node, *ptr)) == NODE_NONE) {
+            if ((next = new_node(set, *ptr)) == NODE_NONE) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            set->nodes[next].sibling = set->nodes[node].child;
+            set->nodes[node].child = next;
+        }
+
+        node = next;
+    }
+
+    set->nodes[node].flags |= contents ? IGN_PREFIX : IGN_EXACT;
+    set->count++;
+
+    /* FNV-1a over each path and its type, in the order added, so callers
+     * can tell if a set differs from a previous run */
+    if (set->hash == 0)
+        set->hash = FNV_OFFSET;
+    for (const unsigned char *ptr = (const unsigned char *)path; *ptr; ptr++)
+        set->hash = (set->hash ^ *ptr) * FNV_PRIME;
+    set->hash = (set->hash ^ (contents ? 'x' : 'X')) * FNV_PRIME;
+
+    return 0;
+}
+
+/* a path is ignored if it equals any path, or starts with any path added
+ * with contents set */
+bool ignore_match(const struct ignore_set *set, const char *path)
+{
+    uint32_t node = 0;
+
+    if (set->nnodes == 0)
+        return false;
+
+    for (const unsigned char *ptr = (const unsigned char *)path; *ptr; ptr++)
+    {
+        if (set->nodes[node].flags & IGN_PREFIX)
+            return true;
+
+        if ((node = find_child(set, node, *ptr)) == NODE_NONE)
+            return false;
+    }
+
+    return set->nodes[node].flags != 0;
+}
+
+/* as ignore_match(), but only true if path starts with a path added with
+ * contents set. used on "dir/" to find that all of a directory is ignored */
+bool ignore_match_prefix(const struct ignore_set *set, const char *path)
+{
+    uint32_t node = 0;
+
+    if (set->nnodes == 0)
+        return false;
+
+    for (const unsigned char *ptr = (const unsigned char *)path; *ptr; ptr++)
+    {
+        if (set->nodes[node].flags & IGN_PREFIX)
+            return true;
+
+        if ((node = find_child(set, node, *ptr)) == NODE_NONE)
+            return false;
+    }
+
+    return (set->nodes[node].flags & IGN_PREFIX) != 0;
+}
+
+/* dst must be empty, or cleared */
+int ignore_copy(struct ignore_set *dst, const struct ignore_set *src)
+{
+    *dst = *src;
+    dst->cap = src->nnodes;
+
+    if (src->nnodes == 0) {
+        dst->nodes = NULL;
+        return 0;
+    }
+
+    if ((dst->nodes = malloc(src->nnodes * sizeof(struct ignore_node))) == NULL) {
+        dst->nnodes = dst->cap = 0;
+        dst->count = 0;
+        return -1;
+    }
+
+    memcpy(dst->nodes, src->nodes, src->nnodes * sizeof(struct ignore_node));
+
+    return 0;
+}
+
+void ignore_clear(struct ignore_set *set)
+{
+    free(set->nodes);
+    set->nodes = NULL;
+    set->nnodes = 0;
+    set->cap = 0;
+    set->count = 0;
+    set->hash = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the paths of x/X lines, stored as a byte-wise trie so that a lookup costs
+ * one step per character of the path being checked, however many paths
+ * are ignored */
+
+struct ignore_node;
+
+struct ignore_set {
+    struct ignore_node *nodes;
+    uint32_t nnodes;
+    uint32_t cap;
+    size_t count;
+    uint64_t hash;      /* changes with every path added, see ignore_add() */
+};
+
+/* contents: if true path is matched as a prefix (x), otherwise exactly (X) */
+extern int ignore_add(struct ignore_set *set, const char *path, bool contents)
+    __attribute__((nonnull, warn_unused_result));
+extern bool ignore_match(const struct ignore_set *set, const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern bool ignore_match_prefix(const struct ignore_set *set, const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern int ignore_copy(struct ignore_set *dst, const struct ignore_set *src)
+    __attribute__((nonnull, warn_unused_result));
+extern void ignore_clear(struct ignore_set *set)
+    __attribute__((nonnull));
+
+#endif
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -15,13 +16,19 @@
 #include <grp.h>
 #include <unistd.h>
 #include <sys/utsname.h>
-#include <glob.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <libgen.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/statvfs.h>
+#include <inttypes.h>
 
 #ifdef __linux__
 # include <sys/sysmacros.h>
@@ -30,8 +37,23 @@
 #endif
 
 #include "config.h"
+#include "workpool.h"
+#include "uring.h"
+#include "ignore.h"
+#include "cleanidx.h"
+#include "expiry.h"
+#include "watch.h"
+#include "cfgmap.h"
+#include "rules.h"
+#include "nsscache.h"
+#include "pathglob.h"
+#include "copyfile.h"
+#include "subvol.h"
+#include "trash.h"
 
 extern int mkpath(char *dir, mode_t mode) __attribute__((nonnull));
+extern void mkpath_forget(void);
+extern void mkpath_forget_tree(const char *path) __attribute__((nonnull));
 
 
 
@@ -89,6 +111,7 @@ typedef enum {
     CFG_GLOB   = (1<<4),
     CFG_FOLLOW = (1<<5),
     CFG_PLUS   = (1<<6),
+    CFG_OWNS   = (1<<7), /* later lines for the same path are dropped, see parse_line() */
 } cfg_options_t;
 
 typedef enum {
@@ -107,17 +130,19 @@ struct config_element {
     const cfg_arg_type_t arg_type;
 };
 
-typedef struct ignent {
-    char path[PATH_MAX];
-    size_t length;
-    bool contents;
-} ignent_t;
+/* a config file found in one of config_dirs */
+struct config_file {
+    char *name;
+    int dir;    /* index into config_dirs, the lower the higher its precedence */
+};
 
 /* private global variables */
 
 /* long_opt values */
 static int do_create=0, do_clean=0, do_remove=0, do_boot=0;
 static int do_help=0, do_version=0, debug=0, debug_unlink=0;
+static int do_uring=0, do_clean_index=0, do_daemon=0, do_rule_cache=0;
+static int do_plan=0, do_trash=0, do_destroy_subvols=0;
 
 static char *opt_prefix = NULL, *opt_exclude = NULL, *opt_root = NULL;
 static char **config_files = NULL;
@@ -130,34 +155,121 @@ static char *machineid = NULL;
 static char *kernelrel = NULL;
 static char *bootid = NULL;
 
-static ignent_t *ignores = NULL;
-static int ignores_size = 0;
+/* the value of each specifier, resolved the first time it is used and then
+ * kept for the run. NULL if it could not be */
+static const char *specifiers[UCHAR_MAX + 1];
+static bool specifiers_set[UCHAR_MAX + 1];
+static char spec_uid[24], spec_gid[24];
+
+static struct ignore_set ignores = { NULL, 0, 0, 0, 0 };
+
+/* the directories (as "dir/") cleaned by a line of their own, which the
+ * clean of any directory above them leaves to it, see plan_clean() */
+static struct ignore_set clean_roots = { NULL, 0, 0, 0, 0 };
+
+/* --jobs: threads used to walk directories when cleaning */
+static int opt_jobs = 1;
+static struct workpool *clean_pool = NULL;
+
+/* --jobs: threads rules that do not depend on each other are applied on */
+static struct workpool *apply_pool = NULL;
+
+/* --jobs: threads the sub-directories of a C line are copied on */
+static struct workpool *copy_pool = NULL;
+
+/* --io-uring: batches the metadata syscalls of a serial clean */
+static struct uring *clean_ring = NULL;
+
+/* --clean-index: directories an aged clean need not read again */
+static struct clean_index *clean_index = NULL;
+static char *clean_index_path = NULL;
+static unsigned long cidx_scanned = 0, cidx_skipped = 0;
+
+/* --trash: where D and R move what they remove, see trash.h. read without
+ * --trash too if its list is there, so that what an earlier run left is
+ * deleted */
+static struct trash *trash = NULL;
+static char *trash_path = NULL;
+
+/* --daemon: files left by a clean, deleted as they fall due */
+static struct expiry_heap expiries = { NULL, 0, 0 };
+static time_t expiries_overflow = 0;
+
+/* --daemon: inotify watches on the directories cleaned, so new files are
+ * found without walking again. the daily clean is still needed, for any that
+ * could not be added and anything else the watches and expiries miss */
+static struct watch_set *dir_watches = NULL;
+
+/* --free-target: the oldest files left by a clean, deleted until each file
+ * system has this percentage free. due holds the negated mtime, so that the
+ * youngest is at the top and is the one dropped once the heap is full */
+static int opt_free_target = 0;
+static struct expiry_heap evictions = { NULL, 0, 0 };
+static bool evictions_dropped = false;
+
+/* --plan: what the rule being applied would have done, added to from
+ * clean_pool threads, and what each rule did */
+struct plan_result {
+    size_t rule;            /* index into rules */
+    unsigned long scanned;
+    unsigned long dirs;
+    unsigned long files;
+    uint64_t bytes;
+    struct timespec time;
+};
+
+static bool plan_json = false;
+static atomic_ulong plan_scanned, plan_dirs, plan_files;
+static atomic_uint_fast64_t plan_bytes;
+static struct timespec plan_start;
+static struct plan_result *plan_results = NULL;
+static size_t plan_count = 0, plan_cap = 0;
+
+/* protects expiries, evictions and dir_watches from clean_pool threads */
+static pthread_mutex_t notes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the config files as parsed at start up (or SIGHUP), applied again by each
+ * later pass of --daemon or --free-target. rules_warned is set if a line
+ * could not be fully parsed, so that they are not saved with --rule-cache */
+static struct ruleset rules;
+static bool rules_read = false, rules_warned = false;
+static unsigned long rules_dropped = 0;
+static char *rule_cache_path = NULL;
+static uint64_t rules_key = 0;
+static bool rules_unsaved = false;
+
+/* user and group lookups, for vet_uid(), vet_gid() and expand_path() */
+static struct nss_cache *nss = NULL;
+
+/* the directories read by the glob lines, kept while only glob lines run */
+static struct pathglob *globber = NULL;
+static bool globber_stale = true;
 
 /* constants */
 
 static const struct config_element configuration[] = {
     [0x00] = { 0, 0, 0 },
 
-    ['f']  = { CREAT_FILE   , CFG_STAT|CFG_PLUS            , ARG_CONTENT        } ,
+    ['f']  = { CREAT_FILE   , CFG_STAT|CFG_PLUS|CFG_OWNS   , ARG_CONTENT        } ,
     /* tmpfiles.d(5) implies [w] is glob in the description, but not the config summary */
-    ['w']  = { WRITE_ARG    , CFG_STAT|CFG_FOLLOW|CFG_PLUS|CFG_GLOB , ARG_CONTENT        } ,
-    ['d']  = { MKDIR        , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['D']  = { MKDIR_RMF    , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['e']  = { ADJUST       , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['v']  = { CREATE_SVOL  , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['q']  = { CREATE_SVOL2 , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['Q']  = { CREATE_SVOL3 , CFG_STAT|CFG_AGE             , 0                  } ,
-    ['p']  = { CREATE_PIPE  , CFG_STAT|CFG_PLUS            , 0                  } ,
-    ['L']  = { CREATE_SYM   , CFG_PLUS                     , ARG_SYMLINK_TARGET } ,
-    ['c']  = { CREATE_CHAR  , CFG_STAT|CFG_PLUS            , ARG_NODE           } ,
-    ['b']  = { CREATE_BLK   , CFG_STAT|CFG_PLUS            , ARG_NODE           } ,
-    ['C']  = { COPY         , CFG_AGE                      , ARG_SOURCE         } ,
+    ['w']  = { WRITE_ARG    , CFG_STAT|CFG_FOLLOW|CFG_PLUS|CFG_GLOB|CFG_OWNS , ARG_CONTENT        } ,
+    ['d']  = { MKDIR        , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['D']  = { MKDIR_RMF    , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['e']  = { ADJUST       , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['v']  = { CREATE_SVOL  , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['q']  = { CREATE_SVOL2 , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['Q']  = { CREATE_SVOL3 , CFG_STAT|CFG_AGE|CFG_OWNS    , 0                  } ,
+    ['p']  = { CREATE_PIPE  , CFG_STAT|CFG_PLUS|CFG_OWNS   , 0                  } ,
+    ['L']  = { CREATE_SYM   , CFG_PLUS|CFG_OWNS            , ARG_SYMLINK_TARGET } ,
+    ['c']  = { CREATE_CHAR  , CFG_STAT|CFG_PLUS|CFG_OWNS   , ARG_NODE           } ,
+    ['b']  = { CREATE_BLK   , CFG_STAT|CFG_PLUS|CFG_OWNS   , ARG_NODE           } ,
+    ['C']  = { COPY         , CFG_AGE|CFG_OWNS             , ARG_SOURCE         } ,
     /* tmpfiles.d(5) implies [xX] is glob in the description, but not the config summary */
     ['x']  = { IGN          , CFG_AGE|CFG_GLOB             , 0                  } ,
     ['X']  = { IGNR         , CFG_AGE|CFG_GLOB             , 0                  } ,
     /* tmpfiles.d(5) implies [rR] is glob in the description, but not the config summary */
-    ['r']  = { RM           , 0                            , 0                  } ,
-    ['R']  = { RMRF         , 0                            , 0                  } ,
+    ['r']  = { RM           , CFG_OWNS                     , 0                  } ,
+    ['R']  = { RMRF         , CFG_OWNS                     , 0                  } ,
     ['z']  = { CHMOD        , CFG_STAT|CFG_GLOB            , 0                  } ,
     ['Z']  = { CHMODR       , CFG_STAT|CFG_GLOB            , 0                  } ,
     ['t']  = { CHXATTR      , CFG_STAT|CFG_GLOB            , ARG_XATTR          } ,
@@ -179,6 +291,15 @@ static const struct option long_options[] = {
     {"prefix",          required_argument,  0,              'p'},
     {"exclude-prefix",  required_argument,  0,              'e'},
     {"root",            required_argument,  0,              'r'},
+    {"jobs",            required_argument,  0,              'j'},
+    {"io-uring",        no_argument,        &do_uring,      true},
+    {"clean-index",     no_argument,        &do_clean_index, true},
+    {"daemon",          no_argument,        &do_daemon,     true},
+    {"free-target",     required_argument,  0,              'f'},
+    {"rule-cache",      no_argument,        &do_rule_cache, true},
+    {"plan",            optional_argument,  0,              'P'},
+    {"trash",           no_argument,        &do_trash,      true},
+    {"destroy-subvolumes", no_argument,     &do_destroy_subvols, true},
     {"help",            no_argument,        &do_help,       true},
     {"version",         no_argument,        &do_version,    true},
     {"debug",           no_argument,        &debug,         true},
@@ -191,6 +312,41 @@ static const char   cfg_ext[]   = ".conf";
 static const char   default_opt_root[] = "";
 static const size_t cfg_ext_len = sizeof(cfg_ext);
 
+/* sub-directories queued on clean_pool per thread before walking inline */
+static const size_t max_queued_per_job = 64;
+
+/* directory entries read, and syscalls submitted, at once with clean_ring */
+static const unsigned clean_ring_entries = 64;
+
+static const char clean_index_file[] = LOCALSTATEDIR "/lib/tmpfilesd/clean.idx";
+static const char rule_cache_file[]  = LOCALSTATEDIR "/cache/tmpfilesd/rules.bin";
+static const char trash_file[]       = LOCALSTATEDIR "/lib/tmpfilesd/trash.list";
+
+/* the directories config files are read from, in order */
+static const char *const config_dirs[] = {
+    "/etc/tmpfiles.d",
+    "/run/tmpfiles.d",
+    "/usr/lib/tmpfiles.d",
+    NULL
+};
+
+/* vet_uid() and vet_gid() are cached with the rules, so changes to these
+ * also mean parsing the config files again */
+static const char *const nss_files[] = {
+    "/etc/passwd",
+    "/etc/group",
+    "/etc/nsswitch.conf",
+    NULL
+};
+
+/* --daemon: how often to look for new files, and how many to track */
+static const time_t daemon_rescan_interval = 24 * 60 * 60;
+static const size_t max_expiries = 1 << 20;
+static const size_t max_watches = 1 << 16;
+
+/* --free-target: how many of the oldest files to consider at once */
+static const size_t max_evictions = 1 << 16;
+
 static const mode_t def_file_mode   = S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
 static const mode_t def_folder_mode = def_file_mode|S_IXUSR|S_IXGRP|S_IXOTH;
 
@@ -242,6 +398,20 @@ static int is_dot(const char *path)
 	return false;
 }
 
+/* does name end in cfg_ext (and have more to it than that) */
+__attribute__((nonnull, access(read_only, 1)))
+static bool is_config_file(const char *name)
+{
+    size_t len;
+
+    if (is_dot(name))
+        return false;
+    if ((len = strlen(name)) <= cfg_ext_len)
+        return false;
+
+    return !strncmp(name + len - cfg_ext_len + 1, cfg_ext, cfg_ext_len);
+}
+
 __attribute__((nonnull, access(read_only, 1), access(read_only, 2)))
 static char *pathcat(const char *a, const char *b)
 {
@@ -301,6 +471,21 @@ static void show_help(void)
             "      --prefix=PATH          only apply rules with a matching path\n"
             "      --exclude-prefix=PATH  ignores rules with paths that match\n"
             "      --root=ROOT            all paths including config will be prefixed\n"
+            "      --jobs=N               use N threads to apply rules, and to clean\n"
+            "                             and copy directories\n"
+            "      --io-uring             batch cleaning syscalls with io_uring\n"
+            "      --clean-index          skip reading unchanged directories when\n"
+            "                             cleaning by age\n"
+            "      --daemon               stay resident, cleaning files as they expire\n"
+            "      --free-target=PCT%%     then delete the oldest files until PCT%% is free\n"
+            "      --rule-cache           keep the parsed config files, and use them\n"
+            "                             while none have changed\n"
+            "      --plan[=json]          change nothing, but show what --clean and\n"
+            "                             --remove would scan and delete, per rule\n"
+            "      --trash                move what D and R remove aside, and delete\n"
+            "                             it in the background\n"
+            "      --destroy-subvolumes   let D and R destroy a btrfs subvolume whole,\n"
+            "                             rather than by removing what is in it\n"
             "\n"
           );
 }
@@ -363,14 +548,17 @@ static uid_t vet_uid(const char *t, bool *defuid)
     if (isnumber(t))
         return atol(t);
 
-    struct passwd *pw;
+    uid_t uid;
 
-    if ((pw = getpwnam(t)) == NULL) {
-        warn("vet_uid: getpwnam");
+    if (nss_uid(nss, t, &uid)) {
+        if (errno == ENOENT)
+            warnx("vet_uid: nss_uid: %s: no such user", t);
+        else
+            warn("vet_uid: nss_uid: %s", t);
         return -1;
     }
 
-    return pw->pw_uid;
+    return uid;
 }
 
 /*
@@ -389,14 +577,17 @@ static gid_t vet_gid(const char *t, bool *defgid)
     if (isnumber(t))
         return atol(t);
 
-    struct group *gr;
+    gid_t gid;
 
-    if ((gr = getgrnam(t)) == NULL) {
-        warn("vet_gid: getgrnam");
+    if (nss_gid(nss, t, &gid)) {
+        if (errno == ENOENT)
+            warnx("vet_gid: nss_gid: %s: no such group", t);
+        else
+            warn("vet_gid: nss_gid: %s", t);
         return -1;
     }
 
-    return gr->gr_gid;
+    return gid;
 }
 
 __attribute__((warn_unused_result))
@@ -562,146 +753,159 @@ static mode_t vet_mode(const char *t, mode_t *mask, bool *defmode, bool *create_
     return (mode_t) ret;
 }
 
-/* TODO stop doing free(path) as pointer may be reused by callers */
-__attribute__((nonnull, warn_unused_result))
-static char *expand_path(char *path)
+/* the value of the specifier %c, or NULL if it has none */
+__attribute__((warn_unused_result))
+static const char *specifier(unsigned char c)
 {
-    const int buf_len = 1024;
-
-    char *buf;
-    char *ptr = path;
-    const char *cpy;
-    char *free_me;
-    char tmp;
-    int spos = 0, dpos = 0;
-    char string[BUFSIZ];
-
-    if (!*path)
-        return path;
-
-    if ((buf = calloc(1, buf_len)) == NULL)
-        err(EXIT_FAILURE, "expand_path: calloc");
+    const char *val = NULL, *ign;
 
-    ptr = path;
+    if (specifiers_set[c])
+        return specifiers[c];
 
-    while((tmp = ptr[spos]) && dpos < buf_len)
+    switch (c)
     {
-        if (tmp != '%') {
-            buf[dpos++] = ptr[spos++];
-            continue;
-        }
+        case 'b': /* Boot ID */
+            val = getbootid();
+            break;
 
-        tmp = ptr[++spos];
-        if (dpos >= buf_len || !tmp)
-            continue;
+        case 'm': /* Machine ID */
+            val = getmachineid();
+            break;
 
-        cpy = NULL;
-        free_me = NULL;
+        case 'H': /* Host name */
+            val = gethost();
+            break;
 
-        switch (tmp)
-        {
-            case '%':
-                buf[dpos++] = ptr[spos];
-                break;
+        case 'v': /* Kernel release */
+            val = getkernelrelease();
+            break;
 
-            case 'b': /* Boot ID */
-                cpy = getbootid();
+        case 'g': /* User group */
+            if (nss_group(nss, getgid(), &val) == 0)
                 break;
+            /* fall through */
 
-            case 'm': /* Machine ID */
-                cpy = getmachineid();
-                break;
+        case 'G': /* User GID */
+            snprintf(spec_gid, sizeof(spec_gid), "%u", getgid());
+            val = spec_gid;
+            break;
 
-            case 'H': /* Host name */
-                cpy = gethost();
-                break;
+        case 'L': /* system or TODO user log */
+            val = "/var/log";
+            break;
 
-            case 'v': /* Kernel release */
-                cpy = getkernelrelease();
-                break;
+        case 'h': /* user home directory */
+            if (nss_user(nss, getuid(), &ign, &val) || val == NULL) {
+                warn("expand_path: NULL $HOME");
+                val = NULL;
+            }
+            break;
 
-            case 'g': /* User group */
-                {
-                    struct group *grp;
-                    if ((grp = getgrgid(getgid())) != NULL) {
-                        cpy = grp->gr_name;
-                    } else {
-print_gid:
-                        snprintf(string, sizeof(string), "%u", getgid());
-                        cpy = string;
-                    }
-                }
-                break;
+        case 'u': /* username */
+            if (nss_user(nss, getuid(), &val, &ign) || val == NULL) {
+                warn("expand_path: NULL $USERNAME");
+                val = NULL;
+            }
+            break;
 
-            case 'G': /* User GID */
-                goto print_gid;
+        case 'U': /* UID */
+            snprintf(spec_uid, sizeof(spec_uid), "%u", getuid());
+            val = spec_uid;
+            break;
 
-            case 'L': /* system or TODO user log */
-                cpy = "/var/log";
-                break;
+        case 'C': /* $XDG_CACHE_HOME in --user or /var/cache */
+            val = "/var/cache";
+            break;
 
-            case 'h': /* user home directory */
-                {
-                    struct passwd *pwd;
+        case 'V': /* tmp folder */
+            if (       (val = getenv("TMPDIR")) == NULL
+                    && (val = getenv("TEMP"))   == NULL
+                    && (val = getenv("TMP"))    == NULL
+               ) {
+                val = "/var/tmp";
+            }
+            break;
 
-                    if ((pwd = getpwuid(getuid())) == NULL) {
-                        warn("expand_path: NULL $HOME");
-                        continue;
-                    }
+        default:
+            warnx("Unhandled expansion <%c>", isprint(c) ? c : '?');
+            val = "";
+            break;
+    }
 
-                    cpy = pwd->pw_dir;
-                }
-                break;
+    specifiers_set[c] = true;
+    specifiers[c] = val;
+    return val;
+}
 
-            case 'u': /* username */
-                {
-                    struct passwd *pwd;
+/* appends len bytes of src to buf, growing it as needed */
+__attribute__((nonnull, warn_unused_result))
+static int expand_append(char **buf, size_t *len, size_t *cap,
+        const char *src, size_t src_len)
+{
+    if (*len + src_len + 1 > *cap) {
+        size_t new_cap = *cap * 2;
+        char *tmp;
 
-                    if ((pwd = getpwuid(getuid())) == NULL) {
-                        warn("expand_path: NULL $USERNAME");
-                        continue;
-                    }
+        while (*len + src_len + 1 > new_cap)
+            new_cap *= 2;
 
-                    cpy = pwd->pw_name;
-                }
-                break;
+        if ((tmp = realloc(*buf, new_cap)) == NULL)
+            return -1;
 
-            case 'U': /* UID */
-                snprintf(string, sizeof(string), "%u", getuid());
-                cpy = string;
-                break;
+        *buf = tmp;
+        *cap = new_cap;
+    }
 
-            case 'C': /* $XDG_CACHE_HOME in --user or /var/cache */
-                cpy = "/var/cache";
-                break;
+    memcpy(*buf + *len, src, src_len);
+    *len += src_len;
+    (*buf)[*len] = '\0';
+    return 0;
+}
 
-            case 'V': /* tmp folder */
-                if (       (cpy = getenv("TMPDIR")) == NULL
-                        && (cpy = getenv("TEMP"))   == NULL
-                        && (cpy = getenv("TMP"))    == NULL
-                   ) {
-                    cpy = "/var/tmp";
-                }
-                break;
+/* returns a new string, which must be free(3)d, or NULL if a specifier in
+ * path could not be resolved */
+__attribute__((nonnull, warn_unused_result))
+static char *expand_path(const char *path)
+{
+    const char *ptr, *pct, *val;
+    char *buf;
+    size_t len = 0, cap = strlen(path) + 64;
 
-            default:
-                warnx("Unhandled expansion <%c>\n", isprint(tmp) ? tmp : '?');
-                break;
-        }
+    if ((buf = malloc(cap)) == NULL) {
+        warn("expand_path: malloc");
+        return NULL;
+    }
+    *buf = '\0';
 
-        if (cpy) {
-            strncpy(buf + dpos, cpy, buf_len - dpos);
-            dpos += strlen(cpy);
-        }
+    for (ptr = path; *ptr; ptr = pct + 2)
+    {
+        if ((pct = strchr(ptr, '%')) == NULL)
+            pct = ptr + strlen(ptr);
+
+        if (expand_append(&buf, &len, &cap, ptr, pct - ptr))
+            goto fail;
+
+        /* a trailing % is dropped */
+        if (pct[0] == '\0' || pct[1] == '\0')
+            break;
 
-        if (free_me)
-            free(free_me);
+        if (pct[1] == '%')
+            val = "%";
+        else if ((val = specifier(pct[1])) == NULL) {
+            free(buf);
+            return NULL;
+        }
 
-        spos++;
+        if (expand_append(&buf, &len, &cap, val, strlen(val)))
+            goto fail;
     }
 
-    free(path);
     return buf;
+
+fail:
+    warn("expand_path: realloc");
+    free(buf);
+    return NULL;
 }
 
 /*
@@ -710,22 +914,17 @@ print_gid:
  * %H - Host name
  * %v - Kernel release (uname -r)
  * %% - %
+ *
+ * returns path itself if there is nothing to expand, otherwise a new string
+ * which must be free(3)d, or NULL if it could not be expanded
  */
 __attribute__((nonnull, warn_unused_result, access(read_only, 1)))
-static char *vet_path(const char *path)
+static const char *vet_path(const char *path)
 {
-    char *tmppath;
-
-    if ((tmppath = strdup(path)) == NULL) {
-        warn("vet_path: strdup");
-        return NULL;
-    }
-
-    if (strchr(path, '%')) {
-        return(expand_path(tmppath));
-    }
+    if (!strchr(path, '%'))
+        return path;
 
-    return tmppath;
+    return expand_path(path);
 }
 
 /*
@@ -738,8 +937,9 @@ static char *vet_path(const char *path)
  * but not the files and directories immediately inside it.
  */
 
-__attribute__((nonnull, warn_unused_result, access(read_only, 1), access(write_only, 2)))
-static struct timeval *vet_age(const char *t, int *subonly)
+__attribute__((nonnull, warn_unused_result, access(read_only, 1), access(write_only, 2),
+            access(write_only, 3)))
+static struct timeval *vet_age(const char *t, int *subonly, struct timeval *tv)
 {
     if (*t == '-') {
         errno = EINVAL;
@@ -747,8 +947,8 @@ static struct timeval *vet_age(const char *t, int *subonly)
     }
 
     uint64_t val;
-    int len, ret;
-    char *tmp = NULL;
+    long ret;
+    char *tmp;
     const char *src = t;
 
     if (*src == '~') {
@@ -757,16 +957,14 @@ static struct timeval *vet_age(const char *t, int *subonly)
     } else
         *subonly = 0;
 
-    len = sscanf(src, "%d%ms", &ret, &tmp);
+    ret = strtol(src, &tmp, 10);
 
-    if (len == EOF || len == 0 || len > 2) {
-        if (tmp) 
-            free(tmp);
+    if (tmp == src) {
         warnx("vet_age: invalid age: %s\n", t);
         return NULL;
     }
 
-    if (!tmp || !*tmp) {
+    if (!*tmp) {
         val = (uint64_t)ret * 1000000;
     } else if (!strcmp(tmp, "ms")) {
         val = (uint64_t)ret * 1000;
@@ -781,154 +979,100 @@ static struct timeval *vet_age(const char *t, int *subonly)
     } else if (!strcmp(tmp, "w")) {
         val = (uint64_t)ret * 1000000 * 60 * 60 * 24 * 7;
     } else {
-        if (tmp)
-            free(tmp);
         warnx("vet_age: invalid age: %s\n", t);
         return NULL;
     }
 
-    struct timeval *tv;
-
-    if ((tv = malloc(sizeof(struct timeval))) == NULL) {
-        warn("vet_age: malloc");
-        if (tmp)
-            free(tmp);
-
-        return NULL;
-    }
-
     tv->tv_sec  = (time_t)(val / 1000000);
     tv->tv_usec = (suseconds_t)(val % 1000000);
 
-    if (tmp)
-        free(tmp);
-
     return tv;
 }
 
+/* matches must be freed with pathglob_free(). fails with ENOENT if there
+ * are none */
 __attribute__((nonnull, warn_unused_result, access(read_only, 1), access(write_only, 2),
-            access(write_only, 3), access(write_only, 4)))
-static int glob_file(const char *path, char ***matches, size_t *count,
-        glob_t **pglob)
+            access(write_only, 3)))
+static int glob_file(const char *path, char ***matches, size_t *count)
 {
-    int r;
+    struct stat sb;
 
-    errno = 0;
+    /* nothing to match, so as glob(3) would */
+    if (strpbrk(path, PATHGLOB_MAGIC) == NULL) {
+        *matches = NULL;
+        *count = 0;
 
-    if (*pglob == NULL && (*pglob = calloc(1, sizeof(glob_t))) == NULL) {
-        warn("glob_file: calloc");
-        return -1;
+        if (lstat(path, &sb) == -1) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        if ((*matches = malloc(sizeof(char *))) == NULL ||
+                (**matches = strdup(path)) == NULL) {
+            free(*matches);
+            *matches = NULL;
+            warn("glob_file: malloc");
+            return -1;
+        }
+
+        *count = 1;
+        return 0;
     }
 
-    if ((r = glob(path, GLOB_NOSORT, NULL, *pglob))) {
-        if (r != GLOB_NOMATCH) {
-            warnx("glob returned %u", r);
-            if (r == GLOB_NOSPACE)
-                errno = ENOMEM;
-            else if (r == GLOB_ABORTED)
-                errno = EIO;
-        } else
-            errno = ENOENT;
+    /* anything other than a glob line may have changed what was read */
+    if (globber_stale) {
+        pathglob_flush(globber);
+        globber_stale = false;
+    }
 
-        globfree(*pglob);
-        free(*pglob);
+    return pathglob_match(globber, path, matches, count);
+}
 
-        *pglob = NULL;
-        *matches = NULL;
-        *count = 0;
-        r = -1;
-    } else {
-        *matches = (**pglob).gl_pathv;
-        *count = (**pglob).gl_pathc;
-        r = 0;
+/* the CLOCK_MONOTONIC time since start */
+__attribute__((nonnull, warn_unused_result, access(read_only, 1)))
+static struct timespec elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now.tv_sec -= start->tv_sec;
+    now.tv_nsec -= start->tv_nsec;
+    if (now.tv_nsec < 0) {
+        now.tv_sec--;
+        now.tv_nsec += 1000000000L;
     }
 
-    return r;
+    return now;
 }
 
-/* TODO what mode_t for the created file? */
 __attribute__((nonnull, warn_unused_result, access(read_only, 1), access(read_only, 2)))
 static int copy_one_file(const char *src, const char *dst)
 {
     struct stat sb;
-    int rc;
-    int fd_src = -1, fd_dst = -1;
-    
-    rc = stat(dst, &sb);
 
-    if (rc == -1 && errno != ENOENT) {
-        /* ??? */
-        return -1;
-    } else if (rc != -1) {
+    if (lstat(dst, &sb) == 0) {
         if (debug)
             printf("DEBUG: copy_one_file: skip file %s as destination exists\n", src);
         return 0;
-    }
-
-    if (dst[strlen(dst) - 1] == '/') {
-        /* TODO */
-        errno = ENOSYS;
-        warn("copy_one_file: trying to create a folder: %s", dst);
-        goto fail;
-    }
-
-    if ((fd_src = open(src, O_RDONLY)) == -1)
-        goto fail;
-
-    if (fstat(fd_src, &sb) == -1)
-        goto fail;
-
-    if (!S_ISREG(sb.st_mode)) {
-        errno = EBADF;
-        goto fail;
-    }
-
-    /* avoid race condition where stat == ENOENT .. file created .. open() */
-    if ((fd_dst = open(dst, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1) {
-        if (errno == EEXIST) {
-            close(fd_src);
-            return 0;
-        }
-        goto fail;
-    }
-
-    char buf[BUFSIZ * 4];
-    ssize_t len;
-
-    while ((len = read(fd_src, buf, sizeof(buf))) > 0)
-    {
-        if (write(fd_dst, buf, len) == -1)
-            goto fail;
-    }
+    } else if (errno != ENOENT)
+        return -1;
 
-    if (len == -1)
-        goto fail;
+    if (copy_file(src, dst))
+        return -1;
 
     if (debug)
         printf("DEBUG: copy_one_file: cp %s %s\n", src, dst);
 
-    close(fd_src);
-    close(fd_dst);
-
     return 0;
-
-fail:
-    if (fd_src != -1)
-        close(fd_src);
-    if (fd_dst != -1)
-        close(fd_dst);
-    /* TODO unlink partial files? */
-
-    return -1;
 }
 
+/* copies src to dst, or into dst if it is a directory, see copy_tree() */
 __attribute__((nonnull, warn_unused_result, access(read_only, 1), access(read_only, 2)))
 static int copy_src_dir(const char *src, const char *dst)
 {
+    struct timespec start, took;
     struct stat sb;
-    char path_src[PATH_MAX];
-    char path_dst[PATH_MAX];
-    DIR *dirp;
+    char *path_dst, *tmp_src;
     int rc;
 
     /* check src exists */
@@ -942,1137 +1086,3017 @@ static int copy_src_dir(const char *src, const char *dst)
         return -1;
     } 
 
-    /* two scenarios: src is a file, or src is a folder */
+    /* src is a folder */
 
-    if (!S_ISDIR(sb.st_mode)) { 
+    if (S_ISDIR(sb.st_mode)) {
+        if (debug)
+            clock_gettime(CLOCK_MONOTONIC, &start);
 
-        /* src is a file */
-        
-        if ((rc = stat(dst, &sb)) == -1 && errno != ENOENT) {
-            /* ??? */
+        if (copy_tree(src, dst, copy_pool)) {
+            warn("copy_src_dir: copy_tree: %s", src);
             return -1;
-        } else if (rc == -1) { /* ENOENT */
-            return copy_one_file(src, dst);
-        } else if (!S_ISDIR(sb.st_mode)) {
-            if (debug)
-                printf("DEBUG: copy_src_dir: skipping %s as destination already present\n", src);
-            return 0;
-        } else if (rc != -1) { /* S_ISDIR() == true */
-            char *tmp_src;
+        }
 
-            if ((tmp_src = strdup(src)) == NULL) {
-                warn("copy_src_dir: strdup(src)");
-                return -1;
-            }
+        if (debug) {
+            took = elapsed(&start);
+            printf("DEBUG: copy_tree(%s): %d job(s) %ld.%06lds\n", src, opt_jobs,
+                    (long)took.tv_sec, took.tv_nsec / 1000L);
+        }
 
-            snprintf(path_dst, sizeof(path_dst), "%s/%s", dst, basename(tmp_src));
-            free(tmp_src);
+        return 0;
+    }
 
-            return copy_one_file(path_dst, src);
-        }
-    } 
+    /* src is a file */
 
-    /* src is a folder */
+    if ((rc = stat(dst, &sb)) == -1 && errno != ENOENT) {
+        /* ??? */
+        return -1;
+    } else if (rc == -1) { /* ENOENT */
+        return copy_one_file(src, dst);
+    } else if (!S_ISDIR(sb.st_mode)) {
+        if (debug)
+            printf("DEBUG: copy_src_dir: skipping %s as destination already present\n", src);
+        return 0;
+    }
+
+    /* dst is a folder, so the file goes in it */
 
-    if ((dirp = opendir(src)) == NULL) {
-        warn("copy_src_dir: opendir(src): %s", src);
+    if ((tmp_src = strdup(src)) == NULL) {
+        warn("copy_src_dir: strdup(src)");
         return -1;
     }
 
-    struct dirent *ent;
+    path_dst = pathcat(dst, basename(tmp_src));
+    free(tmp_src);
 
-    while ((ent = readdir(dirp)) != NULL)
-    {
-        if (!strcmp(ent->d_name, ".")) continue;
-        if (!strcmp(ent->d_name, "..")) continue;
+    if (path_dst == NULL)
+        return -1;
 
-        snprintf(path_src, sizeof(path_src), "%s/%s", src, ent->d_name);
-        snprintf(path_dst, sizeof(path_dst), "%s/%s", dst, ent->d_name);
+    rc = copy_one_file(src, path_dst);
+    free(path_dst);
 
-        if (stat(path_src, &sb) == -1) {
-            if (errno != ENOENT)
-                warn("copy_src_dir: stat(path_src): %s", path_src);
-            continue;
-        }
+    return rc;
+}
 
-        const bool cur_src_dir = !!S_ISDIR(sb.st_mode);
+/* a directory being walked by rm_rf(), the full path of an entry is only
+ * assembled (via walk_path) when it is needed for a message or an ignore
+ * check */
+struct walk_dir {
+    const struct walk_dir *parent;
+    const char *name;
+};
 
-        /* dirent is a file */
+__attribute__((access(read_only, 1)))
+static size_t walk_path_len(const struct walk_dir *dir)
+{
+    if (dir == NULL)
+        return 0;
 
-        if (!cur_src_dir) {
-            if (copy_one_file(path_src, path_dst))
-                warn("copy_src_dir: copy_one_file");
-            continue;
-        }
+    return walk_path_len(dir->parent) + strlen(dir->name) + 1;
+}
 
-        /* dirent is a folder */
+__attribute__((access(read_only, 1), access(write_only, 2)))
+static char *walk_path_fill(const struct walk_dir *dir, char *dst)
+{
+    size_t len;
 
-        rc = stat(path_dst, &sb);
+    if (dir == NULL)
+        return dst;
 
-        if (rc == -1 && errno == ENOENT) {
-        } else if (rc == -1) {
-            /* ??? */
-        } else { /* rc != -1 */
-            if (debug)
-                printf("DEBUG: copy_src_dir: skip folder %s as destination exists\n", path_src);
-            continue;
-        }
+    dst = walk_path_fill(dir->parent, dst);
+    len = strlen(dir->name);
+    memcpy(dst, dir->name, len);
+    dst += len;
 
-        if (mkdir(path_dst, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1) {
-            warn("DEBUG: copy_src_dir: mkdir(path_dst): %s", path_dst);
-        }
+    if (len == 0 || dir->name[len - 1] != '/')
+        *dst++ = '/';
 
-        if (debug) {
-            printf("DEBUG: copy_src_dir: mkdir %s\n", path_dst);
-            printf("DEBUG: copy_src_dir: recursion into %s\n", path_src);
-        }
-            
-        if (copy_src_dir(path_src, path_dst))
-            warn("copy_src_dir: copy_src_dir");
+    return dst;
+}
+
+/* returns the full path of name inside dir (or name if dir is NULL), which
+ * must be free(3)d by the caller */
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static char *walk_path(const struct walk_dir *dir, const char *name)
+{
+    size_t len = strlen(name);
+    char *ret, *ptr;
+
+    if ((ret = malloc(walk_path_len(dir) + len + 1)) == NULL) {
+        warn("walk_path: malloc");
+        return NULL;
     }
 
-    closedir(dirp);
-    return 0;
+    ptr = walk_path_fill(dir, ret);
+    memcpy(ptr, name, len + 1);
+
+    return ret;
 }
 
-/* a wrapper function around unlink(3) that checks for ignored paths */
-__attribute__((nonnull,warn_unused_result, access(read_only, 1)))
-static int unlink_wrapper(const char *pathname, bool check_ignores)
+/* checks if name, relative to the directory described by dir, may be
+ * unlinked. the full path is only built if ignores or debug require it.
+ *
+ * returns 1 if it may, 0 if it is ignored (or --debug-unlink) and -1 on
+ * error */
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static int unlink_permitted(const struct walk_dir *dir, const char *name,
+        bool check_ignores)
 {
-    if (check_ignores) {
-        for (int i = 0; i < ignores_size; i++)
-            /* where contents is true, we check as a prefix otherwise the entire path */
-            if (ignores[i].contents && !strncmp(pathname, ignores[i].path, ignores[i].length))
-                return 0;
-            else if (!strcmp(pathname, ignores[i].path))
-                return 0;
-    }
+    char *pathname = NULL;
 
-    if (!strcmp("/", pathname) || !strcmp(".", pathname) || !strcmp("..", pathname))
+    if (!strcmp("/", name) || is_dot(name))
         errx(EXIT_FAILURE, "unlink: attempt to remove protected file");
 
+    if ((check_ignores && ignores.count) || debug) {
+        if ((pathname = walk_path(dir, name)) == NULL)
+            return -1;
+
+        if (!strcmp("/", pathname))
+            errx(EXIT_FAILURE, "unlink: attempt to remove protected file");
+    }
+
+    if (check_ignores && ignores.count && ignore_match(&ignores, pathname)) {
+        free(pathname);
+        return 0;
+    }
+
     if (debug) {
         printf("DEBUG: unlink(%s)\n", pathname);
-        if (debug_unlink)
+        if (debug_unlink) {
+            free(pathname);
             return 0;
+        }
     }
 
-    return unlink(pathname);
+    free(pathname);
+    return 1;
 }
 
-__attribute__((nonnull(1),warn_unused_result, access(read_only, 1), access(read_only, 2)))
-static int rm_if_old(const char *path, const struct timeval *tv, bool check_ignores)
+/* checks if everything below the directory name, inside the directory
+ * described by dir, is covered by an x line so that it need not be read, or
+ * (unless it is where the walk started) is cleaned by a line of its own */
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static bool is_pruned(const struct walk_dir *dir, const char *name, bool check_ignores)
 {
-    struct stat sb;
-    time_t now;
+    const struct walk_dir sub = { dir, name };
+    char *pathname;
+    bool ret;
 
-    if (lstat(path, &sb) == -1 ) {
-        warn("rm_if_old: lstat(%s)", path);
-        return -1;
-    }
+    if (!check_ignores || (!ignores.count && (!clean_roots.count || dir == NULL)))
+        return false;
 
-    now = time(NULL);
+    /* "dir/name/" as every entry below it will start with this */
+    if ((pathname = walk_path(&sub, "")) == NULL)
+        return false;
 
-#ifdef DEBUG
-    printf("%s mtime=%lu now=%lu age=%lu diff=%lu\n",
-            path,
-            sb.st_mtime,
-            now,
-            tv ? tv->tv_sec : 0,
-            now - sb.st_mtime);
-#endif
+    if ((ret = ignore_match_prefix(&ignores, pathname)) && debug)
+        printf("DEBUG: prune %s\n", pathname);
 
-    if (S_ISDIR(sb.st_mode)) {
-        errno = EISDIR;
-        warn("rm_if_old: folder(%s)", path);
-        return -1;
-    } else if ((tv == NULL) || ((now - sb.st_mtime) > tv->tv_sec)) {
-        return unlink_wrapper(path, check_ignores);
-    }
+    if (!ret && dir && (ret = ignore_match(&clean_roots, pathname)) && debug)
+        printf("DEBUG: prune %s, cleaned by its own line\n", pathname);
 
-    return 0;
+    free(pathname);
+    return ret;
 }
 
-__attribute__((nonnull(1), warn_unused_result, access(read_only, 1), access(read_only, 2)))
-static int rm_rf(const char *path, const struct timeval *tv,
-        bool check_ignores, bool follow_symlinks)
+/* a wrapper function around unlinkat(2) that checks for ignored paths.
+ *
+ * name is relative to dirfd, and dir describes dirfd for the purposes of
+ * building the full path */
+__attribute__((nonnull(3), warn_unused_result, access(read_only, 2), access(read_only, 3)))
+static int unlinkat_wrapper(int dirfd, const struct walk_dir *dir,
+        const char *name, bool check_ignores)
 {
-    /* protect some obvious errors */
-    if (!strcmp("/", path) || !strcmp(".", path) || !strcmp("..", path))
-        errx(EXIT_FAILURE, "rm_rf: attempt to remove protected file");
+    int rc;
+
+    if ((rc = unlink_permitted(dir, name, check_ignores)) != 1)
+        return rc;
+
+    if (do_plan) {
+        struct stat sb;
+
+        /* as unlinkat(2) would fail on a directory */
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+            return -1;
+        if (S_ISDIR(sb.st_mode)) {
+            errno = EISDIR;
+            return -1;
+        }
+
+        atomic_fetch_add(&plan_files, 1);
+        atomic_fetch_add(&plan_bytes, (uint64_t)sb.st_blocks * 512);
+        return 0;
+    }
+
+    return unlinkat(dirfd, name, 0);
+}
+
+/* a wrapper function around unlink(3) that checks for ignored paths */
+__attribute__((nonnull,warn_unused_result, access(read_only, 1)))
+static int unlink_wrapper(const char *pathname, bool check_ignores)
+{
+    return unlinkat_wrapper(AT_FDCWD, NULL, pathname, check_ignores);
+}
+
+__attribute__((nonnull(1), warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static bool is_expired(const struct stat *sb, const struct timeval *tv, time_t now)
+{
+    return (tv == NULL) || ((now - sb->st_mtime) > tv->tv_sec);
+}
+
+/* fills in ent (other than due and age) for name, inside dirfd (described by
+ * dir), so that it can be found again once the walk is over.
+ *
+ * returns -1 if it cannot be, or if it is ignored: ignores change with each
+ * config file, so have to be applied now */
+__attribute__((nonnull(3,5), warn_unused_result, access(read_only, 2), access(read_only, 3),
+            access(write_only, 5)))
+static int survivor_entry(int dirfd, const struct walk_dir *dir, const char *name,
+        bool check_ignores, struct expiry *ent)
+{
+    struct stat dsb;
+    char *slash;
+
+    if ((ent->path = walk_path(dir, name)) == NULL)
+        return -1;
+
+    if (check_ignores && ignores.count && ignore_match(&ignores, ent->path))
+        goto fail;
+
+    if ((slash = strrchr(ent->path, '/')) == NULL)
+        goto fail;
+
+    ent->name_off = slash + 1 - ent->path;
+
+    if (dirfd == AT_FDCWD) {
+        char save = ent->path[ent->name_off];
+
+        ent->path[ent->name_off] = '\0';
+        dirfd = stat(ent->path, &dsb);
+        ent->path[ent->name_off] = save;
+        if (dirfd == -1)
+            goto fail;
+    } else if (fstat(dirfd, &dsb) == -1)
+        goto fail;
 
-    char *buf = NULL;
+    ent->dev = dsb.st_dev;
+    ent->ino = dsb.st_ino;
+    ent->bytes = 0;
+
+    return 0;
+
+fail:
+    free(ent->path);
+    ent->path = NULL;
+    return -1;
+}
+
+/* opens the directory of the file recorded in ent, returning -1 if the path
+ * now leads somewhere else. *dirpath must be free(3)d by the caller */
+__attribute__((nonnull, warn_unused_result, access(read_only, 1), access(write_only, 2)))
+static int survivor_dir(const struct expiry *ent, char **dirpath)
+{
     struct stat sb;
-    DIR *d;
-    struct dirent *ent;
-    bool descend;
+    int dirfd;
 
-    if (lstat(path, &sb) == -1) {
-        warn("rm_rf: fstat(%s)", path);
+    if ((*dirpath = strndup(ent->path, ent->name_off)) == NULL)
         return -1;
-    }
 
-    /* if the target is:
-     * a directory: opendir & rm_rf() each entry
-     * a symlink:   rm_rf() the symlink
-     * otherwise:   rm_rf() the file
-     */
+    if ((dirfd = open(*dirpath, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        return -1;
 
-    if (!S_ISLNK(sb.st_mode) && S_ISDIR(sb.st_mode)) {
-        descend = true;
-    } else
-        descend = false;
+    if (fstat(dirfd, &sb) == -1 || sb.st_dev != ent->dev || sb.st_ino != ent->ino) {
+        close(dirfd);
+        return -1;
+    }
 
-    if (descend) {
-        if ((d = opendir(path)) == NULL) {
-            warn("rm_rf: opendir");
-            return -1;
+    return dirfd;
+}
+
+/* records name, inside dirfd (described by dir), which is not yet old enough
+ * to be cleaned: with --daemon so it can be deleted once it is, and with
+ * --free-target as a candidate for eviction */
+__attribute__((nonnull(3,4,5), access(read_only, 2), access(read_only, 3),
+            access(read_only, 4), access(read_only, 5)))
+static void note_survivor(int dirfd, const struct walk_dir *dir, const char *name,
+        const struct stat *sb, const struct timeval *tv, bool check_ignores)
+{
+    struct expiry ent;
+
+    if (do_daemon && !survivor_entry(dirfd, dir, name, check_ignores, &ent)) {
+        ent.due = sb->st_mtime + tv->tv_sec + 1;
+        ent.age = tv->tv_sec;
+
+        pthread_mutex_lock(&notes_lock);
+        if (expiries.count >= max_expiries || expiry_push(&expiries, &ent)) {
+            /* the next clean is brought forward to pick up what is dropped */
+            if (expiries_overflow == 0 || ent.due < expiries_overflow)
+                expiries_overflow = ent.due;
+            free(ent.path);
         }
+        pthread_mutex_unlock(&notes_lock);
+    }
 
-        while ( (ent = readdir(d)) )
-        {
-            if (is_dot(ent->d_name))
-                continue;
+    if (opt_free_target && S_ISREG(sb->st_mode) &&
+            !survivor_entry(dirfd, dir, name, check_ignores, &ent)) {
+        ent.due = -(time_t)sb->st_mtime;
+        ent.age = sb->st_mtime;
+        ent.bytes = (uint64_t)sb->st_blocks * 512;
 
-            if ((buf = pathcat(path, ent->d_name)) != NULL)
-            {
-                if (lstat(buf, &sb) == -1) {
-                    free(buf);
-                    continue;
-                }
+        pthread_mutex_lock(&notes_lock);
+        if (evictions.count >= max_evictions) {
+            struct expiry youngest;
 
-                if (rm_rf(buf, tv, check_ignores, follow_symlinks))
-                    warnx("rm_rf: rm_rf(%s)", buf);
+            evictions_dropped = true;
 
-                free(buf);
-            } else {
-                /* TODO need a warn() here? */
-            }
+            if (ent.due > evictions.items[0].due && !expiry_pop(&evictions, &youngest))
+                free(youngest.path);
+        }
+        if (evictions.count >= max_evictions || expiry_push(&evictions, &ent)) {
+            evictions_dropped = true;
+            free(ent.path);
         }
+        pthread_mutex_unlock(&notes_lock);
+    }
+}
 
-        closedir(d);
+/* --daemon: watches dirfd (described by dir) for new files to clean */
+__attribute__((nonnull(2), access(read_only, 2), access(read_only, 3)))
+static void watch_note(int dirfd, const struct walk_dir *dir, const struct timeval *tv,
+        bool check_ignores)
+{
+    struct stat sb;
+    char *path;
 
-        if (errno)
-            return -1;
-        return 0;
-    } else {
-        /* is not a folder */
-        return rm_if_old(path, tv, check_ignores);
-    }
+    if (dir_watches == NULL || tv == NULL)
+        return;
 
-    /* FIXME check how age checking on symbolic links should be handled */
+    if (fstat(dirfd, &sb) == -1 || (path = walk_path(dir, "")) == NULL)
+        return;
+
+    pthread_mutex_lock(&notes_lock);
+    if (watch_add(dir_watches, path, sb.st_dev, sb.st_ino, tv->tv_sec,
+                (check_ignores && ignores.count) ? &ignores : NULL) && debug)
+        printf("DEBUG: watch_add(%s): %s\n", path, strerror(errno));
+    pthread_mutex_unlock(&notes_lock);
+
+    free(path);
 }
 
-/**
- * execute the action against a single path entry
- *
- * @param[in] act action to perform
- * @param[in] path path/glob (modified)
- * @param[in] age age setting
- * @param[in] arg argument
- * @param[in] mode,defmode,mask config settings for file mode
- * @param[in] defuid,uid config settings uid
- * @param[in] defgid,gid config settings gid
- * @param[in] rawpath unmodified path from config
- * @param[in] dev where act type is ARG_NODE, parsed dev_t
- *
- * @return 0 if OK, -1 for error
- */
-__attribute__((nonnull(2,14), warn_unused_result, access(read_only, 2), access(read_only, 3), access(read_only, 14)))
-static int execute_action(
-        char act, char *path, const struct timeval *age,
-        const char *arg,
-        mode_t mode, bool defmode, mode_t mask,
-        bool defuid, uid_t uid,
-        bool defgid, gid_t gid,
-        bool subonly,
-        int mod,
-        const char *rawpath,
-        dev_t dev)
+/* as rm_if_old(), but for an entry that has already been lstat(2)ed */
+__attribute__((nonnull(3,4), warn_unused_result, access(read_only, 2), access(read_only, 3),
+            access(read_only, 4), access(read_only, 5)))
+static int rm_if_old_at(int dirfd, const struct walk_dir *dir, const char *name,
+        const struct stat *sb, const struct timeval *tv, bool check_ignores)
 {
-    int fd  = -1;
-    int ret = 0;
-    int open_mode;
+    time_t now;
 
-    char *dest = NULL;
-    char *src  = NULL;
+    now = time(NULL);
 
-    switch(act)
+#ifdef DEBUG
     {
-        /* w - Write the argument parameter to a file
-         *
-         * Argument: Content to be written including C-style backslash escapes
-         * Path: glob
-         * Symlinks: followed
-         *
-         * Write to existing file, w+ append to existing file.
-         */
-        case WRITE_ARG:
-            if (do_create) {
-                /* TODO */
-
-                open_mode  = O_NOCTTY|O_WRONLY;
-                open_mode |= (mod & MOD_PLUS) ? O_APPEND : O_TRUNC;
+        char *path = walk_path(dir, name);
+        printf("%s mtime=%lu now=%lu age=%lu diff=%lu\n",
+                path ? path : name,
+                sb->st_mtime,
+                now,
+                tv ? tv->tv_sec : 0,
+                now - sb->st_mtime);
+        free(path);
+    }
+#endif
 
-                if ((fd = open(path, open_mode)) == -1) {
-                    warn("WRITE_ARG: open: <%s>", path);
-                    goto fail;
-                }
+    if (S_ISDIR(sb->st_mode)) {
+        char *path = walk_path(dir, name);
+        errno = EISDIR;
+        warn("rm_if_old: folder(%s)", path ? path : name);
+        free(path);
+        return -1;
+    } else if (is_expired(sb, tv, now)) {
+        return unlinkat_wrapper(dirfd, dir, name, check_ignores);
+    }
 
-                /* FIXME - escaping */
-                if (write(fd, arg, strlen(arg)) == -1) {
-                    warn("WRITE_ARG: write: <%s>", path);
-                    close(fd);
-                    goto fail;
-                }
+    note_survivor(dirfd, dir, name, sb, tv, check_ignores);
 
-                close(fd);
-            }
-            break;
+    return 0;
+}
 
-            /* r - Remove a file or directory if it exists (empty only) [remove]
-             * R - Recursively remove a path and all its subdirectories [remove]
-             *
-             * Mode: ignored
-             * UID, GID: ignored
-             * Age: ignored
-             */
-        case RM:
-        case RMRF:
-            if (!do_remove)
-                break;
+__attribute__((nonnull(1),warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static int rm_if_old(const char *path, const struct timeval *tv, bool check_ignores)
+{
+    struct stat sb;
 
-            if (act == RMRF) {
-                if (rm_rf(path, NULL, false, false))
-                    warn("RMRF: rmrf(%s)",path);
-            } else
-                if (unlink_wrapper(path, false) && errno != ENOENT)
-                    warn("RM: unlink(%s):", path);
+    if (lstat(path, &sb) == -1 ) {
+        warn("rm_if_old: lstat(%s)", path);
+        return -1;
+    }
 
-            break;
+    return rm_if_old_at(AT_FDCWD, NULL, path, &sb, tv, check_ignores);
+}
 
-            /* x - Ignore a path during cleaning (plus contents)
-             * X - Ignore a path during cleaning (ignores contents)
-             *
-             * Mode: ignored
-             * UID, GID: ignored
-             */
-        case IGN:
-        case IGNR:
-            {
-                ignent_t *new_ignores = realloc( ignores, (sizeof(ignent_t) * (ignores_size+1)) );
+/* a heap allocated walk_dir, used when a directory is handed to another
+ * thread of clean_pool and so can outlive the walk of its parent */
+struct walk_node {
+    struct walk_dir dir;
+    struct walk_node *parent;
+    atomic_uint refs;
+    int dirfd;
+    const struct timeval *tv;
+    bool check_ignores;
+    bool follow_symlinks;
+    char name[];
+};
 
-                if (new_ignores == NULL) {
-                    warn("IGN: realloc");
-                    goto fail;
-                }
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 2)))
+static struct walk_node *walk_node_new(struct walk_node *parent, const char *name,
+        int dirfd, const struct timeval *tv, bool check_ignores, bool follow_symlinks)
+{
+    struct walk_node *node;
+    size_t len = strlen(name);
 
-                ignores = new_ignores;
+    if ((node = malloc(sizeof(struct walk_node) + len + 1)) == NULL) {
+        warn("walk_node_new: malloc");
+        return NULL;
+    }
 
-                strncpy(ignores[ignores_size].path, path, PATH_MAX - 1);
-                ignores[ignores_size].contents = (act == IGN) ? true : false;
-                ignores[ignores_size].length   = strlen(ignores[ignores_size].path);
-                ignores_size++;
+    memcpy(node->name, name, len + 1);
+    node->dir.parent = parent ? &parent->dir : NULL;
+    node->dir.name = node->name;
+    node->parent = parent;
+    node->dirfd = dirfd;
+    node->tv = tv;
+    node->check_ignores = check_ignores;
+    node->follow_symlinks = follow_symlinks;
+    atomic_init(&node->refs, 1);
 
-                if (debug)
-                    printf("DEBUG: ignore/r %s\n", path);
-            }
-            break;
+    if (parent)
+        atomic_fetch_add(&parent->refs, 1);
 
-            /* z - Adjust the access mode, group and user, and restore the
-             *     SELinux security context (if it exists)
-             * Z - As above, recursively.
-             *
-             * Mode: NULL/- means do not change
-             * UID, GID: NULL/- means do not change
-             */
-        case CHMOD:
-        case CHMODR:
-            {
-                struct stat sb;
+    return node;
+}
 
-                if (do_create) {
-                    mode_t mmode = mode;
+static void walk_node_put(struct walk_node *node)
+{
+    struct walk_node *parent;
 
-                    if (defmode) {
-                        if (stat(path, &sb) == -1)
-                            warn("CHMOD: stat(%s)", path);
-                        else {
-                            if (S_ISDIR(sb.st_mode))
-                                mmode = def_folder_mode;
-                            else
-                                mmode = def_file_mode;
-                        }
-                    }
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1)
+    {
+        parent = node->parent;
+        free(node);
+        node = parent;
+    }
+}
 
-                    if (mask) {
-                        errno = ENOSYS;
-                        warn("chmod(%s,%o|%o)", path, mmode, mask);
-                    } else {
-                        if (debug)
-                            printf("DEBUG: chmod/r %s,%o", path, mmode);
+static int rm_rf_at(int dirfd, const struct walk_dir *dir, const struct timeval *tv,
+        bool check_ignores, bool follow_symlinks, struct walk_node *node);
 
-                        if (chmod(path, mmode))
-                            warn("CHMOD: chmod(%s,%o)", path, mmode);
-                    }
-                    /* FIXME is the logic around -1 right here ? */
-                    uid_t tmpuid = defuid ? (uid_t)-1 : uid;
-                    gid_t tmpgid = defgid ? (gid_t)-1 : gid;
-                    if (lchown(path, tmpuid, tmpgid))
-                        warn("CHMOD: lchown(%s,%d,%d)", path, tmpuid, tmpgid);
-                }
-            }
-            break;
+/* what a walk of a directory left in it, recorded in clean_index */
+struct dir_scan {
+    int64_t oldest;
+    char **children;
+    uint32_t nchildren;
+    uint32_t cap;
+    bool failed;        /* a child could not be recorded, so nothing is */
+};
 
-            /* t - Set extended attributes
-             * T - Set extended attributes, recursively
-             *
-             * Mode: ignored
-             * UID, GID: ignored
-             * Age: ignored
-             */
-        case CHATTR:
-        case CHATTRR:
-            if (do_create) {
-                dest = pathcat(opt_root, arg);
-                /* TODO */
-                if (debug)
-                    printf("DEBUG: chattr/r path=%s dest=%s\n", path, dest);
-            }
-            break;
+__attribute__((nonnull))
+static void scan_keep(struct dir_scan *scan, time_t mtime)
+{
+    if ((int64_t)mtime < scan->oldest)
+        scan->oldest = mtime;
+}
 
-            /* a/a+ - Set POSIX ACLs. If suffixed with +, specified entries
-             *        will be added to the existing set
-             * A/A+ - as above, but recursive.
-             *
-             * Mode: ignored
-             * UID, GID: ignored
-             * Age: ignored
-             */
-        case CHACL:
-        case CHACLR:
-            if (do_create) {
-                dest = pathcat(opt_root, arg);
-                /* TODO */
-                if (debug)
-                    printf("DEBUG: acl/r path=%s dest=%s\n", path, dest);
-            }
-            break;
+/* on failure the scan is marked failed, so that the directory is not
+ * recorded, and is read again next time */
+__attribute__((nonnull))
+static void scan_child(struct dir_scan *scan, const char *name)
+{
+    if (scan->nchildren == scan->cap) {
+        uint32_t new_cap = scan->cap ? scan->cap * 2 : 8;
+        char **new_children;
 
-            /* v - create subvolume, or behave as d if not supported
-            */
-        case CREATE_SVOL:
-            /* TODO */
-            break;
+        if ((new_children = realloc(scan->children, new_cap * sizeof(char *))) == NULL) {
+            scan->failed = true;
+            return;
+        }
 
-            /* d - create a directory (if does not exist)
-             * D - create a direcotry (delete contents if exists) [remove]
-             */
-        case MKDIR:
-        case MKDIR_RMF:
-            if ( (do_clean && age) || (do_remove && act == MKDIR_RMF) ) {
-                if (subonly) {
-                    DIR *dirp = opendir(path);
-                    struct dirent *dirent;
-                    char *buf;
+        scan->children = new_children;
+        scan->cap = new_cap;
+    }
 
-                    if (!dirp)
-                        goto mkdir_skip;
+    if ((scan->children[scan->nchildren] = strdup(name)) == NULL) {
+        scan->failed = true;
+        return;
+    }
 
-                    while ( (dirent = readdir(dirp)) != NULL )
-                    {
-                        if ( is_dot(dirent->d_name) )
-                            continue;
+    scan->nchildren++;
+}
 
-                        if ( (buf = pathcat(path, dirent->d_name)) )
-                        {
-                            if (do_clean && age) {
-                                if (rm_rf(buf, age, do_clean, true))
-                                    warn("MKDIR: rm_rf(%s)", buf);
-                            } else if (unlink_wrapper(buf, do_clean) && errno != ENOENT)
-                                warn("MKDIR: unlink(%s)", buf);
-                            free(buf);
-                        }
+__attribute__((nonnull))
+static void scan_free(struct dir_scan *scan)
+{
+    for (uint32_t i = 0; i < scan->nchildren; i++)
+        free(scan->children[i]);
+    free(scan->children);
+}
 
-                    }
+/* clean_pool worker: walks a directory queued by rm_rf_entry() */
+static void rm_rf_task(void *arg)
+{
+    struct walk_node *node = arg;
 
-                    closedir(dirp);
+    if (rm_rf_at(node->dirfd, &node->dir, node->tv, node->check_ignores,
+                node->follow_symlinks, node)) {
+        char *buf = walk_path(node->dir.parent, node->name);
+        warnx("rm_rf: rm_rf(%s)", buf ? buf : node->name);
+        free(buf);
+    }
 
-                } else { /* !subonly */
-                    if (do_clean && age) {
-                        /* tmpfiles.d(5) is ambiguous if d/D follow symlinks */
-                        if (rm_rf(path, age, do_clean, false))
-                            warn("MKDIR: rm_rf(%s)", path);
-                        else if (debug)
-                            printf("DEBUG: CLEAN: mkdir/r: %s\n", path);
+    walk_node_put(node);
+}
 
-                    } else if (do_remove) {
-                        if (unlink_wrapper(path, false) && errno != ENOENT) /* FIXME is false correct? */
-                            warn("MKDIR: unlink(%s)", path);
-                        else if (debug)
-                            printf("DEBUG: REMOVE: mkdir/r: %s\n", path);
-                    }
-                }
-            }
-mkdir_skip:
-            if (do_create) {
-                /*
-                   printf("MKDIR %s %s %s %s %s\n", path, modet, uidt, gidt,
-                   aget);
-                   printf("MKDIR %s [%d] %u %u %u\n", path, defmode,
-                   (defmode ? DEF_FOLD : mode), uid, gid);
-                   */
-                fd = open(path, O_DIRECTORY|O_RDONLY);
+/* cleans a single entry of the open directory dirfd (described by dir).
+ *
+ * d_type is used where the file system provides it, so that lstat(2) is only
+ * needed for DT_UNKNOWN or when the age of a file has to be checked.
+ *
+ * if node is not NULL, dir belongs to it and sub-directories are queued on
+ * clean_pool, unless enough work is already queued, in which case they are
+ * walked in this thread.
+ *
+ * if scan is not NULL, what is left behind is recorded in it */
+__attribute__((nonnull(2,3), warn_unused_result, access(read_only, 2), access(read_only, 3),
+            access(read_only, 4)))
+static int rm_rf_entry(int dirfd, const struct walk_dir *dir, const struct dirent *ent,
+        const struct timeval *tv, bool check_ignores, bool follow_symlinks,
+        struct walk_node *node, struct dir_scan *scan)
+{
+    struct stat sb;
+    int fd;
 
-                if (fd == -1 && errno != ENOENT)
-                    break;
-                else if (fd == -1 && errno == ENOENT) {
-                    /* OK */
-                } else if (fd != -1 && !(act == MKDIR_RMF)) {
-                    if (debug)
-                        printf("DEBUG: SKIP:  mkdir/r: %s\n", path);
-                    break;
-                } else if (fd != -1 && rm_rf(path, NULL, false, false))
-                    warn("rmrf(%s)", path);
+    if (ent->d_type == DT_DIR) {
+        /* no need to stat */
+    } else if (ent->d_type != DT_UNKNOWN && tv == NULL) {
+        if (unlinkat_wrapper(dirfd, dir, ent->d_name, check_ignores))
+            return errno == ENOENT ? 0 : -1;
+        return 0;
+    } else if (fstatat(dirfd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    } else if (!S_ISDIR(sb.st_mode)) {
+        int rc = rm_if_old_at(dirfd, dir, ent->d_name, &sb, tv, check_ignores);
+
+        if (scan && (rc || !is_expired(&sb, tv, time(NULL))))
+            scan_keep(scan, sb.st_mtime);
+        return rc;
+    }
 
-                if (fd != -1)
-                    close(fd);
+    if (is_pruned(dir, ent->d_name, check_ignores))
+        return 0;
 
-                /* mkpath performs chmod */
-                if (mkpath(path, (defmode ? def_folder_mode : mode)) == -1)
-                    warn("MKDIR: mkpath(%s)", path);
-                if (lchown(path, uid, gid))
-                    warn("MKDIR: lchown(%s,%d,%d)", path, uid, gid);
+    if (scan)
+        scan_child(scan, ent->d_name);
 
-                if (debug)
-                    printf("DEBUG: DONE:  mkdir/r: %s:%d.%d:0%o\n", path, uid, gid, 
-                            (defmode ? def_folder_mode : mode));
-            }
+    if ((fd = openat(dirfd, ent->d_name,
+                    O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        return errno == ENOENT ? 0 : -1;
 
-            break;
+    if (node && workpool_queued(clean_pool) < (size_t)opt_jobs * max_queued_per_job) {
+        struct walk_node *sub_node;
 
-            /* f  - Create a file if it does not exist (only write if created)
-             * f+ - Create a file, truncate if exists (always write?)
-             *
-             * Age: ignored
-             * Argument: written to the file (with trailing newline?)
-             */
-        case CREAT_FILE:
+        if ((sub_node = walk_node_new(node, ent->d_name, fd, tv,
+                        check_ignores, follow_symlinks)) != NULL) {
+            if (!workpool_submit(clean_pool, rm_rf_task, sub_node))
+                return 0;
+            walk_node_put(sub_node);
+        }
+    }
 
-            if (do_clean && age) {
-                if (rm_if_old(path, age, true))
-                    warn("CREATE/TRUNC_FILE: rm_if_old: <%s>", path);
-                else if (debug)
-                    printf("DEBUG: CLEAN: <%s>\n", path);
-            }
+    const struct walk_dir sub = { dir, ent->d_name };
 
-            if (do_create) {
-                struct stat sb;
-                if (stat(path, &sb) == -1) {
-                    if (errno != ENOENT) {
-                        warn("CREATE/TRUNC_FILE: stat: <%s>", path);
-                        break;
-                    }
-                } else if (!(act & MOD_PLUS)) {
-                    if (debug)
-                        printf("DEBUG: SKIP:  create/trunc_file: <%s>\n", path);
-                    break;
-                }
+    return rm_rf_at(fd, &sub, tv, check_ignores, follow_symlinks, NULL);
+}
 
-                /* O_TRUNC will do nothing for "f" */
-                open_mode  = O_NOCTTY|O_WRONLY|O_CREAT|O_TRUNC;
+/* an entry of the batch of a directory walked by rm_rf_at_ring() */
+struct ring_ent {
+    const char *name;
+    unsigned char d_type;
+    bool descend;
+    int res;
+    struct stat sb;
+};
 
-                char *tmppath;
-                if ((tmppath = strdup(path)) == NULL)
-                    err(EXIT_FAILURE, "strdup(path)");
+/* the context of the unlinkat(2)s of a batch */
+struct ring_unlink {
+    const struct walk_dir *dir;
+    const struct ring_ent *ents;
+};
 
-                mkpath(dirname(tmppath), def_folder_mode);
-                free(tmppath);
+static void clean_ring_failed(void)
+{
+    warn("rm_rf: io_uring failed, using syscalls");
+    uring_destroy(clean_ring);
+    clean_ring = NULL;
+}
 
-                if ((fd = open(path, open_mode, (defmode ? def_file_mode : mode))) == -1) {
-                    warn("open(%s)", path);
-                    break;
-                }
+static void ring_stat_done(void *ctx, uint64_t data, int res)
+{
+    struct ring_ent *ents = ctx;
 
-                /* if uid or gid is -1 nothing happens */
-                if ( (uid != (uid_t)-1 || gid != (gid_t)-1) 
-                        && fchown(fd, uid, gid))
-                    warn("CREATE/TRUNC_FILE: fchown(%s, %d, %d)", path, uid, gid);
+    ents[data].res = res;
+}
 
-                /* does NOT have C-style escapes */
-                if (arg && *arg != '-')
-                    if (write(fd, arg, strlen(arg)) == -1)
-                        warn("CREATE/TRUNC_FILE: write: <%s>", path);
+static void ring_unlink_done(void *ctx, uint64_t data, int res)
+{
+    const struct ring_unlink *ru = ctx;
+    const char *name = ru->ents[data].name;
 
-                close(fd);
+    if (res < 0 && res != -ENOENT) {
+        char *buf = walk_path(ru->dir, name);
+        warnx("rm_rf: rm_rf(%s)", buf ? buf : name);
+        free(buf);
+    }
+}
 
-                if (debug)
-                    printf("DEBUG: DONE:  create/trunc_file: <%s>\n", path);
+/* as rm_rf_at(), but reads the directory in batches the size of clean_ring.
+ * the lstat(2)s of a batch are submitted together, then the unlink(2)s, and
+ * only then are its sub-directories walked */
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 2), access(read_only, 3)))
+static int rm_rf_at_ring(int dirfd, const struct walk_dir *dir, const struct timeval *tv,
+        bool check_ignores, bool follow_symlinks)
+{
+    const unsigned batch = uring_space(clean_ring);
+    struct ring_unlink ru = { dir, NULL };
+    struct ring_ent *ents;
+    struct dirent *ent = NULL;
+    char *names;
+    DIR *d;
+    int fd;
+    int rc = 0;
 
-            }
-            break;
+    if ((d = fdopendir(dirfd)) == NULL) {
+        warn("rm_rf: fdopendir");
+        close(dirfd);
+        return -1;
+    }
 
-            /* C - Recursively copy a file or directory, if the destination
-             *     files or directories do not exist yet
-             *
-             * Argument: specifics the source folder/file.
-             *           If blank uses /usr/share/factory/$NAME
-             */
-        case COPY:
-            {
-                struct stat sb;
-                bool exists;
-                bool dest_dir;
-                bool factory;
-                bool src_dir;
-                char buf[PATH_MAX];
+    ents = calloc(batch, sizeof(struct ring_ent));
+    names = malloc(batch * (NAME_MAX + 1));
 
-                /* check the destination */
-                if (stat(path, &sb) == -1) {
-                    if (errno != ENOENT)
-                        break;
+    if (ents == NULL || names == NULL) {
+        warn("rm_rf: malloc");
+        free(ents);
+        free(names);
+        closedir(d);
+        return -1;
+    }
 
-                    exists = false;
-                    dest_dir = false;
-                } else {
-                    exists = true;
-                    dest_dir = !!S_ISDIR(sb.st_mode);
+    ru.ents = ents;
+
+    do {
+        size_t n = 0, used = 0;
+        time_t now;
+
+        errno = 0;
+        while (n < batch && (ent = readdir(d)) != NULL)
+        {
+            size_t len;
+
+            if (is_dot(ent->d_name))
+                continue;
+
+            len = strlen(ent->d_name) + 1;
+            memcpy(names + used, ent->d_name, len);
+
+            ents[n].name = names + used;
+            ents[n].d_type = ent->d_type;
+            ents[n].descend = false;
+            ents[n].res = 1;
+
+            used += len;
+            n++;
+        }
+
+        if (ent == NULL && errno)
+            rc = -1;
+
+        /* stat anything whose type, or age, is not yet known */
+        for (size_t i = 0; clean_ring && i < n; i++)
+            if (ents[i].d_type == DT_UNKNOWN || (ents[i].d_type != DT_DIR && tv))
+                if (uring_prep_stat(clean_ring, dirfd, ents[i].name, &ents[i].sb, i))
+                    break;
+
+        if (clean_ring && uring_run(clean_ring, ring_stat_done, ents))
+            clean_ring_failed();
+
+        now = time(NULL);
+
+        /* queue the unlinks */
+        for (size_t i = 0; i < n; i++)
+        {
+            struct ring_ent *e = &ents[i];
+            const bool need_stat = e->d_type == DT_UNKNOWN || (e->d_type != DT_DIR && tv);
+
+            if (need_stat && e->res == 1)
+                e->res = fstatat(dirfd, e->name, &e->sb, AT_SYMLINK_NOFOLLOW) ? -errno : 0;
+
+            if (need_stat && e->res < 0) {
+                if (e->res != -ENOENT) {
+                    char *buf = walk_path(dir, e->name);
+                    warnx("rm_rf: rm_rf(%s)", buf ? buf : e->name);
+                    free(buf);
                 }
+                continue;
+            }
 
-                /* check the source */
-                if (arg && *arg != '-') {
-                    if ((src = pathcat(opt_root, arg)) == NULL) {
-                        warn("COPY: pathcat(arg)");
+            if (need_stat ? S_ISDIR(e->sb.st_mode) : e->d_type == DT_DIR) {
+                e->descend = true;
+                continue;
+            }
+
+            if (need_stat && !is_expired(&e->sb, tv, now)) {
+                if (tv)
+                    note_survivor(dirfd, dir, e->name, &e->sb, tv, check_ignores);
+                continue;
+            }
+
+            switch (unlink_permitted(dir, e->name, check_ignores))
+            {
+                case 1:
+                    if (clean_ring &&
+                            !uring_prep_unlinkat(clean_ring, dirfd, e->name, 0, i))
                         break;
-                    }
-                    factory = false;
-                } else {
-                    if ((src = pathcat(opt_root, "/usr/share/factory/")) == NULL) {
-                        warn("COPY: pathcat(factory)");
+                    if (unlinkat(dirfd, e->name, 0) == 0 || errno == ENOENT)
                         break;
+                    /* fall through */
+                case -1:
+                    {
+                        char *buf = walk_path(dir, e->name);
+                        warnx("rm_rf: rm_rf(%s)", buf ? buf : e->name);
+                        free(buf);
                     }
-                    strcpy(buf, src);
-                    free(src);
+                    break;
+            }
+        }
+
+        if (clean_ring && uring_run(clean_ring, ring_unlink_done, &ru))
+            clean_ring_failed();
+
+        /* and finally walk the sub-directories */
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!ents[i].descend || is_pruned(dir, ents[i].name, check_ignores))
+                continue;
+
+            const struct walk_dir sub = { dir, ents[i].name };
+
+            if ((fd = openat(dirfd, ents[i].name,
+                            O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+                if (errno == ENOENT)
+                    continue;
+            } else if (!rm_rf_at(fd, &sub, tv, check_ignores, follow_symlinks, NULL))
+                continue;
+
+            char *buf = walk_path(dir, ents[i].name);
+            warnx("rm_rf: rm_rf(%s)", buf ? buf : ents[i].name);
+            free(buf);
+        }
+    } while (ent != NULL);
+
+    free(names);
+    free(ents);
+    closedir(d);
+
+    return rc;
+}
+
+/* walks only the sub-directories of dirfd (described by dir) recorded in
+ * idx, which is closed on return */
+__attribute__((nonnull(2,3), warn_unused_result, access(read_only, 2), access(read_only, 3),
+            access(read_only, 4)))
+static int rm_rf_at_indexed(int dirfd, const struct walk_dir *dir,
+        const struct cidx_entry *idx, const struct timeval *tv,
+        bool check_ignores, bool follow_symlinks)
+{
+    int fd;
+
+    for (uint32_t i = 0; i < idx->nchildren; i++)
+    {
+        const char *name = idx->children[i];
+
+        if (is_pruned(dir, name, check_ignores))
+            continue;
+
+        if ((fd = openat(dirfd, name,
+                        O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+            if (errno != ENOENT) {
+                char *buf = walk_path(dir, name);
+                warn("rm_rf: openat(%s)", buf ? buf : name);
+                free(buf);
+            }
+            continue;
+        }
+
+        const struct walk_dir sub = { dir, name };
+
+        if (rm_rf_at(fd, &sub, tv, check_ignores, follow_symlinks, NULL)) {
+            char *buf = walk_path(dir, name);
+            warnx("rm_rf: rm_rf(%s)", buf ? buf : name);
+            free(buf);
+        }
+    }
+
+    close(dirfd);
+
+    return 0;
+}
+
+/* walks the open directory dirfd (described by dir), which is always closed
+ * on return.
+ *
+ * with clean_index, an aged clean of a directory that is unchanged since it
+ * was last read, and holds nothing yet due, only visits its sub-directories */
+__attribute__((nonnull(2), warn_unused_result, access(read_only, 2), access(read_only, 3)))
+static int rm_rf_at(int dirfd, const struct walk_dir *dir, const struct timeval *tv,
+        bool check_ignores, bool follow_symlinks, struct walk_node *node)
+{
+    DIR *d;
+    struct dirent *ent;
+    struct stat dsb;
+    struct dir_scan scan, *scanp = NULL;
+    const uint64_t fingerprint = check_ignores ? ignores.hash ^ clean_roots.hash : 0;
+    int rc = 0;
+
+    watch_note(dirfd, dir, tv, check_ignores);
+
+    if (clean_ring)
+        return rm_rf_at_ring(dirfd, dir, tv, check_ignores, follow_symlinks);
+
+    if (clean_index && tv && !node && fstat(dirfd, &dsb) == 0) {
+        const struct cidx_entry *idx = cidx_lookup(clean_index, &dsb);
+
+        /* compared so as not to overflow, whatever oldest was saved as */
+        if (idx && cidx_unchanged(idx, &dsb, fingerprint) &&
+                (idx->oldest == CIDX_NEVER || (idx->oldest != INT64_MIN &&
+                    idx->oldest >= (int64_t)time(NULL) - tv->tv_sec))) {
+            cidx_skipped++;
+            return rm_rf_at_indexed(dirfd, dir, idx, tv, check_ignores, follow_symlinks);
+        }
+
+        memset(&scan, 0, sizeof(scan));
+        scan.oldest = CIDX_NEVER;
+        scanp = &scan;
+        cidx_scanned++;
+    }
+
+    if ((d = fdopendir(dirfd)) == NULL) {
+        warn("rm_rf: fdopendir");
+        close(dirfd);
+        return -1;
+    }
+
+    if (do_plan)
+        atomic_fetch_add(&plan_dirs, 1);
+
+    errno = 0;
+    while ( (ent = readdir(d)) )
+    {
+        if (is_dot(ent->d_name))
+            continue;
+
+        if (do_plan)
+            atomic_fetch_add(&plan_scanned, 1);
+
+        if (rm_rf_entry(dirfd, dir, ent, tv, check_ignores, follow_symlinks, node, scanp)) {
+            char *buf = walk_path(dir, ent->d_name);
+            warnx("rm_rf: rm_rf(%s)", buf ? buf : ent->d_name);
+            free(buf);
+        }
+
+        errno = 0;
+    }
+
+    if (errno)
+        rc = -1;
+
+    if (scanp && (rc || scan.failed || fstat(dirfd, &dsb) == -1 ||
+                cidx_update(clean_index, &dsb, scan.oldest, fingerprint,
+                    scan.children, scan.nchildren)))
+        scan_free(&scan);
+
+    closedir(d);
+
+    return rc;
+}
+
+__attribute__((nonnull(1), warn_unused_result, access(read_only, 1), access(read_only, 2)))
+static int rm_rf(const char *path, const struct timeval *tv,
+        bool check_ignores, bool follow_symlinks)
+{
+    /* protect some obvious errors */
+    if (!strcmp("/", path) || !strcmp(".", path) || !strcmp("..", path))
+        errx(EXIT_FAILURE, "rm_rf: attempt to remove protected file");
+
+    struct stat sb;
+    struct timespec start, took;
+    int fd, rc;
+
+    if (lstat(path, &sb) == -1) {
+        warn("rm_rf: fstat(%s)", path);
+        return -1;
+    }
+
+    /* if the target is:
+     * a directory: walk it relative to its descriptor
+     * a symlink:   rm_rf() the symlink
+     * otherwise:   rm_rf() the file
+     */
+
+    if (!S_ISDIR(sb.st_mode)) {
+        /* is not a folder */
+        return rm_if_old_at(AT_FDCWD, NULL, path, &sb, tv, check_ignores);
+    }
+
+    if (is_pruned(NULL, path, check_ignores))
+        return 0;
+
+    if ((fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+        warn("rm_rf: opendir");
+        return -1;
+    }
+
+    if (debug)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (clean_pool) {
+        struct walk_node *top;
+
+        if ((top = walk_node_new(NULL, path, fd, tv, check_ignores, follow_symlinks)) == NULL) {
+            close(fd);
+            return -1;
+        }
+
+        /* this thread walks the top level, the pool anything below it */
+        rc = rm_rf_at(fd, &top->dir, tv, check_ignores, follow_symlinks, top);
+        workpool_wait(clean_pool);
+        walk_node_put(top);
+    } else {
+        const struct walk_dir top = { NULL, path };
+
+        rc = rm_rf_at(fd, &top, tv, check_ignores, follow_symlinks, NULL);
+    }
+
+    /* so that mkpath() does not take what has gone to be there still */
+    mkpath_forget_tree(path);
+
+    if (debug) {
+        took = elapsed(&start);
+        printf("DEBUG: rm_rf(%s): %d job(s) %ld.%06lds\n", path, opt_jobs,
+                (long)took.tv_sec, took.tv_nsec / 1000L);
+    }
+
+    return rc;
+
+    /* FIXME check how age checking on symbolic links should be handled */
+}
+
+/* --destroy-subvolumes: D and R destroy a btrfs subvolume whole, by one
+ * ioctl rather than a walk, which cannot be undone nor stopped part way,
+ * so is only done when asked for. returns true if path was one and is
+ * gone, else it is for rm_rf() */
+__attribute__((nonnull, warn_unused_result, access(read_only, 1)))
+static bool destroy_subvol(const char *path)
+{
+    if (!do_destroy_subvols || do_plan || !subvol_is(path))
+        return false;
+
+    if (subvol_destroy(path)) {
+        /* such as one with another subvolume inside */
+        if (debug)
+            printf("DEBUG: subvol_destroy(%s): %s, removing it by walking\n",
+                    path, strerror(errno));
+        return false;
+    }
+
+    /* along with whatever mkpath() knows of inside it */
+    mkpath_forget();
+
+    if (debug)
+        printf("DEBUG: subvol_destroy(%s)\n", path);
+
+    return true;
+}
+
+/* --trash: D and R rename what they remove into the trash of its file
+ * system, which is deleted once the rules are done, rather than waiting for
+ * rm_rf(). returns true if path was moved, else it is for rm_rf() */
+__attribute__((nonnull, warn_unused_result, access(read_only, 1)))
+static bool trash_aside(const char *path)
+{
+    if (!do_trash || trash == NULL)
+        return false;
+
+    if (trash_move(trash, path)) {
+        /* such as the top of a file system */
+        if (errno != ENOENT && debug)
+            printf("DEBUG: trash_move(%s): %s, removing it here\n", path, strerror(errno));
+        return false;
+    }
+
+    /* along with whatever mkpath() knows of inside it */
+    mkpath_forget();
+
+    if (debug)
+        printf("DEBUG: trash_move(%s)\n", path);
+
+    return true;
+}
+
+/* v, q and Q: a btrfs subvolume where path is on btrfs, else as d */
+__attribute__((nonnull, warn_unused_result, access(read_only, 1)))
+static int make_subvol(const char *path, mode_t mode, subvol_qgroup_t qgroup)
+{
+    char *parent, *slash;
+    int rc = 0;
+
+    if ((parent = strdup(path)) == NULL)
+        return -1;
+
+    if ((slash = strrchr(parent, '/')) != NULL && slash != parent) {
+        *slash = '\0';
+        rc = mkpath(parent, mode);
+    }
+    free(parent);
+
+    if (rc)
+        return -1;
+
+    if (subvol_create(path, mode, qgroup) == 0) {
+        if (debug)
+            printf("DEBUG: subvol_create(%s)\n", path);
+        return 0;
+    }
+
+    if (errno != ENOTTY)
+        return -1;
+
+    return mkpath((char *)path, mode);
+}
+
+/**
+ * execute the action against a single path entry
+ *
+ * @param[in] act action to perform
+ * @param[in] path path/glob (modified)
+ * @param[in] age age setting
+ * @param[in] arg argument
+ * @param[in] mode,defmode,mask config settings for file mode
+ * @param[in] defuid,uid config settings uid
+ * @param[in] defgid,gid config settings gid
+ * @param[in] rawpath unmodified path from config
+ * @param[in] dev where act type is ARG_NODE, parsed dev_t
+ *
+ * @return 0 if OK, -1 for error
+ */
+__attribute__((nonnull(2,14), warn_unused_result, access(read_only, 2), access(read_only, 3), access(read_only, 14)))
+static int execute_action(
+        char act, char *path, const struct timeval *age,
+        const char *arg,
+        mode_t mode, bool defmode, mode_t mask,
+        bool defuid, uid_t uid,
+        bool defgid, gid_t gid,
+        bool subonly,
+        int mod,
+        const char *rawpath,
+        dev_t dev)
+{
+    int fd  = -1;
+    int ret = 0;
+    int open_mode;
+
+    char *dest = NULL;
+    char *src  = NULL;
+
+    switch(act)
+    {
+        /* w - Write the argument parameter to a file
+         *
+         * Argument: Content to be written including C-style backslash escapes
+         * Path: glob
+         * Symlinks: followed
+         *
+         * Write to existing file, w+ append to existing file.
+         */
+        case WRITE_ARG:
+            if (do_create) {
+                /* TODO */
+
+                open_mode  = O_NOCTTY|O_WRONLY;
+                open_mode |= (mod & MOD_PLUS) ? O_APPEND : O_TRUNC;
+
+                if ((fd = open(path, open_mode)) == -1) {
+                    warn("WRITE_ARG: open: <%s>", path);
+                    goto fail;
+                }
+
+                /* FIXME - escaping */
+                if (write(fd, arg, strlen(arg)) == -1) {
+                    warn("WRITE_ARG: write: <%s>", path);
+                    close(fd);
+                    goto fail;
+                }
+
+                close(fd);
+            }
+            break;
+
+            /* r - Remove a file or directory if it exists (empty only) [remove]
+             * R - Recursively remove a path and all its subdirectories [remove]
+             *
+             * Mode: ignored
+             * UID, GID: ignored
+             * Age: ignored
+             */
+        case RM:
+        case RMRF:
+            if (!do_remove)
+                break;
+
+            if (act == RMRF) {
+                if (!destroy_subvol(path) && !trash_aside(path) &&
+                        rm_rf(path, NULL, false, false))
+                    warn("RMRF: rmrf(%s)",path);
+            } else
+                if (unlink_wrapper(path, false) && errno != ENOENT)
+                    warn("RM: unlink(%s):", path);
+
+            break;
+
+            /* x - Ignore a path during cleaning (plus contents)
+             * X - Ignore a path during cleaning (ignores contents)
+             *
+             * Mode: ignored
+             * UID, GID: ignored
+             */
+        case IGN:
+        case IGNR:
+            if (ignore_add(&ignores, path, act == IGN)) {
+                warn("IGN: ignore_add");
+                goto fail;
+            }
+
+            if (debug)
+                printf("DEBUG: ignore/r %s\n", path);
+            break;
+
+            /* z - Adjust the access mode, group and user, and restore the
+             *     SELinux security context (if it exists)
+             * Z - As above, recursively.
+             *
+             * Mode: NULL/- means do not change
+             * UID, GID: NULL/- means do not change
+             */
+        case CHMOD:
+        case CHMODR:
+            {
+                struct stat sb;
+
+                if (do_create) {
+                    mode_t mmode = mode;
+
+                    if (defmode) {
+                        if (stat(path, &sb) == -1)
+                            warn("CHMOD: stat(%s)", path);
+                        else {
+                            if (S_ISDIR(sb.st_mode))
+                                mmode = def_folder_mode;
+                            else
+                                mmode = def_file_mode;
+                        }
+                    }
+
+                    if (mask) {
+                        errno = ENOSYS;
+                        warn("chmod(%s,%o|%o)", path, mmode, mask);
+                    } else {
+                        if (debug)
+                            printf("DEBUG: chmod/r %s,%o", path, mmode);
+
+                        if (chmod(path, mmode))
+                            warn("CHMOD: chmod(%s,%o)", path, mmode);
+                    }
+                    /* FIXME is the logic around -1 right here ? */
+                    uid_t tmpuid = defuid ? (uid_t)-1 : uid;
+                    gid_t tmpgid = defgid ? (gid_t)-1 : gid;
+                    if (lchown(path, tmpuid, tmpgid))
+                        warn("CHMOD: lchown(%s,%d,%d)", path, tmpuid, tmpgid);
+                }
+            }
+            break;
+
+            /* t - Set extended attributes
+             * T - Set extended attributes, recursively
+             *
+             * Mode: ignored
+             * UID, GID: ignored
+             * Age: ignored
+             */
+        case CHATTR:
+        case CHATTRR:
+            if (do_create) {
+                dest = pathcat(opt_root, arg);
+                /* TODO */
+                if (debug)
+                    printf("DEBUG: chattr/r path=%s dest=%s\n", path, dest);
+            }
+            break;
+
+            /* a/a+ - Set POSIX ACLs. If suffixed with +, specified entries
+             *        will be added to the existing set
+             * A/A+ - as above, but recursive.
+             *
+             * Mode: ignored
+             * UID, GID: ignored
+             * Age: ignored
+             */
+        case CHACL:
+        case CHACLR:
+            if (do_create) {
+                dest = pathcat(opt_root, arg);
+                /* TODO */
+                if (debug)
+                    printf("DEBUG: acl/r path=%s dest=%s\n", path, dest);
+            }
+            break;
+
+            /* v - create subvolume, or behave as d if not supported
+             * q - as v, in the quota groups of the parent subvolume
+             * Q - as q, in a quota group of its own
+             *
+             * d - create a directory (if does not exist)
+             * D - create a direcotry (delete contents if exists) [remove]
+             */
+        case CREATE_SVOL:
+        case CREATE_SVOL2:
+        case CREATE_SVOL3:
+        case MKDIR:
+        case MKDIR_RMF:
+            if ( (do_clean && age) || (do_remove && act == MKDIR_RMF) ) {
+                if (subonly) {
+                    const struct walk_dir top_dir = { NULL, path };
+                    struct walk_node *top = NULL;
+                    const struct walk_dir *topp = &top_dir;
+                    DIR *dirp;
+                    struct dirent *dirent;
+                    char *buf;
+                    int dirfd;
+
+                    if ((dirfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+                        goto mkdir_skip;
+
+                    if ((dirp = fdopendir(dirfd)) == NULL) {
+                        close(dirfd);
+                        goto mkdir_skip;
+                    }
+
+                    if (do_clean && age)
+                        watch_note(dirfd, topp, age, do_clean);
+
+                    if (do_plan)
+                        atomic_fetch_add(&plan_dirs, 1);
+
+                    /* with --jobs sub-directories are walked by clean_pool */
+                    if (clean_pool && do_clean && age &&
+                            (top = walk_node_new(NULL, path, -1, age, do_clean, true)) != NULL)
+                        topp = &top->dir;
+
+                    while ( (dirent = readdir(dirp)) != NULL )
+                    {
+                        if ( is_dot(dirent->d_name) )
+                            continue;
+
+                        if (do_plan)
+                            atomic_fetch_add(&plan_scanned, 1);
+
+                        if (do_clean && age) {
+                            if (rm_rf_entry(dirfd, topp, dirent, age, do_clean, true, top, NULL)) {
+                                buf = walk_path(topp, dirent->d_name);
+                                warn("MKDIR: rm_rf(%s)", buf ? buf : dirent->d_name);
+                                free(buf);
+                            }
+                        } else if (unlinkat_wrapper(dirfd, topp, dirent->d_name, do_clean)
+                                && errno != ENOENT) {
+                            buf = walk_path(topp, dirent->d_name);
+                            warn("MKDIR: unlink(%s)", buf ? buf : dirent->d_name);
+                            free(buf);
+                        }
+                    }
+
+                    if (top) {
+                        workpool_wait(clean_pool);
+                        walk_node_put(top);
+                    }
+
+                    closedir(dirp);
+
+                } else { /* !subonly */
+                    if (do_clean && age) {
+                        /* tmpfiles.d(5) is ambiguous if d/D follow symlinks */
+                        if (rm_rf(path, age, do_clean, false))
+                            warn("MKDIR: rm_rf(%s)", path);
+                        else if (debug)
+                            printf("DEBUG: CLEAN: mkdir/r: %s\n", path);
+
+                    } else if (trash_aside(path)) {
+                        /* made again at once, empty, unless --create will */
+                        if (!do_create &&
+                                (mkpath(path, (defmode ? def_folder_mode : mode)) == -1 ||
+                                 lchown(path, uid, gid)))
+                            warn("MKDIR: mkpath(%s)", path);
+                        else if (debug)
+                            printf("DEBUG: REMOVE: mkdir/r: %s\n", path);
+                    } else if (access(path, F_OK) == -1) {
+                        if (errno != ENOENT)
+                            warn("MKDIR: access(%s)", path);
+                    } else if (rm_rf(path, NULL, false, false)) {
+                        /* the contents, as the directory itself is kept */
+                        warn("MKDIR: rm_rf(%s)", path);
+                    } else if (debug)
+                        printf("DEBUG: REMOVE: mkdir/r: %s\n", path);
+                }
+            }
+mkdir_skip:
+            if (do_create) {
+                /*
+                   printf("MKDIR %s %s %s %s %s\n", path, modet, uidt, gidt,
+                   aget);
+                   printf("MKDIR %s [%d] %u %u %u\n", path, defmode,
+                   (defmode ? DEF_FOLD : mode), uid, gid);
+                   */
+                subvol_qgroup_t qgroup = SUBVOL_QGROUP_NONE;
+                bool subvol = act == CREATE_SVOL || act == CREATE_SVOL2 ||
+                    act == CREATE_SVOL3;
+
+                if (act == CREATE_SVOL2)
+                    qgroup = SUBVOL_QGROUP_INHERIT;
+                else if (act == CREATE_SVOL3)
+                    qgroup = SUBVOL_QGROUP_OWN;
+
+                fd = open(path, O_DIRECTORY|O_RDONLY);
+
+                if (fd == -1 && errno != ENOENT)
+                    break;
+                else if (fd == -1 && errno == ENOENT) {
+                    /* OK */
+                } else if (fd != -1 && !(act == MKDIR_RMF)) {
+                    if (debug)
+                        printf("DEBUG: SKIP:  mkdir/r: %s\n", path);
+                    close(fd);
+                    break;
+                } else if (fd != -1 && destroy_subvol(path)) {
+                    /* and made again as one */
+                    subvol = true;
+                } else if (fd != -1 && trash_aside(path)) {
+                    /* made again below */
+                } else if (fd != -1 && rm_rf(path, NULL, false, false))
+                    warn("rmrf(%s)", path);
+
+                if (fd != -1)
+                    close(fd);
+
+                /* mkpath performs chmod */
+                if (subvol) {
+                    if (make_subvol(path, (defmode ? def_folder_mode : mode), qgroup) == -1)
+                        warn("MKDIR: make_subvol(%s)", path);
+                } else if (mkpath(path, (defmode ? def_folder_mode : mode)) == -1)
+                    warn("MKDIR: mkpath(%s)", path);
+                if (lchown(path, uid, gid))
+                    warn("MKDIR: lchown(%s,%d,%d)", path, uid, gid);
+
+                if (debug)
+                    printf("DEBUG: DONE:  mkdir/r: %s:%d.%d:0%o\n", path, uid, gid, 
+                            (defmode ? def_folder_mode : mode));
+            }
+
+            break;
+
+            /* f  - Create a file if it does not exist (only write if created)
+             * f+ - Create a file, truncate if exists (always write?)
+             *
+             * Age: ignored
+             * Argument: written to the file (with trailing newline?)
+             */
+        case CREAT_FILE:
+
+            if (do_clean && age) {
+                if (rm_if_old(path, age, true))
+                    warn("CREATE/TRUNC_FILE: rm_if_old: <%s>", path);
+                else if (debug)
+                    printf("DEBUG: CLEAN: <%s>\n", path);
+            }
+
+            if (do_create) {
+                struct stat sb;
+                if (stat(path, &sb) == -1) {
+                    if (errno != ENOENT) {
+                        warn("CREATE/TRUNC_FILE: stat: <%s>", path);
+                        break;
+                    }
+                } else if (!(act & MOD_PLUS)) {
+                    if (debug)
+                        printf("DEBUG: SKIP:  create/trunc_file: <%s>\n", path);
+                    break;
+                }
+
+                /* O_TRUNC will do nothing for "f" */
+                open_mode  = O_NOCTTY|O_WRONLY|O_CREAT|O_TRUNC;
+
+                char *tmppath;
+                if ((tmppath = strdup(path)) == NULL)
+                    err(EXIT_FAILURE, "strdup(path)");
+
+                mkpath(dirname(tmppath), def_folder_mode);
+                free(tmppath);
+
+                if ((fd = open(path, open_mode, (defmode ? def_file_mode : mode))) == -1) {
+                    warn("open(%s)", path);
+                    break;
+                }
+
+                /* if uid or gid is -1 nothing happens */
+                if ( (uid != (uid_t)-1 || gid != (gid_t)-1) 
+                        && fchown(fd, uid, gid))
+                    warn("CREATE/TRUNC_FILE: fchown(%s, %d, %d)", path, uid, gid);
+
+                /* does NOT have C-style escapes */
+                if (arg && *arg != '-')
+                    if (write(fd, arg, strlen(arg)) == -1)
+                        warn("CREATE/TRUNC_FILE: write: <%s>", path);
+
+                close(fd);
+
+                if (debug)
+                    printf("DEBUG: DONE:  create/trunc_file: <%s>\n", path);
+
+            }
+            break;
+
+            /* C - Recursively copy a file or directory, if the destination
+             *     files or directories do not exist yet
+             *
+             * Argument: specifics the source folder/file.
+             *           If blank uses /usr/share/factory/$NAME
+             */
+        case COPY:
+            {
+                struct stat sb;
+                bool exists;
+                bool dest_dir;
+                bool factory;
+                bool src_dir;
+                char buf[PATH_MAX];
+
+                /* check the destination */
+                if (stat(path, &sb) == -1) {
+                    if (errno != ENOENT)
+                        break;
+
+                    exists = false;
+                    dest_dir = false;
+                } else {
+                    exists = true;
+                    dest_dir = !!S_ISDIR(sb.st_mode);
+                }
+
+                /* check the source */
+                if (arg && *arg != '-') {
+                    if ((src = pathcat(opt_root, arg)) == NULL) {
+                        warn("COPY: pathcat(arg)");
+                        break;
+                    }
+                    factory = false;
+                } else {
+                    if ((src = pathcat(opt_root, "/usr/share/factory/")) == NULL) {
+                        warn("COPY: pathcat(factory)");
+                        break;
+                    }
+                    strcpy(buf, src);
+                    free(src);
+
+                    if ((src = pathcat(buf, rawpath)) == NULL) {
+                        warn("COPY: pathcat(factory)");
+                        break;
+                    }
+                    factory = true;
+                }
+
+                if (stat(src, &sb) == -1) {
+                    if (errno != ENOENT)
+                        warn("COPY: stat: <%s>", src);
+                    free(src);
+                    break;
+                }
+
+                src_dir = !!S_ISDIR(sb.st_mode);
+
+                /* process actions */
+
+                if (do_clean && age) {
+                    /* TODO */
+                }
+
+                if (do_create) {
+                    if (src_dir && !dest_dir) {
+                        warn("COPY: attempt to copy folder(%s) to file(%s)", src, path);
+                        break;
+                    } 
+
+                    if (copy_src_dir(src, path))
+                        warn("COPY: copy_src_dir");
+                   
+                    /* TODO */
+                    if (factory) {
+                    } else {
+                    }
+
+                    if (debug)
+                        printf("DEBUG: copy: src=%s dest=%s exists=%d dest_dir=%d "
+                                "src_dir=%d factory=%d\n",
+                                src, path, exists, dest_dir, src_dir, factory);
+                }
+
+                free(src);
+            }
+            break;
+
+            /* L - Create a symlink if it does not exist
+             * L+ - Unlink and then create
+             *
+             * Mode: ignored
+             * UID/GID: ignored
+             * Argument: if empty, symlink to /usr/share/factory/$NAME
+             */
+        case CREATE_SYM: // FIXME handle NULL dest => /usr/share/factory
+            if (do_clean && age) {
+                /* TODO */
+            }
+
+            if (do_create) {
+                if (strncmp("../", arg, 3) )
+                    dest = pathcat(opt_root, arg);
+                else
+                    dest = strdup(arg);
+
+                if (dest == NULL) {
+                    warn("CREATE_SYM: dest is NULL: <%s>", path);
+                    break;
+                }
+
+                struct stat sb;
+                ret = lstat(path, &sb);
+
+                if (ret == -1 && errno != ENOENT) {
+                    /* failed to stat with a worrying error */
+                    warn("CREATE_SYM: open: <%s> => <%s>", path, dest);
+                    break;
+                } else if (ret == -1) {
+                    /* must be ENOENT, so fine */
+                } else if (!S_ISLNK(sb.st_mode) && (mod & MOD_PLUS)) {
+                    /* if the existing file is NOT a symlink, we have a problem */
+                    warnx("CREATE_SYM: existing file is not a symlink: <%s>", path);
+                    break;
+                } else if (!(mod & MOD_PLUS)) {
+                    /* file exists so ignore */
+                    if (debug)
+                        printf("DEBUG: SKIP:  symlink dest=%s path=%s\n", dest, path);
+                    break;
+                } else if ((mod & MOD_PLUS) && unlink_wrapper(path, false)) {
+                    /* file exists, but we had a problem removing it first */
+                    warn("CREATE_SYM: unlink_wrapper: <%s>", path);
+                    break;
+                }
+
+                if (symlink(dest, path) == -1) {
+                    warn("CREATE_SYM: symlink(%s, %s)", dest, path);
+                    break;
+                }
+
+                if (debug)
+                    printf("DEBUG: DONE:  symlink dest=%s path=%s\n", dest, path);
+            }
+            break;
+
+            /* c  - Create a character file if it does not exist
+             * c+ - Remove and create a character file
+             * b  - Create a block device node if it does not exist
+             * b+ - Remove and create
+             * p  - Create a pipe (FIFO) if it does not exist
+             * p+ - Remove and create a pipe (FIFO)
+             *
+             * Argument: ignored
+             */
+        case CREATE_CHAR:
+        case CREATE_BLK:
+        case CREATE_PIPE:
+            if (do_clean && age) {
+                /* TODO */
+            }
+
+            if (do_create) {
+                struct stat sb;
+                ret = stat(path, &sb);
+
+                if (ret == -1 && errno != ENOENT) {
+                    /* failed to stat with unknown error */
+                    warn("CREATE_CHAR/BLK/PIPE: lstat");
+                    break;
+                } else if (ret == -1) {
+                    /* NOENT: OK */
+                } else if (ret != -1 && !(mod & MOD_PLUS)) {
+                    /* file exists, but not c+ */
+                    if (debug)
+                        printf("DEBUG: SKIP:  create_char/blk %s\n", path);
+                    break;
+                } else if (ret != -1 && (mod & MOD_PLUS) && unlink_wrapper(path, false)) {
+                    warn("CREATE_CHAR/BLK/PIPE: unlink_wrapper(%s)", path);
+                    goto fail;
+                }
+
+                switch (act) 
+                {
+                    case CREATE_CHAR:  mode = S_IFCHR; break;
+                    case CREATE_BLK:   mode = S_IFBLK; break;
+                    case CREATE_PIPE:  mode = 0;       break;
+                }
+
+                char *tmppath;
+                if ((tmppath = strdup(path)) == NULL)
+                    err(EXIT_FAILURE, "strdup(path)");
+
+                mkpath(dirname(tmppath), def_folder_mode);
+                free(tmppath);
+
+                mode |= (defmode ? def_file_mode : mode);
+
+                switch (act)
+                {
+                    case CREATE_PIPE:
+                        if (mkfifo(path, mode)) {
+                            warn("CREATE_PIPE: mkfifo: <%s>", path);
+                            goto fail;
+                        }
+                        break;
+
+                    case CREATE_CHAR:
+                    case CREATE_BLK:
+                        if (mknod(path, mode, dev)) {
+                            warn("CREATE_CHAR/BLK: mknod(%s)", path);
+                            goto fail;
+                        }
+                        break;
+                }
+
+                if (lchown(path, uid, gid))
+                    warn("chown(%s)", path);
+
+                if (debug)
+                    printf("DEBUG: create_char/blk %s\n", path);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+done:
+    if (dest)
+        free(dest);
+    if (fd != -1)  {
+        close(fd);
+    }
+    return ret;
+fail:
+    ret = -1;
+    goto done;
+}
+
+/* the config file that rule idx was read from */
+__attribute__((warn_unused_result))
+static const char *rule_file(size_t idx)
+{
+    while (idx && rules.rules[idx].type != '\0')
+        idx--;
+
+    if (rules.rules[idx].type != '\0' || rules.rules[idx].path == RULE_NO_STR)
+        return "?";
+
+    return rules_str(&rules, rules.rules[idx].path);
+}
+
+/* parses line, which is split into its fields in place, onto the end of
+ * rules. rules_warned is set if anything in it could not be vetted */
+__attribute__((nonnull, warn_unused_result))
+static int parse_line(char *line)
+{
+    char *raw[7] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+    char *raw_type, *raw_path, *raw_mode;
+    char *raw_uid,  *raw_gid,  *raw_age;
+    char *raw_arg;
+
+    int fields = 0;
+    int subonly = 0;
+
+    struct rule rule;
+
+    const struct config_element *cfg_elem = NULL;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.uid = -1;  rule.defuid  = true;
+    rule.gid = -1;  rule.defgid  = true;
+    rule.mode = -1; rule.defmode = true;
+
+    /* Type Path Mode User Group Age Argument */
+    fields = cfgmap_split(line, raw, 7);
+
+    raw_type = raw[0]; raw_path = raw[1]; raw_mode = raw[2];
+    raw_uid  = raw[3]; raw_gid  = raw[4]; raw_age  = raw[5];
+    raw_arg  = raw[6];
+
+    /* Type and Path are mandatory for all types */
+    if (fields < 2) {
+        warnx("parse_line: bad line: %s\n", line);
+        goto fail;
+    }
+
+    if ((rule.mod = validate_type(raw_type, &rule.type)) == -1) {
+        warn("parse_line: bad type format: %s %s", raw_type, raw_path);
+        rules_warned = true;
+        return 0;
+    }
+
+    if (configuration[(uint8_t)rule.type].act == ACT_NULL) {
+        warnx("parse_line: invalid type: %s %s", raw_type, raw_path);
+        goto fail;
+    }
+
+    cfg_elem = &configuration[(uint8_t)rule.type];
+
+    /* ensure an argument is present for those that require it */
+    if (cfg_elem->arg_type && raw_arg == NULL) {
+        warnx("parse_line: argument is mandaotry for type: %s %s", raw_type, raw_path);
+        goto fail;
+    }
+
+    /* validate & tidy up fields */
+
+    if (raw_uid) {
+        rule.uid = vet_uid(raw_uid, &rule.defuid);
+        if (!rule.defuid && rule.uid == (uid_t)-1)
+            rules_warned = true;
+    }
+
+    if (raw_gid) {
+        rule.gid = vet_gid(raw_gid, &rule.defgid);
+        if (!rule.defgid && rule.gid == (gid_t)-1)
+            rules_warned = true;
+    }
+
+    if (raw_mode) {
+        bool mode_create_only;
+
+        rule.mode = vet_mode(raw_mode, &rule.mask, &rule.defmode, &mode_create_only);
+        if (!rule.defmode && rule.mode == (mode_t)-1)
+            rules_warned = true;
+    }
+
+    // FIXME handle '~'
+    if (raw_age) {
+        if (vet_age(raw_age, &subonly, &rule.age))
+            rule.has_age = true;
+        else if (*raw_age != '-')
+            rules_warned = true;
+        rule.subonly = subonly;
+    }
+
+    /* specifiers are expanded by apply_rule(), as some (%b) are only good
+     * until the next boot */
+    if (rules_add(&rules, &rule, raw_path, raw_arg)) {
+        warn("parse_line: rules_add");
+        goto fail;
+    }
+
+    /* as tmpfiles.d(5), the first line to create (or remove) a path wins.
+     * paths are compared as written, before specifiers are expanded, so
+     * "d /run/%u" and "d /run/0" are not duplicates. x and X do not claim:
+     * they all go into the one set of ignores for the run, where a repeat
+     * changes nothing, and an x and an X for the same path both count */
+    if ((cfg_elem->options & CFG_OWNS) && !(rule.mod & MOD_PLUS)) {
+        size_t owner;
+
+        switch (rules_claim(&rules, rules.count - 1, &owner))
+        {
+            case 1:
+                if (debug)
+                    printf("DEBUG: %s: duplicate line for %s, ignoring (first in %s)\n",
+                            rule_file(rules.count - 1), raw_path, rule_file(owner));
+                rules_pop(&rules);
+                rules_dropped++;
+                break;
+            case -1:
+                warn("parse_line: rules_claim");
+                break;
+        }
+    }
+
+    return 0;
+
+fail:
+    rules_warned = true;
+    return -1;
+}
+
+/* --plan: records what rule, just applied, would have done */
+__attribute__((nonnull))
+static void plan_note(const struct rule *rule)
+{
+    struct plan_result *res;
+
+    if (plan_count == plan_cap) {
+        size_t new_cap = plan_cap ? plan_cap * 2 : 64;
+        struct plan_result *tmp;
+
+        if ((tmp = realloc(plan_results, new_cap * sizeof(struct plan_result))) == NULL) {
+            warn("plan_note: realloc");
+            return;
+        }
+
+        plan_results = tmp;
+        plan_cap = new_cap;
+    }
+
+    res = &plan_results[plan_count++];
+    res->rule = rule - rules.rules;
+    res->scanned = atomic_load(&plan_scanned);
+    res->dirs = atomic_load(&plan_dirs);
+    res->files = atomic_load(&plan_files);
+    res->bytes = atomic_load(&plan_bytes);
+    res->time = elapsed(&plan_start);
+}
+
+__attribute__((nonnull))
+static void json_string(const char *str)
+{
+    putchar('"');
+
+    for (const unsigned char *ptr = (const unsigned char *)str; *ptr; ptr++)
+        if (*ptr == '"' || *ptr == '\\')
+            printf("\\%c", *ptr);
+        else if (*ptr < 0x20)
+            printf("\\u%04x", *ptr);
+        else
+            putchar(*ptr);
+
+    putchar('"');
+}
+
+/* --plan: shows every rule that would have scanned or deleted anything, then
+ * the totals */
+static void show_plan(void)
+{
+    struct plan_result total = { 0, 0, 0, 0, 0, { 0, 0 } };
+    const struct plan_result *res;
+    const struct rule *rule;
+    bool first = true;
+
+    if (plan_json)
+        printf("{\"rules\":[");
+
+    for (size_t i = 0; i < plan_count; i++)
+    {
+        res = &plan_results[i];
+        rule = &rules.rules[res->rule];
+
+        total.scanned += res->scanned;
+        total.dirs += res->dirs;
+        total.files += res->files;
+        total.bytes += res->bytes;
+        total.time.tv_sec += res->time.tv_sec;
+        total.time.tv_nsec += res->time.tv_nsec;
+        if (total.time.tv_nsec >= 1000000000L) {
+            total.time.tv_sec++;
+            total.time.tv_nsec -= 1000000000L;
+        }
+
+        if (!res->scanned && !res->files)
+            continue;
+
+        if (plan_json) {
+            printf("%s{\"file\":", first ? "" : ",");
+            json_string(rule_file(res->rule));
+            printf(",\"type\":\"%c\",\"path\":", rule->type);
+            json_string(rules_str(&rules, rule->path));
+            printf(",\"scanned\":%lu,\"dirs\":%lu,\"files\":%lu,\"bytes\":%llu,"
+                    "\"seconds\":%ld.%06ld}",
+                    res->scanned, res->dirs, res->files,
+                    (unsigned long long)res->bytes,
+                    (long)res->time.tv_sec, res->time.tv_nsec / 1000L);
+        } else
+            printf("PLAN: %s: %c %s: %lu scanned, %lu dir(s), %lu file(s), "
+                    "%llu bytes, %ld.%06lds\n",
+                    rule_file(res->rule), rule->type, rules_str(&rules, rule->path),
+                    res->scanned, res->dirs, res->files,
+                    (unsigned long long)res->bytes,
+                    (long)res->time.tv_sec, res->time.tv_nsec / 1000L);
+
+        first = false;
+    }
+
+    if (plan_json)
+        printf("],\"total\":{\"scanned\":%lu,\"dirs\":%lu,\"files\":%lu,"
+                "\"bytes\":%llu,\"seconds\":%ld.%06ld}}\n",
+                total.scanned, total.dirs, total.files,
+                (unsigned long long)total.bytes,
+                (long)total.time.tv_sec, total.time.tv_nsec / 1000L);
+    else
+        printf("PLAN: total: %lu scanned, %lu dir(s), %lu file(s), %llu bytes, "
+                "%ld.%06lds\n",
+                total.scanned, total.dirs, total.files,
+                (unsigned long long)total.bytes,
+                (long)total.time.tv_sec, total.time.tv_nsec / 1000L);
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int apply_rule(const struct rule *rule)
+{
+    const char *raw_path = rules_str(&rules, rule->path);
+    const char *raw_arg  = rules_str(&rules, rule->arg);
+    const char *dest = NULL, *arg = NULL;
+    char *path = NULL;
+
+    int i = 0;
+    int rc = 0;
+
+    char  **globs    = NULL;
+    size_t  nglobs   = 0;
+
+    const struct config_element *cfg_elem;
+    const struct timeval *age = rule->has_age ? &rule->age : NULL;
+    dev_t dev = 0;
+
+    /* the start of the next config file */
+    if (rule->type == '\0')
+        return 0;
+
+    if (do_plan) {
+        atomic_store(&plan_scanned, 0);
+        atomic_store(&plan_dirs, 0);
+        atomic_store(&plan_files, 0);
+        atomic_store(&plan_bytes, 0);
+        clock_gettime(CLOCK_MONOTONIC, &plan_start);
+    }
+
+    if (opt_prefix && strncmp(opt_prefix, raw_path, strlen(opt_prefix)))
+        goto cleanup;
+
+    if (opt_exclude && !strncmp(opt_exclude, raw_path, strlen(opt_exclude)))
+        goto cleanup;
+
+    cfg_elem = &configuration[(uint8_t)rule->type];
+
+    /* perform tmpfiles.d specific expansions */
+    if ((dest = vet_path(raw_path)) == NULL)
+        goto cleanup;
+    if (raw_arg) arg = vet_path(raw_arg);
+
+    path = pathcat(opt_root, dest);
+
+    if (path == NULL)
+        goto cleanup;
+
+    /* skip if not applicable due to boot mode & settings */
+    if ((do_boot && !(rule->mod & MOD_BOOT_ONLY)) 
+            || (!do_boot && (rule->mod & MOD_BOOT_ONLY)))
+        goto cleanup;
+
+    /* TODO process ARG_NODE */
+    if (cfg_elem->arg_type == ARG_NODE) {
+        if (arg == NULL) {
+            warn("apply_rule: missing argument for device node");
+            rc = -1;
+            goto cleanup;
+        }
+
+        if ((dev = vet_dev(arg)) == (dev_t)-1) {
+            rc = -1;
+            goto cleanup;
+        }
+    } else
+        dev = -1;
+
+    if ((cfg_elem->options & CFG_GLOB)) {
+        if (glob_file(path, &globs, &nglobs)) {
+            if (errno != ENOENT) {
+                rc = -1;
+                warn("apply_rule: glob_file: <%s>", path);
+            }
+            goto cleanup;
+        }
+
+        for (i = 0; i < (int)nglobs; i++) {
+            if (execute_action(
+                        cfg_elem->act, globs[i], age, arg,
+                        rule->mode, rule->defmode, rule->mask,
+                        rule->defuid, rule->uid,
+                        rule->defgid, rule->gid,
+                        rule->subonly,
+                        rule->mod,
+                        raw_path,
+                        dev
+                        )) {
+                /* failed */ ;
+            }
+        }
+    } else {
+        if (execute_action(
+                    cfg_elem->act, path, age, arg,
+                    rule->mode, rule->defmode, rule->mask,
+                    rule->defuid, rule->uid,
+                    rule->defgid, rule->gid,
+                    rule->subonly,
+                    rule->mod,
+                    raw_path,
+                    dev
+                    )) {
+            /* failed */ ;
+        }
+    }
+
+cleanup:
+
+    if (path)
+        free(path);
+    if (arg && arg != raw_arg)
+        free((char *)arg);
+    if (dest && dest != raw_path)
+        free((char *)dest);
+    if (globs)
+        pathglob_free(globs, nglobs);
+
+    if (do_plan)
+        plan_note(rule);
+
+    return rc;
+}
+
+__attribute__((nonnull(1), access(read_only, 1), access(read_only, 2)))
+static int process_file(const char *file, const char *folder)
+{
+    static const struct rule file_start = { .type = '\0' };
+    char *in = NULL;
+    char *line = NULL;
+    struct cfgmap map;
+    int len = 0;
+    int rc = -1;
+
+    if (folder) {
+        len = strlen(file) + strlen(folder) + 2;
+        if ((in = calloc(1, len)) == NULL) {
+            warn("process_file: calloc");
+            return -1;
+        }
+        snprintf(in, len, "%s/%s", folder, file);
+    } else {
+        if ((in = strdup(file)) == NULL) {
+            warn("process_file: strdup");
+            return -1;
+        }
+    }
+
+    if (rules_add(&rules, &file_start, in, NULL)) {
+        warn("process_file: rules_add");
+        rules_warned = true;
+        goto done;
+    }
+
+    if (cfgmap_open(&map, in)) {
+        warn("process_file: cfgmap_open: <%s>", in);
+        rules_warned = true;
+        goto done;
+    }
+
+    while ( (line = cfgmap_next_line(&map)) != NULL )
+    {
+        if (parse_line(line))
+            rc = -1;
+    }
+
+    cfgmap_close(&map);
+    rc = 0;
+
+done:
+    free(in);
+    return rc;
+}
+
+/* adds the config files in folder, config_dirs[dir], to files */
+__attribute__((nonnull))
+static int list_folder(const char *folder, int dir, struct config_file **files,
+        size_t *count, size_t *cap)
+{
+    DIR *dirp;
+    struct dirent *dirent;
+
+    if ((dirp = opendir(folder)) == NULL) {
+        warn("list_folder: opendir: <%s>", folder);
+        return -1;
+    }
+
+    int rc = 0;
+
+    while( (dirent = readdir(dirp)) )
+    {
+        if (!is_config_file(dirent->d_name))
+            continue;
+
+        if (*count == *cap) {
+            size_t new_cap = *cap ? *cap * 2 : 64;
+            struct config_file *new_files;
+
+            if ((new_files = realloc(*files, new_cap * sizeof(struct config_file))) == NULL) {
+                warn("list_folder: realloc");
+                rc = -1;
+                break;
+            }
+
+            *files = new_files;
+            *cap = new_cap;
+        }
+
+        if (((*files)[*count].name = strdup(dirent->d_name)) == NULL) {
+            warn("list_folder: strdup");
+            rc = -1;
+            break;
+        }
+
+        (*files)[(*count)++].dir = dir;
+    }
+
+    closedir(dirp);
+    return rc;
+}
+
+/* by name, then by the precedence of the directory it is in */
+__attribute__((nonnull, warn_unused_result))
+static int config_file_cmp(const void *a, const void *b)
+{
+    const struct config_file *fa = a, *fb = b;
+    int rc;
+
+    if ((rc = strcmp(fa->name, fb->name)) != 0)
+        return rc;
+
+    return fa->dir - fb->dir;
+}
+
+static void clean_config_files(void)
+{
+    if (config_files == NULL)
+        return;
+
+    for (int i = 0; i < num_config_files; i++)
+        if (config_files[i]) {
+            free (config_files[i]);
+            config_files[i] = NULL;
+        }
+
+    free(config_files);
+}
+
+static void clean_constants(void)
+{
+    if (hostname)
+        free(hostname);
+    if (machineid)
+        free(machineid);
+    if (kernelrel)
+        free(kernelrel);
+    if (bootid)
+        free(bootid);
+    ignore_clear(&ignores);
+    ignore_clear(&clean_roots);
+    free(plan_results);
+    if (opt_prefix)
+        free(opt_prefix);
+    if (opt_exclude)
+        free(opt_exclude);
+    if (opt_root && opt_root != default_opt_root)
+        free(opt_root);
+    if (apply_pool)
+        workpool_destroy(apply_pool);
+    if (clean_pool)
+        workpool_destroy(clean_pool);
+    if (copy_pool)
+        workpool_destroy(copy_pool);
+    if (clean_ring)
+        uring_destroy(clean_ring);
+    if (clean_index)
+        cidx_free(clean_index);
+    if (clean_index_path)
+        free(clean_index_path);
+    if (trash)
+        trash_destroy(trash);
+    if (trash_path)
+        free(trash_path);
+    expiry_clear(&expiries);
+    expiry_clear(&evictions);
+    rules_clear(&rules);
+    if (rule_cache_path)
+        free(rule_cache_path);
+    if (nss)
+        nss_destroy(nss);
+    if (globber)
+        pathglob_destroy(globber);
+    if (dir_watches)
+        watch_destroy(dir_watches);
+}
+
+
+
+
+/* the order rules are applied in, lowest first: as tmpfiles.d(5) has them
+ * apply to the whole clean, every x and X is applied before anything
+ * else, rather than only those earlier in the same file */
+__attribute__((nonnull, warn_unused_result))
+static int rule_rank(const struct rule *rule)
+{
+    if (rule->type == '\0')
+        return -1;
+
+    switch (configuration[(uint8_t)rule->type].act)
+    {
+        case IGN:
+        case IGNR:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/* adds what identifies the file (or directory) at path, or why it could not
+ * be, to hash */
+__attribute__((nonnull, warn_unused_result))
+static uint64_t hash_stat(uint64_t hash, int dirfd, const char *path)
+{
+    struct stat sb;
+
+    hash = rules_hash(hash, path, strlen(path) + 1);
+
+    if (fstatat(dirfd, path, &sb, 0) == -1)
+        return rules_hash(hash, &errno, sizeof(errno));
+
+    hash = rules_hash(hash, &sb.st_dev, sizeof(sb.st_dev));
+    hash = rules_hash(hash, &sb.st_ino, sizeof(sb.st_ino));
+    hash = rules_hash(hash, &sb.st_size, sizeof(sb.st_size));
+    hash = rules_hash(hash, &sb.st_mtim, sizeof(sb.st_mtim));
+    hash = rules_hash(hash, &sb.st_ctim, sizeof(sb.st_ctim));
+
+    return hash;
+}
+
+/* --rule-cache: a key for everything the rules are parsed from: each config
+ * directory, the config files in it and any given on the command line. it
+ * is taken before they are read, so a change while they are being read is
+ * seen by the next run */
+static uint64_t config_key(void)
+{
+    uint64_t hash = RULES_HASH_INIT;
+    struct dirent *dirent;
+    char *tmppath;
+    DIR *dirp;
+
+    hash = rules_hash(hash, VERSION, sizeof(VERSION));
+    hash = rules_hash(hash, opt_root, strlen(opt_root) + 1);
+
+    for (int i = 0; nss_files[i]; i++)
+        hash = hash_stat(hash, AT_FDCWD, nss_files[i]);
+
+    for (int i = 0; config_dirs[i]; i++) {
+        if ((tmppath = pathcat(opt_root, config_dirs[i])) == NULL)
+            err(EXIT_FAILURE, "config_key: pathcat");
+
+        hash = hash_stat(hash, AT_FDCWD, tmppath);
+
+        if ((dirp = opendir(tmppath)) != NULL) {
+            while ( (dirent = readdir(dirp)) )
+                if (is_config_file(dirent->d_name))
+                    hash = hash_stat(hash, dirfd(dirp), dirent->d_name);
+            closedir(dirp);
+        }
+
+        free(tmppath);
+    }
+
+    for (int i = 0; i < num_config_files; i++) {
+        if (config_files[i] == NULL)
+            continue;
+
+        if ((tmppath = pathcat(opt_root, config_files[i])) == NULL)
+            err(EXIT_FAILURE, "config_key: pathcat");
+
+        hash = hash_stat(hash, AT_FDCWD, tmppath);
+        free(tmppath);
+    }
+
+    return hash;
+}
+
+/* parses every config file into rules, or with --rule-cache loads them
+ * instead if none have changed since they were last saved */
+static void read_config(void)
+{
+    char *dirpaths[sizeof(config_dirs) / sizeof(config_dirs[0])];
+    struct config_file *files = NULL;
+    size_t nfiles = 0, files_cap = 0;
+    uint64_t key = 0;
+
+    rules_clear(&rules);
+    rules_warned = false;
+    rules_read = true;
+
+    if (rule_cache_path) {
+        key = config_key();
+
+        if (rules_load(&rules, rule_cache_path, key) == 0) {
+            if (debug)
+                printf("DEBUG: rule cache: loaded %lu rules\n", (unsigned long)rules.count);
+            if (nss_restore(nss, rules.extra, rules.extra_len))
+                warn("read_config: nss_restore");
+            return;
+        }
+
+        if (debug)
+            printf("DEBUG: rule cache: %s, parsing config files\n", strerror(errno));
+    }
+
+    /* as tmpfiles.d(5), a file in /etc overrides one of the same name in
+     * /run, which overrides one in /usr/lib, and all are read in the order
+     * of their names, regardless of the directory they are in */
+    for (int i = 0; config_dirs[i]; i++) {
+        if ((dirpaths[i] = pathcat(opt_root, config_dirs[i])) == NULL)
+            err(EXIT_FAILURE, "main: pathcat");
+        list_folder(dirpaths[i], i, &files, &nfiles, &files_cap);
+    }
+
+    if (nfiles)
+        qsort(files, nfiles, sizeof(struct config_file), config_file_cmp);
+
+    rules_dropped = 0;
 
-                    if ((src = pathcat(buf, rawpath)) == NULL) {
-                        warn("COPY: pathcat(factory)");
-                        break;
-                    }
-                    factory = true;
-                }
+    for (size_t i = 0, first = 0; i < nfiles; i++) {
+        if (i && !strcmp(files[i].name, files[first].name)) {
+            if (debug)
+                printf("DEBUG: %s/%s: overridden by %s/%s\n",
+                        dirpaths[files[i].dir], files[i].name,
+                        dirpaths[files[first].dir], files[first].name);
+            continue;
+        }
 
-                if (stat(src, &sb) == -1) {
-                    if (errno != ENOENT)
-                        warn("COPY: stat: <%s>", src);
-                    free(src);
-                    break;
-                }
+        first = i;
+        process_file(files[i].name, dirpaths[files[i].dir]);
+    }
 
-                src_dir = !!S_ISDIR(sb.st_mode);
+    for (size_t i = 0; i < nfiles; i++)
+        free(files[i].name);
+    free(files);
 
-                /* process actions */
+    for (int i = 0; config_dirs[i]; i++)
+        free(dirpaths[i]);
 
-                if (do_clean && age) {
-                    /* TODO */
-                }
+    for (int i = 0; i < num_config_files; i++) {
+        if (config_files[i] == NULL) /* should not happen? */
+            continue;
 
-                if (do_create) {
-                    if (src_dir && !dest_dir) {
-                        warn("COPY: attempt to copy folder(%s) to file(%s)", src, path);
-                        break;
-                    } 
+        char *tmp;
+        if ((tmp = pathcat(opt_root, config_files[i])) == NULL) {
+            warn("main: pathcat");
+        } else {
+            process_file(tmp, NULL);
+            free(tmp);
+        }
+    }
 
-                    if (copy_src_dir(src, path))
-                        warn("COPY: copy_src_dir");
-                   
-                    /* TODO */
-                    if (factory) {
-                    } else {
-                    }
+    /* only needed while parsing */
+    rules_claims_clear(&rules);
 
-                    if (debug)
-                        printf("DEBUG: copy: src=%s dest=%s exists=%d dest_dir=%d "
-                                "src_dir=%d factory=%d\n",
-                                src, path, exists, dest_dir, src_dir, factory);
-                }
+    if (debug && rules_dropped)
+        printf("DEBUG: %lu duplicate line(s) ignored\n", rules_dropped);
 
-                free(src);
-            }
-            break;
+    if (rules_sort(&rules, rule_rank)) {
+        warn("read_config: rules_sort");
+        rules_warned = true;
+    }
 
-            /* L - Create a symlink if it does not exist
-             * L+ - Unlink and then create
-             *
-             * Mode: ignored
-             * UID/GID: ignored
-             * Argument: if empty, symlink to /usr/share/factory/$NAME
-             */
-        case CREATE_SYM: // FIXME handle NULL dest => /usr/share/factory
-            if (do_clean && age) {
-                /* TODO */
-            }
+    if (rule_cache_path == NULL)
+        return;
 
-            if (do_create) {
-                if (strncmp("../", arg, 3) )
-                    dest = pathcat(opt_root, arg);
-                else
-                    dest = strdup(arg);
+    if (rules_warned) {
+        if (debug)
+            printf("DEBUG: rule cache: not saved, as some lines were not parsed\n");
+    } else if (do_plan) {
+        /* --plan changes nothing, the cache included */
+        if (debug)
+            printf("DEBUG: rule cache: not saved with --plan\n");
+    } else {
+        /* once applied, so that the lookups of expand_path() are saved too */
+        rules_key = key;
+        rules_unsaved = true;
+    }
+}
 
-                if (dest == NULL) {
-                    warn("CREATE_SYM: dest is NULL: <%s>", path);
-                    break;
-                }
+/* --rule-cache: saves the rules just read, and every user and group looked
+ * up while reading and applying them */
+static void save_rules(void)
+{
+    void *buf = NULL;
+    size_t len = 0;
 
-                struct stat sb;
-                ret = lstat(path, &sb);
+    rules_unsaved = false;
 
-                if (ret == -1 && errno != ENOENT) {
-                    /* failed to stat with a worrying error */
-                    warn("CREATE_SYM: open: <%s> => <%s>", path, dest);
-                    break;
-                } else if (ret == -1) {
-                    /* must be ENOENT, so fine */
-                } else if (!S_ISLNK(sb.st_mode) && (mod & MOD_PLUS)) {
-                    /* if the existing file is NOT a symlink, we have a problem */
-                    warnx("CREATE_SYM: existing file is not a symlink: <%s>", path);
-                    break;
-                } else if (!(mod & MOD_PLUS)) {
-                    /* file exists so ignore */
-                    if (debug)
-                        printf("DEBUG: SKIP:  symlink dest=%s path=%s\n", dest, path);
-                    break;
-                } else if ((mod & MOD_PLUS) && unlink_wrapper(path, false)) {
-                    /* file exists, but we had a problem removing it first */
-                    warn("CREATE_SYM: unlink_wrapper: <%s>", path);
-                    break;
-                }
+    if (nss_dump(nss, &buf, &len)) {
+        warn("save_rules: nss_dump");
+        buf = NULL;
+        len = 0;
+    }
 
-                if (symlink(dest, path) == -1) {
-                    warn("CREATE_SYM: symlink(%s, %s)", dest, path);
-                    break;
-                }
+    if (rules_save(&rules, rule_cache_path, rules_key, buf, len))
+        warn("save_rules: rules_save(%s)", rule_cache_path);
 
-                if (debug)
-                    printf("DEBUG: DONE:  symlink dest=%s path=%s\n", dest, path);
-            }
-            break;
+    free(buf);
+}
 
-            /* c  - Create a character file if it does not exist
-             * c+ - Remove and create a character file
-             * b  - Create a block device node if it does not exist
-             * b+ - Remove and create
-             * p  - Create a pipe (FIFO) if it does not exist
-             * p+ - Remove and create a pipe (FIFO)
-             *
-             * Argument: ignored
-             */
-        case CREATE_CHAR:
-        case CREATE_BLK:
-        case CREATE_PIPE:
-            if (do_clean && age) {
-                /* TODO */
-            }
+/* --jobs: can rule be applied alongside others? not x or X, as the others
+ * need their ignores, nor anything with specifiers (expand_path() is not
+ * thread safe) or a glob, as either may reach anywhere */
+__attribute__((nonnull, warn_unused_result))
+static bool rule_parallel(const struct rule *rule)
+{
+    const char *path = rules_str(&rules, rule->path);
+    const char *arg  = rules_str(&rules, rule->arg);
+
+    if (rule_rank(rule) != 1)
+        return false;
+    if (strchr(path, '%') || (arg && strchr(arg, '%')))
+        return false;
+    /* as glob_file() decides, since pathglob_match() shares one cache */
+    if ((configuration[(uint8_t)rule->type].options & CFG_GLOB) &&
+            strpbrk(path, PATHGLOB_MAGIC))
+        return false;
+
+    return true;
+}
 
-            if (do_create) {
-                struct stat sb;
-                ret = stat(path, &sb);
+/* is a the same path as b, or a directory above it */
+__attribute__((nonnull, warn_unused_result))
+static bool path_covers(const char *a, const char *b)
+{
+    size_t len = strlen(a);
 
-                if (ret == -1 && errno != ENOENT) {
-                    /* failed to stat with unknown error */
-                    warn("CREATE_CHAR/BLK/PIPE: lstat");
-                    break;
-                } else if (ret == -1) {
-                    /* NOENT: OK */
-                } else if (ret != -1 && !(mod & MOD_PLUS)) {
-                    /* file exists, but not c+ */
-                    if (debug)
-                        printf("DEBUG: SKIP:  create_char/blk %s\n", path);
-                    break;
-                } else if (ret != -1 && (mod & MOD_PLUS) && unlink_wrapper(path, false)) {
-                    warn("CREATE_CHAR/BLK/PIPE: unlink_wrapper(%s)", path);
-                    goto fail;
-                }
+    if (strncmp(a, b, len))
+        return false;
 
-                switch (act) 
-                {
-                    case CREATE_CHAR:  mode = S_IFCHR; break;
-                    case CREATE_BLK:   mode = S_IFBLK; break;
-                    case CREATE_PIPE:  mode = 0;       break;
-                }
+    return b[len] == '\0' || b[len] == '/' || (len && a[len - 1] == '/');
+}
 
-                char *tmppath;
-                if ((tmppath = strdup(path)) == NULL)
-                    err(EXIT_FAILURE, "strdup(path)");
+/* --jobs: a rule, and those that wait for it */
+struct rule_node {
+    const struct rule *rule;
+    struct rule_node **children;
+    size_t nchildren;
+};
 
-                mkpath(dirname(tmppath), def_folder_mode);
-                free(tmppath);
+/* apply_pool worker: applies a rule, then queues those waiting for it */
+static void apply_rule_task(void *arg)
+{
+    struct rule_node *node = arg;
 
-                mode |= (defmode ? def_file_mode : mode);
+    if (apply_rule(node->rule)) {
+        /* failed */ ;
+    }
 
-                switch (act)
-                {
-                    case CREATE_PIPE:
-                        if (mkfifo(path, mode)) {
-                            warn("CREATE_PIPE: mkfifo: <%s>", path);
-                            goto fail;
-                        }
-                        break;
+    for (size_t i = 0; i < node->nchildren; i++)
+        if (workpool_submit(apply_pool, apply_rule_task, node->children[i]))
+            apply_rule_task(node->children[i]);
+}
 
-                    case CREATE_CHAR:
-                    case CREATE_BLK:
-                        if (mknod(path, mode, dev)) {
-                            warn("CREATE_CHAR/BLK: mknod(%s)", path);
-                            goto fail;
-                        }
-                        break;
-                }
+/* --jobs: applies rules.order[from] to rules.order[to - 1], all of which
+ * pass rule_parallel(), on apply_pool. each waits for the last rule before
+ * it for its own path or a directory above it, which in path order is on
+ * top of a stack of the paths seen so far. anything else, such as a rule
+ * for a sibling tree, runs alongside it */
+__attribute__((warn_unused_result))
+static int apply_parallel(size_t from, size_t to)
+{
+    const size_t count = to - from;
+    struct rule_node *nodes, **kids;
+    size_t *parent, *stack, depth = 0;
+
+    nodes  = calloc(count, sizeof(struct rule_node));
+    kids   = calloc(count, sizeof(struct rule_node *));
+    parent = calloc(count, sizeof(size_t));
+    stack  = calloc(count, sizeof(size_t));
+
+    if (nodes == NULL || kids == NULL || parent == NULL || stack == NULL) {
+        free(nodes);
+        free(kids);
+        free(parent);
+        free(stack);
+        return -1;
+    }
 
-                if (lchown(path, uid, gid))
-                    warn("chown(%s)", path);
+    for (size_t i = 0; i < count; i++) {
+        const struct rule *rule = &rules.rules[rules.order[from + i]];
+        const char *path = rules_str(&rules, rule->path);
 
-                if (debug)
-                    printf("DEBUG: create_char/blk %s\n", path);
-            }
-            break;
+        while (depth && !path_covers(rules_str(&rules, nodes[stack[depth - 1]].rule->path), path))
+            depth--;
 
-        default:
-            break;
+        nodes[i].rule = rule;
+        parent[i] = depth ? stack[depth - 1] : SIZE_MAX;
+        if (depth)
+            nodes[parent[i]].nchildren++;
+        stack[depth++] = i;
     }
 
-done:
-    if (dest)
-        free(dest);
-    if (fd != -1)  {
-        close(fd);
+    /* each node's children are a run of kids, in the order they were read */
+    for (size_t i = 0, off = 0; i < count; i++) {
+        nodes[i].children = kids + off;
+        off += nodes[i].nchildren;
+        nodes[i].nchildren = 0;
     }
-    return ret;
-fail:
-    ret = -1;
-    goto done;
+
+    for (size_t i = 0; i < count; i++)
+        if (parent[i] != SIZE_MAX) {
+            struct rule_node *up = &nodes[parent[i]];
+            up->children[up->nchildren++] = &nodes[i];
+        }
+
+    for (size_t i = 0; i < count; i++)
+        if (parent[i] == SIZE_MAX && workpool_submit(apply_pool, apply_rule_task, &nodes[i]))
+            apply_rule_task(&nodes[i]);
+
+    workpool_wait(apply_pool);
+
+    free(nodes);
+    free(kids);
+    free(parent);
+    free(stack);
+
+    return 0;
 }
 
-__attribute__((nonnull, warn_unused_result, access(read_only, 1)))
-static int process_line(const char *line)
+/* --clean: a directory with an aged line of its own is left out of the
+ * clean of any directory above it, so that each directory is read once,
+ * and what is in it is cleaned by the age of the closest line. found
+ * before anything is applied, as the lines above come first */
+static void plan_clean(void)
 {
-    char *raw_type = NULL, *raw_path = NULL, *raw_mode = NULL;
-    char *raw_uid  = NULL,  *raw_gid = NULL,  *raw_age = NULL;
-    char *arg      = NULL,  *raw_arg = NULL;
+    const struct rule *rule;
+    const char *raw_path, *dest;
+    char *path, *root;
+    size_t len;
 
-    char *dest = NULL, *src = NULL, *path = NULL;
+    ignore_clear(&clean_roots);
 
-    char type;
+    if (!do_clean)
+        return;
 
-    int subonly = 0;
-    int fields = 0;
-    int i = 0;
-    int rc = 0;
+    for (size_t i = 0; i < rules.count; i++)
+    {
+        rule = &rules.rules[i];
 
-    char  **globs    = NULL;
-    size_t  nglobs   = 0;
-    glob_t *fileglob = NULL;
+        /* v, q and Q are cleaned as d is */
+        if (!rule->type || !strchr("dDvqQ", rule->type) || !rule->has_age)
+            continue;
 
-    actions_t act;
-    uid_t uid = -1; bool defuid = true;
-    gid_t gid = -1; bool defgid = true;
-    mode_t mode = -1; bool defmode = true; mode_t mask = 0; bool mode_create_only = false;
-    dev_t dev = 0;
-    int mod = 0;
+        if ((do_boot && !(rule->mod & MOD_BOOT_ONLY))
+                || (!do_boot && (rule->mod & MOD_BOOT_ONLY)))
+            continue;
 
-    struct timeval *age = NULL;
+        raw_path = rules_str(&rules, rule->path);
 
-    const struct config_element *cfg_elem = NULL;
+        if (opt_prefix && strncmp(opt_prefix, raw_path, strlen(opt_prefix)))
+            continue;
+        if (opt_exclude && !strncmp(opt_exclude, raw_path, strlen(opt_exclude)))
+            continue;
 
-    errno = 0;
-    /* Type Path Mode User Group Age Argument */
-    fields = sscanf(line,
-            "%ms %ms %ms %ms %ms %ms %m[^\n]s",
-            &raw_type, &raw_path, &raw_mode, &raw_uid, &raw_gid, &raw_age, &raw_arg);
+        if ((dest = vet_path(raw_path)) == NULL)
+            continue;
 
-    /* Type and Path are mandatory for all types */
-    if (fields == EOF || fields < 2) {
-        rc = -1;
-        if (errno)
-            warn("process_line: sscanf");
-        else
-            warnx("process_line: bad line: %s\n", line);
-        goto cleanup;
+        path = pathcat(opt_root, dest);
+        if (dest != raw_path)
+            free((char *)dest);
+
+        if (path == NULL)
+            continue;
+
+        /* as "dir/", which is how is_pruned() looks for it */
+        for (len = strlen(path); len && path[len - 1] == '/'; len--)
+            path[len - 1] = '\0';
+
+        if ((root = malloc(len + 2)) == NULL || ignore_add(&clean_roots,
+                    strcat(strcpy(root, path), "/"), false))
+            warn("plan_clean: <%s>", path);
+
+        free(root);
+        free(path);
+    }
+}
+
+/* applies every rule, reading the config files first if they have not been
+ * since start up (or SIGHUP) */
+static void process_config(void)
+{
+    if (!rules_read)
+        read_config();
+
+    ignore_clear(&ignores);
+    plan_clean();
+    globber_stale = true;
+    /* a later pass of --daemon may find directories removed since */
+    mkpath_forget();
+
+    if (rules.order == NULL) {
+        /* could not be sorted, so as read */
+        for (size_t i = 0; i < rules.count; i++) {
+            if (!(configuration[(uint8_t)rules.rules[i].type].options & CFG_GLOB))
+                globber_stale = true;
+            if (apply_rule(&rules.rules[i])) {
+                /* failed */ ;
+            }
+        }
+        goto done;
+    }
+
+    for (size_t i = 0, end; i < rules.order_count; i = end) {
+        end = i + 1;
+
+        if (apply_pool && rule_parallel(&rules.rules[rules.order[i]])) {
+            while (end < rules.order_count && rule_parallel(&rules.rules[rules.order[end]]))
+                end++;
+
+            if (end - i > 1) {
+                globber_stale = true;
+                if (!apply_parallel(i, end))
+                    continue;
+                warn("process_config: apply_parallel");
+            }
+        }
+
+        /* one at a time, in order */
+        for (size_t j = i; j < end; j++) {
+            const struct rule *rule = &rules.rules[rules.order[j]];
+
+            if (!(configuration[(uint8_t)rule->type].options & CFG_GLOB))
+                globber_stale = true;
+            if (apply_rule(rule)) {
+                /* failed */ ;
+            }
+        }
     }
 
-    if (opt_prefix && strncmp(opt_prefix, raw_path, strlen(opt_prefix)))
-        goto cleanup;
+done:
+    if (rules_unsaved)
+        save_rules();
+}
 
-    if (opt_exclude && !strncmp(opt_exclude, raw_path, strlen(opt_exclude)))
-        goto cleanup;
+/* --daemon: deletes the file recorded in ent if it is (still) due, or
+ * records it again if it has been modified since */
+__attribute__((nonnull))
+static void expire_one(struct expiry *ent, time_t now)
+{
+    const char *name = ent->path + ent->name_off;
+    char *dirpath = NULL;
+    struct stat sb;
+    int dirfd;
 
-    if ((mod = validate_type(raw_type, &type)) == -1) {
-        warn("process_line: bad type format: %s", line);
-        goto cleanup;
-    }
+    /* if the path now leads somewhere else, leave that to the next clean */
+    if ((dirfd = survivor_dir(ent, &dirpath)) == -1)
+        goto done;
 
-    if (configuration[(uint8_t)type].act == ACT_NULL) {
-        warnx("process_line: invalid type: %s", line);
-        rc = -1;
-        goto cleanup;
-    }
+    const struct walk_dir top = { NULL, dirpath };
 
-    cfg_elem = &configuration[(uint8_t)type];
-    act = cfg_elem->act;
+    if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1 || S_ISDIR(sb.st_mode))
+        goto done;
 
-    /* ensure an argument is present for those that require it */
-    if (cfg_elem->arg_type && raw_arg == NULL) {
-        warnx("process_line: argument is mandaotry for type: %s", line);
-        rc = -1;
-        goto cleanup;
+    /* modified since, so not due yet */
+    if (now - sb.st_mtime <= ent->age) {
+        ent->due = sb.st_mtime + ent->age + 1;
+        if (!expiry_push(&expiries, ent))
+            ent->path = NULL;
+        goto done;
     }
 
-    /* validate & tidy up fields */
+    if (unlinkat_wrapper(dirfd, &top, name, false) && errno != ENOENT)
+        warn("expire: unlink(%s)", ent->path);
 
+done:
+    if (dirfd != -1)
+        close(dirfd);
+    free(dirpath);
+    free(ent->path);
+}
 
-    if (raw_uid) uid   = vet_uid(raw_uid, &defuid);
-    if (raw_gid) gid   = vet_gid(raw_gid, &defgid);
-    if (raw_mode) mode = vet_mode(raw_mode, &mask, &defmode, &mode_create_only);
-    // FIXME handle '~'
-    if (raw_age) age   = vet_age(raw_age, &subonly);
+/* a file system --free-target is being applied to */
+struct evict_fs {
+    uint64_t dev;
+    int64_t need;       /* bytes still to be freed */
+};
 
-    /* perform tmpfiles.d specific expansions */
-    if (raw_path) dest = vet_path(raw_path);
-    if (raw_arg)  arg  = vet_path(raw_arg);
+/* --free-target: deletes the files in evictions, oldest first, until each
+ * file system they are on has opt_free_target percent available. returns
+ * the number of file systems still short of it, or -1 on error */
+static int evict(unsigned long *deleted, uint64_t *freed)
+{
+    struct expiry *ents;
+    struct evict_fs *fs = NULL;
+    size_t nents = evictions.count, nfs = 0;
+    int short_fs = 0;
 
-    if (dest == NULL)
-        goto cleanup;
+    if (nents == 0)
+        return 0;
 
-    path = pathcat(opt_root, dest);
-    free(dest);
-    dest = NULL;
+    if ((ents = malloc(nents * sizeof(struct expiry))) == NULL) {
+        warn("evict: malloc");
+        return -1;
+    }
 
-    if (path == NULL)
-        goto cleanup;
+    /* the youngest is popped first */
+    for (size_t i = nents; i && !expiry_pop(&evictions, &ents[i - 1]); i--)
+        ;
 
-    /* skip if not applicable due to boot mode & settings */
-    if ((do_boot && !(mod & MOD_BOOT_ONLY)) 
-            || (!do_boot && (mod & MOD_BOOT_ONLY)))
-        goto cleanup;
+    for (size_t i = 0; i < nents; i++)
+    {
+        struct expiry *ent = &ents[i];
+        const char *name = ent->path + ent->name_off;
+        struct evict_fs *f = NULL;
+        char *dirpath = NULL;
+        struct stat sb;
+        int dirfd;
+
+        for (size_t j = 0; j < nfs; j++)
+            if (fs[j].dev == ent->dev)
+                f = &fs[j];
+
+        if (f && f->need <= 0)
+            goto next;
+
+        if ((dirfd = survivor_dir(ent, &dirpath)) == -1)
+            goto next;
+
+        if (f == NULL) {
+            struct evict_fs *new_fs;
+            struct statvfs vfs;
+
+            if ((new_fs = realloc(fs, (nfs + 1) * sizeof(struct evict_fs))) == NULL ||
+                    fstatvfs(dirfd, &vfs) == -1) {
+                if (new_fs)
+                    fs = new_fs;
+                warn("evict: fstatvfs(%s)", dirpath);
+                close(dirfd);
+                goto next;
+            }
 
-    /* TODO process ARG_NODE */
-    if (cfg_elem->arg_type == ARG_NODE) {
-        if (arg == NULL) {
-            warn("process_line: missing argument for device node");
-            rc = -1;
-            goto cleanup;
-        }
+            fs = new_fs;
+            f = &fs[nfs++];
+            f->dev = ent->dev;
+            f->need = (int64_t)((uint64_t)vfs.f_blocks * vfs.f_frsize / 100 * opt_free_target)
+                - (int64_t)((uint64_t)vfs.f_bavail * vfs.f_frsize);
 
-        if ((dev = vet_dev(arg)) == (dev_t)-1) {
-            rc = -1;
-            goto cleanup;
-        }
-    } else
-        dev = -1;
+            if (debug)
+                printf("DEBUG: free-target: %s: %" PRId64 " bytes to free\n",
+                        dirpath, MAX(f->need, (int64_t)0));
 
-    if ((cfg_elem->options & CFG_GLOB)) {
-        if (glob_file(path, &globs, &nglobs, &fileglob)) {
-            if (errno != ENOENT) {
-                rc = -1;
-                warn("process_line: glob_file: <%s>", path);
+            if (f->need <= 0) {
+                close(dirfd);
+                goto next;
             }
-            goto cleanup;
         }
 
-        for (i = 0; i < (int)nglobs; i++) {
-            if (execute_action(
-                        act, globs[i], age, arg,
-                        mode, defmode, mask,
-                        defuid, uid,
-                        defgid, gid,
-                        subonly,
-                        mod,
-                        raw_path,
-                        dev
-                        )) {
-                /* failed */ ;
-            }
-        }
-    } else {
-        if (execute_action(
-                    act, path, age, arg,
-                    mode, defmode, mask,
-                    defuid, uid,
-                    defgid, gid,
-                    subonly,
-                    mod,
-                    raw_path,
-                    dev
-                    )) {
-            /* failed */ ;
+        const struct walk_dir top = { NULL, dirpath };
+
+        /* only if it is the same file, unchanged since it was seen */
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(sb.st_mode) &&
+                sb.st_mtime == ent->age) {
+            if (unlinkat_wrapper(dirfd, &top, name, false) == 0) {
+                f->need -= ent->bytes;
+                *freed += ent->bytes;
+                (*deleted)++;
+            } else if (errno != ENOENT)
+                warn("evict: unlink(%s)", ent->path);
         }
+
+        close(dirfd);
+next:
+        free(dirpath);
+        free(ent->path);
     }
 
-cleanup:
+    for (size_t j = 0; j < nfs; j++)
+        if (fs[j].need > 0)
+            short_fs++;
 
-    if (src)
-        free(src);
-    if (raw_type)
-        free(raw_type);
-    if (path)
-        free(path);
-    if (raw_mode)
-        free(raw_mode);
-    if (raw_uid)
-        free(raw_uid);
-    if (raw_gid)
-        free(raw_gid);
-    if (raw_age)
-        free(raw_age);
-    if (raw_path)
-        free(raw_path);
-    if (raw_arg)
-        free(raw_arg);
-    if (arg)
-        free(arg);
-    if (dest)
-        free(dest);
-    if (age)
-        free(age);
-    if (fileglob)
-        globfree(fileglob);
+    free(fs);
+    free(ents);
 
-    return rc;
+    return short_fs;
 }
 
-__attribute__((nonnull(1), access(read_only, 1), access(read_only, 2)))
-static int process_file(const char *file, const char *folder)
+/* --free-target: evicts what the clean just done left, and if some files
+ * were not considered, cleans again to find them */
+static void free_space(void)
 {
-    char *in = NULL;
-    char *line = NULL;
-    FILE *fp = NULL;
-    ssize_t cnt = 0;
-    size_t ignore = 0;
-    int len = 0;
-    int rc = -1;
+    unsigned long deleted = 0, last;
+    uint64_t freed = 0;
+    int rc;
 
-    if (folder) {
-        len = strlen(file) + strlen(folder) + 2;
-        if ((in = calloc(1, len)) == NULL) {
-            warn("process_file: calloc");
-            return -1;
-        }
-        snprintf(in, len, "%s/%s", folder, file);
-    } else {
-        if ((in = strdup(file)) == NULL) {
-            warn("process_file: strdup");
-            return -1;
-        }
-    }
+    while (true)
+    {
+        last = deleted;
 
-    /* is this correct, or should ignores be kept between config files? */
-    if (ignores) {
-        ignores_size = 0;
-        free(ignores);
-        ignores = NULL;
-    }
+        if ((rc = evict(&deleted, &freed)) <= 0 || !evictions_dropped || deleted == last)
+            break;
 
-    if ((fp = fopen(in, "r")) == NULL) {
-        warn("process_file: fopen: <%s>", in);
-        goto done;
+        if (debug)
+            printf("DEBUG: free-target: looking for more files\n");
+
+        evictions_dropped = false;
+        process_config();
     }
 
-    while( (cnt = getline(&line, &ignore, fp)) != -1 )
-    {
-        if (line == NULL)
-            break;
+    expiry_clear(&evictions);
 
-        char *tmp_line = line;
-        line = trim(tmp_line);
-        free(tmp_line);
+    if (debug)
+        printf("DEBUG: free-target: %lu file(s), %" PRIu64 " bytes deleted\n",
+                deleted, freed);
 
-        if (line == NULL)
-            break;
+    if (rc > 0)
+        warnx("free-target: %d file system(s) still below %d%% free", rc, opt_free_target);
+}
 
-        if (cnt != 1 && line[0] != '#' && line[0] != '\n' && line[0])
-            if (process_line(line))
-                rc = -1;
+/* --daemon: a name has appeared in a watched directory, so clean it as a
+ * walk of that directory would have */
+__attribute__((nonnull(2,3)))
+static void watch_event(void *ctx, const struct watch_dir *wdir, const char *name)
+{
+    const struct walk_dir top = { NULL, wdir->path };
+    const struct timeval tv = { wdir->age, 0 };
+    const bool check_ignores = wdir->ignores != NULL;
+    const struct ignore_set saved = ignores;
+    struct stat sb;
+    int dirfd, fd;
 
-        free(line);
-        line = NULL;
+    (void)ctx;
+
+    if ((dirfd = open(wdir->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        return;
+
+    if (fstat(dirfd, &sb) == -1 || sb.st_dev != wdir->dev || sb.st_ino != wdir->ino ||
+            fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        close(dirfd);
+        return;
     }
 
-    if (line)
-        free(line);
+    /* the ignores of the config file the directory was cleaned from */
+    if (check_ignores)
+        ignores = *wdir->ignores;
 
-    fclose(fp);
-    rc = 0;
+    if (!S_ISDIR(sb.st_mode)) {
+        if (rm_if_old_at(dirfd, &top, name, &sb, &tv, check_ignores) && errno != ENOENT)
+            warn("watch: rm_if_old(%s%s)", wdir->path, name);
+    } else if (!is_pruned(&top, name, check_ignores) &&
+            (fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) != -1) {
+        const struct walk_dir sub = { &top, name };
 
-done:
-    free(in);
-    return rc;
+        if (rm_rf_at(fd, &sub, &tv, check_ignores, false, NULL))
+            warnx("watch: rm_rf(%s%s)", wdir->path, name);
+    }
+
+    ignores = saved;
+    close(dirfd);
 }
 
-__attribute__((nonnull))
-static int process_folder(const char *folder)
+/* --daemon: cleans, then sleeps until the next file falls due, or a new one
+ * appears in a watched directory. everything is cleaned again on SIGHUP
+ * (after re-reading the config), if inotify loses events, and daily, so that
+ * it never does less than a run of --clean would, however many directories
+ * are watched. returns on SIGTERM or SIGINT */
+static void run_daemon(void)
 {
-    DIR *dirp;
-    struct dirent *dirent;
-    int len;
-
-    if ((dirp = opendir(folder)) == NULL) {
-        warn("process_folder: opendir: <%s>", folder);
-        return -1;
+    sigset_t set;
+    struct signalfd_siginfo info;
+    struct pollfd fds[2];
+    struct expiry ent;
+    time_t now, rescan, wake;
+    bool rescan_now = false;
+    int timeout, nfds = 1;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+
+    if ((fds[0].fd = signalfd(-1, &set, SFD_CLOEXEC)) == -1)
+        err(EXIT_FAILURE, "run_daemon: signalfd");
+    fds[0].events = POLLIN;
+
+    if (dir_watches) {
+        fds[1].fd = watch_fd(dir_watches);
+        fds[1].events = POLLIN;
+        nfds = 2;
     }
 
-    int rc = 0;
+    /* only --clean is repeated, anything else was done by the first pass */
+    do_create = 0;
+    do_remove = 0;
 
-    while( (dirent = readdir(dirp)) )
+    rescan = time(NULL) + daemon_rescan_interval;
+
+    while (true)
     {
-        if (is_dot(dirent->d_name))
+        now = time(NULL);
+
+        while (expiries.count && expiries.items[0].due <= now)
+            if (!expiry_pop(&expiries, &ent))
+                expire_one(&ent, now);
+
+        if (rescan_now || now >= rescan ||
+                (expiries_overflow && now >= expiries_overflow)) {
+            if (debug)
+                printf("DEBUG: daemon: rescan\n");
+            expiry_clear(&expiries);
+            expiries_overflow = 0;
+            rescan_now = false;
+            process_config();
+            rescan = time(NULL) + daemon_rescan_interval;
             continue;
-        if ((len = strlen(dirent->d_name)) <= (int)cfg_ext_len)
+        }
+
+        wake = rescan;
+        if (expiries.count && expiries.items[0].due < wake)
+            wake = expiries.items[0].due;
+        if (expiries_overflow && expiries_overflow < wake)
+            wake = expiries_overflow;
+
+        timeout = (int)MIN(wake - now, INT_MAX / 1000) * 1000;
+
+        if (debug) {
+            printf("DEBUG: daemon: %lu file(s) pending, sleeping %lds\n",
+                    (unsigned long)expiries.count, (long)(wake - now));
+        }
+
+        fflush(stdout);
+
+        if (poll(fds, nfds, timeout) == -1) {
+            if (errno != EINTR)
+                err(EXIT_FAILURE, "run_daemon: poll");
             continue;
-        if (strncmp(dirent->d_name + len - cfg_ext_len + 1, cfg_ext, cfg_ext_len))
+        }
+
+        if (nfds > 1 && (fds[1].revents & POLLIN)) {
+            int rc = watch_read(dir_watches, watch_event, NULL);
+
+            if (rc == -1)
+                warn("run_daemon: watch_read");
+            else if (rc == 1) {
+                if (debug)
+                    printf("DEBUG: daemon: inotify events lost\n");
+                rescan_now = true;
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN))
             continue;
 
-        if (process_file(dirent->d_name, folder))
-            rc = -1;
-    }
+        if (read(fds[0].fd, &info, sizeof(info)) != sizeof(info))
+            continue;
 
-    closedir(dirp);
-    return rc;
-}
+        if (info.ssi_signo != SIGHUP)
+            break;
 
-static void clean_config_files(void)
-{
-    if (config_files == NULL)
-        return;
+        if (debug)
+            printf("DEBUG: daemon: SIGHUP, reloading\n");
 
-    for (int i = 0; i < num_config_files; i++)
-        if (config_files[i]) {
-            free (config_files[i]);
-            config_files[i] = NULL;
-        }
+        rules_clear(&rules);
+        rules_read = false;
+        rescan_now = true;
+    }
 
-    free(config_files);
-}
+    if (debug)
+        printf("DEBUG: daemon: exiting on signal %u\n", info.ssi_signo);
 
-static void clean_constants(void)
-{
-    if (hostname)
-        free(hostname);
-    if (machineid)
-        free(machineid);
-    if (kernelrel)
-        free(kernelrel);
-    if (bootid)
-        free(bootid);
-    if (ignores)
-        free(ignores);
-    if (opt_prefix)
-        free(opt_prefix);
-    if (opt_exclude)
-        free(opt_exclude);
-    if (opt_root && opt_root != default_opt_root)
-        free(opt_root);
+    close(fds[0].fd);
 }
 
 
-
 
 /* public functions */
 
@@ -2093,6 +4117,33 @@ int main(int argc, char *argv[])
             case 'p': opt_prefix  = strdup(optarg); break;
             case 'e': opt_exclude = strdup(optarg); break;
             case 'r': opt_root    = strdup(optarg); break;
+            case 'j':
+                      if (!isnumber(optarg) || (opt_jobs = atoi(optarg)) < 1) {
+                          warnx("main: invalid number of jobs: %s", optarg);
+                          fail = 1;
+                      }
+                      break;
+            case 'f':
+                      {
+                          char *end;
+                          long pct = strtol(optarg, &end, 10);
+
+                          if (end == optarg || (*end && strcmp(end, "%")) || pct < 1 || pct > 99) {
+                              warnx("main: invalid free target: %s", optarg);
+                              fail = 1;
+                          } else
+                              opt_free_target = pct;
+                      }
+                      break;
+            case 'P':
+                      do_plan = 1;
+                      if (optarg && !strcmp(optarg, "json"))
+                          plan_json = true;
+                      else if (optarg && strcmp(optarg, "text")) {
+                          warnx("main: invalid plan format: %s", optarg);
+                          fail = 1;
+                      }
+                      break;
             case 'h': do_help = 1; break;
             case '?': fail    = 1; break;
 
@@ -2138,6 +4189,101 @@ int main(int argc, char *argv[])
     if (!opt_root)
         opt_root = (char *)default_opt_root;
 
+    if ((nss = nss_create()) == NULL)
+        err(EXIT_FAILURE, "main: nss_create");
+
+    if ((globber = pathglob_create()) == NULL)
+        err(EXIT_FAILURE, "main: pathglob_create");
+
+    if (do_plan) {
+        if (do_daemon)
+            errx(EXIT_FAILURE, "main: --plan cannot be used with --daemon");
+
+        if (do_create) {
+            warnx("main: --create is not used with --plan, ignoring");
+            do_create = 0;
+        }
+
+        if (opt_free_target) {
+            warnx("main: --free-target is not used with --plan, ignoring");
+            opt_free_target = 0;
+        }
+
+        /* so that every directory is read, and nothing else is written */
+        do_clean_index = 0;
+        do_uring = 0;
+    }
+
+    if (do_daemon) {
+        sigset_t set;
+
+        if (!do_clean)
+            errx(EXIT_FAILURE, "main: --daemon requires --clean");
+
+        if (do_clean_index) {
+            warnx("main: --clean-index is not used with --daemon, ignoring");
+            do_clean_index = 0;
+        }
+
+        /* blocked before any threads start, so only run_daemon() sees them */
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
+            err(EXIT_FAILURE, "main: pthread_sigmask");
+
+        if ((dir_watches = watch_create(max_watches)) == NULL && debug)
+            printf("DEBUG: inotify unavailable (%s), cleaning daily\n", strerror(errno));
+    }
+
+    /* --plan applies one rule at a time, so that each is measured alone */
+    if (opt_jobs > 1 && !do_plan && (apply_pool = workpool_create(opt_jobs)) == NULL)
+        err(EXIT_FAILURE, "main: workpool_create");
+
+    if (opt_jobs > 1 && do_create && (copy_pool = workpool_create(opt_jobs)) == NULL)
+        err(EXIT_FAILURE, "main: workpool_create");
+
+    if (opt_jobs > 1 && (do_clean || do_remove)) {
+        if ((clean_pool = workpool_create(opt_jobs)) == NULL)
+            err(EXIT_FAILURE, "main: workpool_create");
+    } else if (do_uring && (do_clean || do_remove)) {
+        if ((clean_ring = uring_create(clean_ring_entries)) == NULL && debug)
+            printf("DEBUG: io_uring unavailable (%s), using syscalls\n", strerror(errno));
+    }
+
+    if (opt_free_target && !do_clean)
+        errx(EXIT_FAILURE, "main: --free-target requires --clean");
+
+    if (do_rule_cache && (rule_cache_path = pathcat(opt_root, rule_cache_file)) == NULL)
+        err(EXIT_FAILURE, "main: pathcat");
+
+    if (do_clean_index && do_clean) {
+        if (opt_free_target)
+            warnx("main: --clean-index is not used with --free-target, ignoring");
+        else if (clean_pool || clean_ring)
+            warnx("main: --clean-index is only used by a serial clean, ignoring");
+        else if (debug_unlink)
+            warnx("main: --clean-index is not used with --debug-unlink, ignoring");
+        else if ((clean_index_path = pathcat(opt_root, clean_index_file)) == NULL)
+            err(EXIT_FAILURE, "main: pathcat");
+        else if ((clean_index = cidx_load(clean_index_path)) == NULL)
+            err(EXIT_FAILURE, "main: cidx_load");
+    }
+
+    if (do_trash && do_plan) {
+        warnx("main: --trash is not used with --plan, ignoring");
+        do_trash = 0;
+    }
+
+    if (!do_plan) {
+        if ((trash_path = pathcat(opt_root, trash_file)) == NULL)
+            err(EXIT_FAILURE, "main: pathcat");
+        if ((do_trash || access(trash_path, F_OK) == 0) &&
+                (trash = trash_create(trash_path, opt_root)) == NULL)
+            warn("main: trash_create(%s)", trash_path);
+    }
+
 #ifdef DEBUG
     printf("tmpfilesd running\ndo_create=%d,do_clean=%d,"
             "do_remove=%d,do_boot=%d\nroot=%s\n",
@@ -2145,37 +4291,77 @@ int main(int argc, char *argv[])
             root);
 #endif
 
-    char *tmppath;
+    process_config();
 
-    /* TODO move these to constants somewhere e.g. config.h */
-    if ((tmppath = pathcat(opt_root, "/etc/tmpfiles.d")) == NULL)
-        err(EXIT_FAILURE, "main: pathcat");
-    process_folder(tmppath);
-    free(tmppath);
+    if (opt_free_target) {
+        /* later passes only look for files to evict */
+        const int save_create = do_create, save_remove = do_remove;
 
-    if ((tmppath = pathcat(opt_root, "/run/tmpfiles.d")) == NULL)
-        err(EXIT_FAILURE, "main: pathcat");
-    process_folder(tmppath);
-    free(tmppath);
+        do_create = do_remove = 0;
+        free_space();
+        do_create = save_create;
+        do_remove = save_remove;
+    }
 
-    if ((tmppath = pathcat(opt_root, "/usr/lib/tmpfiles.d")) == NULL)
-        err(EXIT_FAILURE, "main: pathcat");
-    process_folder(tmppath);
-    free(tmppath);
+    if (trash) {
+        pid_t pid;
 
-    for (int i = 0; i < num_config_files; i++) {
-        if (config_files[i] == NULL) /* should not happen? */
-            continue;
+        if (do_trash && trash_save(trash))
+            warn("main: trash_save(%s)", trash_path);
 
-        char *tmp;
-        if ((tmp = pathcat(opt_root, config_files[i])) == NULL) {
-            warn("main: pathcat");
-        } else {
-            process_file(tmp, NULL);
-            free(tmp);
+        if ((pid = trash_empty(trash)) == -1)
+            warn("main: trash_empty");
+
+        /* all emptied, so later runs without --trash need not look */
+        if (pid == 0 && !do_trash && unlink(trash_path) == -1 && errno != ENOENT)
+            warn("main: unlink(%s)", trash_path);
+
+        if (debug && pid != -1) {
+            unsigned long moved;
+
+            trash_stats(trash, &moved);
+            printf("DEBUG: trash: %lu moved aside, emptied by pid %d\n", moved, (int)pid);
         }
     }
 
+    if (do_daemon)
+        run_daemon();
+
+    if (do_plan)
+        show_plan();
+
+    if (debug) {
+        unsigned long hits, misses;
+
+        nss_stats(nss, &hits, &misses);
+        printf("DEBUG: nss cache: %lu hit(s), %lu miss(es)\n", hits, misses);
+
+        pathglob_stats(globber, &hits, &misses);
+        printf("DEBUG: glob: %lu directories read, %lu reused\n", hits, misses);
+
+        uint64_t copied[COPY_MECHANISMS];
+
+        copy_stats(copied);
+        printf("DEBUG: copy: %llu bytes cloned, %llu by copy_file_range, "
+                "%llu by read/write\n",
+                (unsigned long long)copied[COPY_CLONE],
+                (unsigned long long)copied[COPY_RANGE],
+                (unsigned long long)copied[COPY_READ_WRITE]);
+
+        unsigned long files, dirs;
+
+        copy_counts(&files, &dirs);
+        printf("DEBUG: copy: %lu file(s), %lu directories\n", files, dirs);
+    }
+
+    if (clean_index) {
+        if (debug)
+            printf("DEBUG: clean index: %lu directories scanned, %lu skipped\n",
+                    cidx_scanned, cidx_skipped);
+        if (cidx_save(clean_index, clean_index_path))
+            warn("main: cidx_save(%s)", clean_index_path);
+    }
+
     /* TODO should this be EXIT_FAILURE if any single error/warning occured? */
     exit(EXIT_SUCCESS);
 }
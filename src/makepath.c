@@ -18,44 +18,237 @@
 #define _XOPEN_SOURCE 700
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
 
+#define KNOWN_BUCKETS 1024
+
+/* directories that exist, as found or made by mkpath(), so that each is
+ * only looked at once until mkpath_forget() */
+struct known_dir {
+    struct known_dir *next;
+    char path[];
+};
+
+static struct known_dir *known[KNOWN_BUCKETS];
+static pthread_mutex_t known_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t known_hash(const char *path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+
+    return (size_t)(h ^ (h >> 32)) % KNOWN_BUCKETS;
+}
+
+/* is the first len bytes of path a known directory */
+static bool known_find(const char *path, size_t len)
+{
+    const struct known_dir *ent;
+    bool ret = false;
+
+    pthread_mutex_lock(&known_lock);
+    for (ent = known[known_hash(path, len)]; ent; ent = ent->next)
+        if (!strncmp(ent->path, path, len) && ent->path[len] == '\0') {
+            ret = true;
+            break;
+        }
+    pthread_mutex_unlock(&known_lock);
+
+    return ret;
+}
+
+/* failing to remember one is not an error, it is just looked at again */
+static void known_add(const char *path, size_t len)
+{
+    struct known_dir *ent;
+    size_t bucket = known_hash(path, len);
+
+    if ((ent = malloc(sizeof(*ent) + len + 1)) == NULL)
+        return;
+
+    memcpy(ent->path, path, len);
+    ent->path[len] = '\0';
+
+    pthread_mutex_lock(&known_lock);
+    ent->next = known[bucket];
+    known[bucket] = ent;
+    pthread_mutex_unlock(&known_lock);
+}
+
+/**
+ * mkpath_forget - Forget every directory mkpath() has found or made
+ *
+ * For when any of them may have since been removed.
+ */
+void mkpath_forget(void)
+{
+    struct known_dir *ent, *next;
+
+    pthread_mutex_lock(&known_lock);
+    for (size_t i = 0; i < KNOWN_BUCKETS; i++)
+    {
+        for (ent = known[i]; ent; ent = next)
+        {
+            next = ent->next;
+            free(ent);
+        }
+        known[i] = NULL;
+    }
+    pthread_mutex_unlock(&known_lock);
+}
+
+/**
+ * mkpath_forget_tree - Forget @path, and every directory below it
+ * @path: Directory that may have since been removed, in part or whole
+ */
+void mkpath_forget_tree(const char *path)
+{
+    struct known_dir *ent, **prev;
+    size_t len;
+
+    for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+        ;
+
+    pthread_mutex_lock(&known_lock);
+    for (size_t i = 0; i < KNOWN_BUCKETS; i++)
+    {
+        for (prev = &known[i]; (ent = *prev) != NULL; )
+        {
+            if (!strncmp(ent->path, path, len) &&
+                    (ent->path[len] == '\0' || ent->path[len] == '/')) {
+                *prev = ent->next;
+                free(ent);
+            } else
+                prev = &ent->next;
+        }
+    }
+    pthread_mutex_unlock(&known_lock);
+}
+
 /**
  * mkpath - Like makepath() but takes a mode_t argument
  * @dir:  Directory to created, relative or absolute
  * @mode: A &mode_t mode to create @dir with
  *
+ * Starts from the closest directory above @dir already known to exist,
+ * and makes each component from there with mkdirat(), relative to the
+ * one above it.  Each directory is remembered, so is not looked at again
+ * until mkpath_forget().
+ *
  * Returns:
  * POSIX OK(0) on success, otherwise -1 with @errno set.
  */
 int mkpath(char *dir, mode_t mode)
 {
     struct stat sb;
-    char *tmp;
+    char *path;
+    size_t len, pos, end;
+    bool last;
+    int fd, next, rc = 0;
 
     if (dir == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    if (stat(dir, &sb) == 0)
-        return 0;
+    if (*dir == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
 
-    if (errno != ENOENT)
+    if ((path = strdup(dir)) == NULL)
         return -1;
 
-    if ((tmp = strdup(dir)) == NULL)
+    for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+        path[len - 1] = '\0';
+
+    if (known_find(path, len)) {
+        free(path);
+        return 0;
+    }
+
+    for (pos = len - 1; pos > 0; pos--)
+        if (path[pos] == '/' && path[pos - 1] != '/' && known_find(path, pos))
+            break;
+
+    fd = -1;
+    if (pos > 0) {
+        path[pos] = '\0';
+        fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        path[pos] = '/';
+
+        /* removed since, so start again from the top */
+        if (fd == -1) {
+            mkpath_forget();
+            pos = 0;
+        }
+    }
+
+    if (fd == -1 && (fd = open(*path == '/' ? "/" : ".",
+                    O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+        free(path);
         return -1;
+    }
+
+    while (true)
+    {
+        while (path[pos] == '/')
+            pos++;
+        if (path[pos] == '\0')
+            break;
+
+        for (end = pos; path[end] && path[end] != '/'; end++)
+            ;
+
+        last = path[end] == '\0';
+        path[end] = '\0';
 
-    mkpath(dirname(tmp), mode);
+        if (mkdirat(fd, path + pos, mode) == 0) {
+            if (last)
+                known_add(path, end);
+        } else if (errno != EEXIST) {
+            rc = -1;
+            break;
+        } else if (last) {
+            if (fstatat(fd, path + pos, &sb, 0) == 0 && S_ISDIR(sb.st_mode))
+                known_add(path, end);
+        }
 
-    free(tmp);
+        if (last)
+            break;
+
+        next = openat(fd, path + pos, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (next == -1) {
+            rc = -1;
+            break;
+        }
+
+        known_add(path, end);
+        path[end] = '/';
+
+        close(fd);
+        fd = next;
+        pos = end;
+    }
+
+    {
+        int saved = errno;
+
+        close(fd);
+        free(path);
+        errno = saved;
+    }
 
-    return mkdir(dir, mode);
+    return rc;
 }
 
 /**
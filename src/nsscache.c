@@ -0,0 +1,379 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+
+#include "nsscache.h"
+
+/* macros and defines */
+
+#define NSS_BUCKETS 256
+
+
+
+/* type defintions */
+
+typedef enum {
+    NSS_UID_BY_NAME = 0,
+    NSS_GID_BY_NAME,
+    NSS_USER_BY_UID,
+    NSS_GROUP_BY_GID,
+} nss_kind_t;
+
+struct nss_entry {
+    struct nss_entry *next;
+    uint8_t kind;
+    bool found;
+    uint32_t id;
+    char *name;     /* the key of a by name lookup, else the answer */
+    char *home;     /* NSS_USER_BY_UID only */
+};
+
+struct nss_cache {
+    struct nss_entry *buckets[NSS_BUCKETS];
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* how an entry is saved by nss_dump(), followed by the name and home, each
+ * without a NUL */
+struct nss_record {
+    uint8_t kind;
+    uint8_t found;
+    uint16_t name_len;
+    uint16_t home_len;
+    uint16_t pad;
+    uint32_t id;
+};
+
+
+
+/* private functions */
+
+static size_t nss_hash(uint8_t kind, uint32_t id, const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ kind;
+
+    if (name)
+        for (const unsigned char *ptr = (const unsigned char *)name; *ptr; ptr++)
+            h = (h ^ *ptr) * 0x100000001b3ULL;
+    else
+        h = (h ^ id) * 0x100000001b3ULL;
+
+    return (size_t)(h ^ (h >> 32)) % NSS_BUCKETS;
+}
+
+/* name for the by name kinds, id for the others */
+__attribute__((nonnull(1), warn_unused_result))
+static struct nss_entry *nss_find(struct nss_cache *cache, uint8_t kind,
+        uint32_t id, const char *name)
+{
+    struct nss_entry *ent;
+
+    for (ent = cache->buckets[nss_hash(kind, id, name)]; ent; ent = ent->next)
+        if (ent->kind == kind && (name ? !strcmp(ent->name, name) : ent->id == id))
+            return ent;
+
+    return NULL;
+}
+
+/* takes ownership of name and home */
+__attribute__((nonnull(1), warn_unused_result))
+static struct nss_entry *nss_add(struct nss_cache *cache, uint8_t kind,
+        bool found, uint32_t id, char *name, char *home)
+{
+    struct nss_entry *ent;
+    size_t bucket;
+
+    if ((ent = calloc(1, sizeof(struct nss_entry))) == NULL) {
+        free(name);
+        free(home);
+        return NULL;
+    }
+
+    ent->kind = kind;
+    ent->found = found;
+    ent->id = id;
+    ent->name = name;
+    ent->home = home;
+
+    bucket = nss_hash(kind, id, kind < NSS_USER_BY_UID ? name : NULL);
+    ent->next = cache->buckets[bucket];
+    cache->buckets[bucket] = ent;
+
+    return ent;
+}
+
+/* as strdup(), but NULL is left as NULL. returns -1 if it fails */
+__attribute__((nonnull(2), warn_unused_result))
+static int dup_or_null(const char *str, char **dst)
+{
+    *dst = NULL;
+
+    if (str && (*dst = strdup(str)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/* looks up, and caches, anything not already in cache. returns NULL with
+ * errno set if the lookup itself failed, rather than found nothing */
+__attribute__((nonnull(1), warn_unused_result))
+static struct nss_entry *nss_get(struct nss_cache *cache, uint8_t kind,
+        uint32_t id, const char *name)
+{
+    const struct passwd *pw = NULL;
+    const struct group *gr = NULL;
+    struct nss_entry *ent;
+    char *key = NULL, *val = NULL, *home = NULL;
+
+    if ((ent = nss_find(cache, kind, id, name)) != NULL) {
+        cache->hits++;
+        return ent;
+    }
+
+    cache->misses++;
+    errno = 0;
+
+    switch (kind)
+    {
+        case NSS_UID_BY_NAME:  pw = getpwnam(name); break;
+        case NSS_GID_BY_NAME:  gr = getgrnam(name); break;
+        case NSS_USER_BY_UID:  pw = getpwuid(id);   break;
+        case NSS_GROUP_BY_GID: gr = getgrgid(id);   break;
+    }
+
+    /* only "not found" is an answer worth keeping */
+    if (pw == NULL && gr == NULL && errno != 0 && errno != ENOENT &&
+            errno != ESRCH && errno != EBADF && errno != EPERM)
+        return NULL;
+
+    if (dup_or_null(name, &key))
+        return NULL;
+
+    if (pw) {
+        id = pw->pw_uid;
+        if (kind == NSS_USER_BY_UID && (dup_or_null(pw->pw_name, &val) ||
+                    dup_or_null(pw->pw_dir, &home)))
+            goto fail;
+    } else if (gr) {
+        id = gr->gr_gid;
+        if (kind == NSS_GROUP_BY_GID && dup_or_null(gr->gr_name, &val))
+            goto fail;
+    }
+
+    return nss_add(cache, kind, pw || gr, id, key ? key : val, home);
+
+fail:
+    free(key);
+    free(val);
+    free(home);
+    return NULL;
+}
+
+
+
+/* public functions */
+
+struct nss_cache *nss_create(void)
+{
+    return calloc(1, sizeof(struct nss_cache));
+}
+
+void nss_destroy(struct nss_cache *cache)
+{
+    struct nss_entry *ent, *next;
+
+    for (size_t i = 0; i < NSS_BUCKETS; i++)
+        for (ent = cache->buckets[i]; ent; ent = next) {
+            next = ent->next;
+            free(ent->name);
+            free(ent->home);
+            free(ent);
+        }
+
+    free(cache);
+}
+
+int nss_uid(struct nss_cache *cache, const char *name, uid_t *uid)
+{
+    const struct nss_entry *ent;
+
+    if ((ent = nss_get(cache, NSS_UID_BY_NAME, 0, name)) == NULL)
+        return -1;
+
+    if (!ent->found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *uid = ent->id;
+    return 0;
+}
+
+int nss_gid(struct nss_cache *cache, const char *name, gid_t *gid)
+{
+    const struct nss_entry *ent;
+
+    if ((ent = nss_get(cache, NSS_GID_BY_NAME, 0, name)) == NULL)
+        return -1;
+
+    if (!ent->found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *gid = ent->id;
+    return 0;
+}
+
+int nss_user(struct nss_cache *cache, uid_t uid, const char **name,
+        const char **home)
+{
+    const struct nss_entry *ent;
+
+    if ((ent = nss_get(cache, NSS_USER_BY_UID, uid, NULL)) == NULL)
+        return -1;
+
+    if (!ent->found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *name = ent->name;
+    *home = ent->home;
+    return 0;
+}
+
+int nss_group(struct nss_cache *cache, gid_t gid, const char **name)
+{
+    const struct nss_entry *ent;
+
+    if ((ent = nss_get(cache, NSS_GROUP_BY_GID, gid, NULL)) == NULL)
+        return -1;
+
+    if (!ent->found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *name = ent->name;
+    return 0;
+}
+
+void nss_stats(const struct nss_cache *cache, unsigned long *hits,
+        unsigned long *misses)
+{
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+/* saves every entry into a new buffer, which must be free(3)d */
+int nss_dump(const struct nss_cache *cache, void **buf, size_t *len)
+{
+    const struct nss_entry *ent;
+    struct nss_record rec;
+    size_t total = 0, name_len, home_len;
+    char *out, *ptr;
+
+    for (size_t i = 0; i < NSS_BUCKETS; i++)
+        for (ent = cache->buckets[i]; ent; ent = ent->next) {
+            name_len = ent->name ? strlen(ent->name) : 0;
+            home_len = ent->home ? strlen(ent->home) : 0;
+
+            if (name_len > UINT16_MAX || home_len > UINT16_MAX)
+                continue;
+
+            total += sizeof(rec) + name_len + home_len;
+        }
+
+    if ((out = malloc(total ? total : 1)) == NULL)
+        return -1;
+
+    ptr = out;
+
+    for (size_t i = 0; i < NSS_BUCKETS; i++)
+        for (ent = cache->buckets[i]; ent; ent = ent->next) {
+            name_len = ent->name ? strlen(ent->name) : 0;
+            home_len = ent->home ? strlen(ent->home) : 0;
+
+            if (name_len > UINT16_MAX || home_len > UINT16_MAX)
+                continue;
+
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = ent->kind;
+            rec.found = ent->found;
+            rec.name_len = name_len;
+            rec.home_len = home_len;
+            rec.id = ent->id;
+
+            memcpy(ptr, &rec, sizeof(rec));
+            ptr += sizeof(rec);
+            if (name_len)
+                memcpy(ptr, ent->name, name_len);
+            ptr += name_len;
+            if (home_len)
+                memcpy(ptr, ent->home, home_len);
+            ptr += home_len;
+        }
+
+    *buf = out;
+    *len = total;
+    return 0;
+}
+
+/* adds the entries saved by nss_dump(), without counting them as misses */
+int nss_restore(struct nss_cache *cache, const void *buf, size_t len)
+{
+    const char *ptr = buf, *end = ptr + len;
+    struct nss_record rec;
+    char *name, *home;
+
+    while (ptr < end)
+    {
+        if ((size_t)(end - ptr) < sizeof(rec))
+            goto inval;
+
+        memcpy(&rec, ptr, sizeof(rec));
+        ptr += sizeof(rec);
+
+        if (rec.kind > NSS_GROUP_BY_GID ||
+                (size_t)(end - ptr) < (size_t)rec.name_len + rec.home_len)
+            goto inval;
+
+        name = home = NULL;
+
+        if ((rec.name_len || rec.kind < NSS_USER_BY_UID) &&
+                (name = strndup(ptr, rec.name_len)) == NULL)
+            return -1;
+        ptr += rec.name_len;
+
+        if (rec.home_len && (home = strndup(ptr, rec.home_len)) == NULL) {
+            free(name);
+            return -1;
+        }
+        ptr += rec.home_len;
+
+        /* anything already looked up this run is newer */
+        if (nss_find(cache, rec.kind, rec.id, rec.kind < NSS_USER_BY_UID ? name : NULL)) {
+            free(name);
+            free(home);
+            continue;
+        }
+
+        if (nss_add(cache, rec.kind, rec.found, rec.id, name, home) == NULL)
+            return -1;
+    }
+
+    return 0;
+
+inval:
+    errno = EINVAL;
+    return -1;
+}
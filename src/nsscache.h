@@ -0,0 +1,40 @@
+#ifndef NSSCACHE_H
+#define NSSCACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* the answers from the user and group databases, kept for the rest of the
+ * run, as each lookup may go out to a directory service (sssd, LDAP...).
+ *
+ * names that are not found are remembered too, but not lookups that fail
+ * for any other reason. with --rule-cache, the answers are saved with the
+ * rules by nss_dump(), and put back by nss_restore() before any are used.
+ *
+ * lookups fail with ENOENT for a name or id that does not exist. the
+ * strings returned belong to the cache. none of this is thread safe */
+
+struct nss_cache;
+
+extern struct nss_cache *nss_create(void)
+    __attribute__((warn_unused_result));
+extern void nss_destroy(struct nss_cache *cache)
+    __attribute__((nonnull));
+extern int nss_uid(struct nss_cache *cache, const char *name, uid_t *uid)
+    __attribute__((nonnull, warn_unused_result));
+extern int nss_gid(struct nss_cache *cache, const char *name, gid_t *gid)
+    __attribute__((nonnull, warn_unused_result));
+extern int nss_user(struct nss_cache *cache, uid_t uid, const char **name,
+        const char **home)
+    __attribute__((nonnull, warn_unused_result));
+extern int nss_group(struct nss_cache *cache, gid_t gid, const char **name)
+    __attribute__((nonnull, warn_unused_result));
+extern void nss_stats(const struct nss_cache *cache, unsigned long *hits,
+        unsigned long *misses)
+    __attribute__((nonnull));
+extern int nss_dump(const struct nss_cache *cache, void **buf, size_t *len)
+    __attribute__((nonnull, warn_unused_result));
+extern int nss_restore(struct nss_cache *cache, const void *buf, size_t len)
+    __attribute__((nonnull(1), warn_unused_result));
+
+#endif
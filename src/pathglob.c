@@ -0,0 +1,426 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pathglob.h"
+
+/* macros and defines */
+
+#define PG_BUCKETS 256
+
+
+
+/* type defintions */
+
+/* the entries of a directory, as read */
+struct pg_dir {
+    struct pg_dir *next;
+    char *path;             /* the pattern up to here, with the matches */
+    char *names;            /* each with a NUL, one after the other */
+    size_t *offs;           /* into names */
+    unsigned char *types;   /* d_type */
+    size_t count;
+};
+
+struct pathglob {
+    struct pg_dir *buckets[PG_BUCKETS];
+    unsigned long reads;
+    unsigned long reuses;
+};
+
+/* one pattern, split into components */
+struct pg_pattern {
+    const char *str;
+    char *comps;            /* a copy of str, with each '/' as a NUL */
+    size_t *offs;           /* of each component, into both */
+    size_t ncomps;
+    size_t trail;           /* offset of any '/' after the last component */
+};
+
+struct pg_matches {
+    char **paths;
+    size_t count;
+    size_t cap;
+};
+
+
+
+/* private functions */
+
+__attribute__((nonnull, warn_unused_result))
+static size_t pg_hash(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *ptr = (const unsigned char *)path; *ptr; ptr++)
+        h = (h ^ *ptr) * 0x100000001b3ULL;
+
+    return (size_t)(h ^ (h >> 32)) % PG_BUCKETS;
+}
+
+__attribute__((nonnull))
+static void pg_dir_free(struct pg_dir *dir)
+{
+    free(dir->path);
+    free(dir->names);
+    free(dir->offs);
+    free(dir->types);
+    free(dir);
+}
+
+/* reads the directory open on dirfd, known as path */
+__attribute__((nonnull, warn_unused_result))
+static struct pg_dir *pg_read(int dirfd, const char *path)
+{
+    struct pg_dir *dir;
+    struct dirent *dirent;
+    DIR *dirp;
+    size_t names_len = 0, names_cap = 4096, cap = 64, len;
+    int fd;
+
+    if ((dir = calloc(1, sizeof(struct pg_dir))) == NULL)
+        return NULL;
+
+    if ((dir->path = strdup(path)) == NULL ||
+            (dir->names = malloc(names_cap)) == NULL ||
+            (dir->offs = malloc(cap * sizeof(size_t))) == NULL ||
+            (dir->types = malloc(cap)) == NULL)
+        goto fail;
+
+    if ((fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+        goto fail;
+
+    if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        goto fail;
+    }
+
+    errno = 0;
+    while ((dirent = readdir(dirp)) != NULL)
+    {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+
+        len = strlen(dirent->d_name) + 1;
+
+        if (names_len + len > names_cap) {
+            char *tmp;
+
+            while (names_len + len > names_cap)
+                names_cap *= 2;
+            if ((tmp = realloc(dir->names, names_cap)) == NULL)
+                goto fail_dir;
+            dir->names = tmp;
+        }
+
+        if (dir->count == cap) {
+            size_t *tmp_offs;
+            unsigned char *tmp_types;
+
+            cap *= 2;
+            if ((tmp_offs = realloc(dir->offs, cap * sizeof(size_t))) == NULL)
+                goto fail_dir;
+            dir->offs = tmp_offs;
+            if ((tmp_types = realloc(dir->types, cap)) == NULL)
+                goto fail_dir;
+            dir->types = tmp_types;
+        }
+
+        memcpy(dir->names + names_len, dirent->d_name, len);
+        dir->offs[dir->count] = names_len;
+        dir->types[dir->count] = dirent->d_type;
+        dir->count++;
+        names_len += len;
+        errno = 0;
+    }
+
+    if (errno)
+        goto fail_dir;
+
+    closedir(dirp);
+    return dir;
+
+fail_dir:
+    {
+        int saved = errno;
+        closedir(dirp);
+        errno = saved;
+    }
+fail:
+    {
+        int saved = errno;
+        pg_dir_free(dir);
+        errno = saved;
+    }
+    return NULL;
+}
+
+/* the entries of the directory open on dirfd, known as path, read only if
+ * they have not been since the last flush */
+__attribute__((nonnull, warn_unused_result))
+static const struct pg_dir *pg_list(struct pathglob *pg, int dirfd, const char *path)
+{
+    struct pg_dir *dir;
+    size_t bucket = pg_hash(path);
+
+    for (dir = pg->buckets[bucket]; dir; dir = dir->next)
+        if (!strcmp(dir->path, path)) {
+            pg->reuses++;
+            return dir;
+        }
+
+    if ((dir = pg_read(dirfd, path)) == NULL)
+        return NULL;
+
+    pg->reads++;
+    dir->next = pg->buckets[bucket];
+    pg->buckets[bucket] = dir;
+
+    return dir;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int pg_add(struct pg_matches *out, const char *path)
+{
+    if (out->count == out->cap) {
+        size_t new_cap = out->cap ? out->cap * 2 : 16;
+        char **tmp;
+
+        if ((tmp = realloc(out->paths, new_cap * sizeof(char *))) == NULL)
+            return -1;
+
+        out->paths = tmp;
+        out->cap = new_cap;
+    }
+
+    if ((out->paths[out->count] = strdup(path)) == NULL)
+        return -1;
+
+    out->count++;
+    return 0;
+}
+
+/* component idx of pat, under the directory open on dirfd. buf holds the
+ * path so far, len bytes of it, and has room for the rest. returns -1 only
+ * if out of memory */
+__attribute__((nonnull, warn_unused_result))
+static int pg_walk(struct pathglob *pg, const struct pg_pattern *pat, size_t idx,
+        int dirfd, char *buf, size_t len, struct pg_matches *out)
+{
+    const char *comp = pat->comps + pat->offs[idx];
+    const char *trail = pat->str + pat->trail;
+    const bool last = idx + 1 == pat->ncomps;
+    const struct pg_dir *dir;
+    struct stat sb;
+    size_t sep_off, name_len;
+    int fd, rc = 0;
+
+    /* the '/' before the component, as written */
+    sep_off = idx ? pat->offs[idx - 1] + strlen(pat->comps + pat->offs[idx - 1]) : 0;
+    memcpy(buf + len, pat->str + sep_off, pat->offs[idx] - sep_off);
+    len += pat->offs[idx] - sep_off;
+    buf[len] = '\0';
+
+    if (strpbrk(comp, PATHGLOB_MAGIC) == NULL) {
+        name_len = strlen(comp);
+        memcpy(buf + len, comp, name_len + 1);
+
+        if (last) {
+            if (fstatat(dirfd, comp, &sb, *trail ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+                    (!*trail || S_ISDIR(sb.st_mode))) {
+                strcpy(buf + len + name_len, trail);
+                return pg_add(out, buf);
+            }
+            return 0;
+        }
+
+        if ((fd = openat(dirfd, comp, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+            return 0;
+
+        rc = pg_walk(pg, pat, idx + 1, fd, buf, len + name_len, out);
+        close(fd);
+        return rc;
+    }
+
+    if ((dir = pg_list(pg, dirfd, buf)) == NULL)
+        return errno == ENOMEM ? -1 : 0;
+
+    for (size_t i = 0; i < dir->count && rc == 0; i++)
+    {
+        const char *name = dir->names + dir->offs[i];
+
+        if (fnmatch(comp, name, FNM_PERIOD))
+            continue;
+
+        name_len = strlen(name);
+        memcpy(buf + len, name, name_len + 1);
+
+        if (last) {
+            if (*trail && (fstatat(dirfd, name, &sb, 0) || !S_ISDIR(sb.st_mode)))
+                continue;
+            strcpy(buf + len + name_len, trail);
+            rc = pg_add(out, buf);
+            continue;
+        }
+
+        if (dir->types[i] != DT_DIR && dir->types[i] != DT_LNK &&
+                dir->types[i] != DT_UNKNOWN)
+            continue;
+
+        if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+            continue;
+
+        rc = pg_walk(pg, pat, idx + 1, fd, buf, len + name_len, out);
+        close(fd);
+    }
+
+    return rc;
+}
+
+/* splits pattern into components, skipping empty ones */
+__attribute__((nonnull, warn_unused_result))
+static int pg_compile(struct pg_pattern *pat, const char *pattern)
+{
+    size_t len = strlen(pattern);
+
+    memset(pat, 0, sizeof(struct pg_pattern));
+    pat->str = pattern;
+    pat->trail = len;
+
+    if ((pat->comps = strdup(pattern)) == NULL ||
+            (pat->offs = malloc((len / 2 + 1) * sizeof(size_t))) == NULL) {
+        free(pat->comps);
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (pat->comps[i] == '/') {
+            pat->comps[i] = '\0';
+            continue;
+        }
+
+        if (i == 0 || pat->comps[i - 1] == '\0')
+            pat->offs[pat->ncomps++] = i;
+
+        /* so that any '/' after the last component is kept */
+        pat->trail = i + 1;
+    }
+
+    return 0;
+}
+
+
+
+/* public functions */
+
+struct pathglob *pathglob_create(void)
+{
+    return calloc(1, sizeof(struct pathglob));
+}
+
+void pathglob_flush(struct pathglob *pg)
+{
+    struct pg_dir *dir, *next;
+
+    for (size_t i = 0; i < PG_BUCKETS; i++) {
+        for (dir = pg->buckets[i]; dir; dir = next) {
+            next = dir->next;
+            pg_dir_free(dir);
+        }
+        pg->buckets[i] = NULL;
+    }
+}
+
+void pathglob_destroy(struct pathglob *pg)
+{
+    pathglob_flush(pg);
+    free(pg);
+}
+
+int pathglob_match(struct pathglob *pg, const char *pattern, char ***matches,
+        size_t *count)
+{
+    struct pg_matches out = { NULL, 0, 0 };
+    struct pg_pattern pat;
+    struct stat sb;
+    char *buf = NULL;
+    int dirfd = -1, rc = -1;
+
+    *matches = NULL;
+    *count = 0;
+
+    if (pg_compile(&pat, pattern))
+        return -1;
+
+    /* "/", or "" */
+    if (pat.ncomps == 0) {
+        if (*pattern && lstat(pattern, &sb) == 0 && pg_add(&out, pattern))
+            goto done;
+        rc = 0;
+        goto done;
+    }
+
+    if ((buf = malloc(strlen(pattern) + pat.ncomps * (NAME_MAX + 1) + 1)) == NULL)
+        goto done;
+    *buf = '\0';
+
+    if ((dirfd = open(*pattern == '/' ? "/" : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+        goto done;
+
+    rc = pg_walk(pg, &pat, 0, dirfd, buf, 0, &out);
+
+done:
+    if (dirfd != -1)
+        close(dirfd);
+    free(buf);
+    free(pat.comps);
+    free(pat.offs);
+
+    if (rc == -1) {
+        int saved = errno;
+        pathglob_free(out.paths, out.count);
+        errno = saved;
+        return -1;
+    }
+
+    if (out.count == 0) {
+        free(out.paths);
+        errno = ENOENT;
+        return -1;
+    }
+
+    *matches = out.paths;
+    *count = out.count;
+    return 0;
+}
+
+void pathglob_free(char **matches, size_t count)
+{
+    if (matches == NULL)
+        return;
+
+    for (size_t i = 0; i < count; i++)
+        free(matches[i]);
+
+    free(matches);
+}
+
+void pathglob_stats(const struct pathglob *pg, unsigned long *reads,
+        unsigned long *reuses)
+{
+    *reads = pg->reads;
+    *reuses = pg->reuses;
+}
@@ -0,0 +1,41 @@
+#ifndef PATHGLOB_H
+#define PATHGLOB_H
+
+#include <stddef.h>
+
+/* glob(3) for the glob lines (w, x, X, z, Z, t, T, h and H).
+ *
+ * a pattern is walked a component at a time, each directory opened
+ * relative to the one before it, and only those with a wildcard in the
+ * next component are read. what is read is kept, so that other patterns
+ * through the same directory match against it without reading it again,
+ * until pathglob_flush(), which the caller must do once anything may have
+ * been created, renamed or removed.
+ *
+ * as glob(3) without flags, except that "." and ".." are never matched and
+ * the matches are in directory order. pathglob_match() fails with ENOENT
+ * if nothing matched. unreadable directories are skipped. none of this is
+ * thread safe */
+
+/* a path with none of these in it is only itself, and need not be matched.
+ * a backslash counts, as it may quote one of the others */
+#define PATHGLOB_MAGIC "*?[\\"
+
+struct pathglob;
+
+extern struct pathglob *pathglob_create(void)
+    __attribute__((warn_unused_result));
+extern void pathglob_destroy(struct pathglob *pg)
+    __attribute__((nonnull));
+extern void pathglob_flush(struct pathglob *pg)
+    __attribute__((nonnull));
+/* matches must be freed with pathglob_free() */
+extern int pathglob_match(struct pathglob *pg, const char *pattern,
+        char ***matches, size_t *count)
+    __attribute__((nonnull, warn_unused_result));
+extern void pathglob_free(char **matches, size_t count);
+extern void pathglob_stats(const struct pathglob *pg, unsigned long *reads,
+        unsigned long *reuses)
+    __attribute__((nonnull));
+
+#endif
@@ -0,0 +1,477 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rules.h"
+
+extern int mkpath(char *dir, mode_t mode) __attribute__((nonnull));
+
+/* macros and defines */
+
+#define RULES_MAGIC "TMPFRUL3"
+#define CLAIMS_INITIAL 256
+
+
+
+/* type defintions */
+
+/* followed by count struct rule, order_count uint32_t of order, extra_len
+ * bytes of extra, then strs_len bytes of strings */
+struct rules_header {
+    char magic[8];
+    uint32_t rule_size;     /* the layout of struct rule is that of the build */
+    uint32_t pad;
+    uint64_t key;
+    uint64_t count;
+    uint64_t order_count;
+    uint64_t extra_len;
+    uint64_t strs_len;
+};
+
+struct rule_key {
+    int rank;
+    uint32_t idx;
+    const char *path;
+};
+
+
+
+/* private functions */
+
+__attribute__((nonnull, warn_unused_result))
+static int add_str(struct ruleset *set, const char *str, uint32_t *off)
+{
+    size_t len = strlen(str) + 1;
+
+    if (set->strs_len + len >= RULE_NO_STR) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    if (set->strs_len + len > set->strs_cap) {
+        size_t new_cap = set->strs_cap ? set->strs_cap : 4096;
+        char *new_strs;
+
+        while (new_cap < set->strs_len + len)
+            new_cap *= 2;
+
+        if ((new_strs = realloc(set->strs, new_cap)) == NULL)
+            return -1;
+
+        set->strs = new_strs;
+        set->strs_cap = new_cap;
+    }
+
+    memcpy(set->strs + set->strs_len, str, len);
+    *off = set->strs_len;
+    set->strs_len += len;
+
+    return 0;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static size_t *claim_slot(size_t *claims, size_t cap, const struct ruleset *set,
+        const char *path, uint64_t hash)
+{
+    size_t i = hash & (cap - 1);
+
+    while (claims[i] && strcmp(set->strs + set->rules[claims[i] - 1].path, path))
+        i = (i + 1) & (cap - 1);
+
+    return &claims[i];
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int claims_grow(struct ruleset *set)
+{
+    size_t new_cap = set->claims_cap ? set->claims_cap * 2 : CLAIMS_INITIAL;
+    size_t *new_claims;
+
+    if ((new_claims = calloc(new_cap, sizeof(size_t))) == NULL)
+        return -1;
+
+    for (size_t i = 0; i < set->claims_cap; i++) {
+        const char *path;
+
+        if (set->claims[i] == 0)
+            continue;
+
+        path = set->strs + set->rules[set->claims[i] - 1].path;
+        *claim_slot(new_claims, new_cap, set, path,
+                rules_hash(RULES_HASH_INIT, path, strlen(path))) = set->claims[i];
+    }
+
+    free(set->claims);
+    set->claims = new_claims;
+    set->claims_cap = new_cap;
+
+    return 0;
+}
+
+/* as strcmp(), but with '/' before any other character */
+__attribute__((nonnull, warn_unused_result))
+static int path_cmp(const char *a, const char *b)
+{
+    while (*a && *a == *b)
+        a++, b++;
+
+    if (*a == *b)
+        return 0;
+    if (*a == '/' && *b)
+        return -1;
+    if (*b == '/' && *a)
+        return 1;
+
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int rule_key_cmp(const void *a, const void *b)
+{
+    const struct rule_key *ka = a, *kb = b;
+    int rc;
+
+    if (ka->rank != kb->rank)
+        return ka->rank - kb->rank;
+    if ((rc = path_cmp(ka->path, kb->path)) != 0)
+        return rc;
+
+    return ka->idx < kb->idx ? -1 : ka->idx > kb->idx;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static bool valid_str(const struct ruleset *set, uint32_t off)
+{
+    return off == RULE_NO_STR || off < set->strs_len;
+}
+
+
+
+/* public functions */
+
+/* copies rule, and path and arg (either of which may be NULL) into set */
+int rules_add(struct ruleset *set, const struct rule *rule,
+        const char *path, const char *arg)
+{
+    struct rule *ent;
+
+    if (set->map) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (set->count == set->cap) {
+        size_t new_cap = set->cap ? set->cap * 2 : 64;
+        struct rule *new_rules;
+
+        if ((new_rules = realloc(set->rules, new_cap * sizeof(struct rule))) == NULL)
+            return -1;
+
+        set->rules = new_rules;
+        set->cap = new_cap;
+    }
+
+    ent = &set->rules[set->count];
+    memcpy(ent, rule, sizeof(struct rule));
+    ent->path = ent->arg = RULE_NO_STR;
+
+    if (path && add_str(set, path, &ent->path))
+        return -1;
+    if (arg && add_str(set, arg, &ent->arg))
+        return -1;
+
+    set->count++;
+    return 0;
+}
+
+/* returns 1, and the index of the rule in owner, if the path of rule idx
+ * has already been claimed. otherwise claims it for rule idx and returns 0 */
+int rules_claim(struct ruleset *set, size_t idx, size_t *owner)
+{
+    const char *path = set->strs + set->rules[idx].path;
+    size_t *slot;
+
+    if (set->claims_count * 2 >= set->claims_cap && claims_grow(set))
+        return -1;
+
+    slot = claim_slot(set->claims, set->claims_cap, set, path,
+            rules_hash(RULES_HASH_INIT, path, strlen(path)));
+
+    if (*slot) {
+        *owner = *slot - 1;
+        return 1;
+    }
+
+    *slot = idx + 1;
+    set->claims_count++;
+
+    return 0;
+}
+
+/* removes the last rule added, which must not have been claimed */
+void rules_pop(struct ruleset *set)
+{
+    const struct rule *ent = &set->rules[--set->count];
+
+    if (ent->path != RULE_NO_STR)
+        set->strs_len = ent->path;
+    else if (ent->arg != RULE_NO_STR)
+        set->strs_len = ent->arg;
+}
+
+void rules_claims_clear(struct ruleset *set)
+{
+    free(set->claims);
+    set->claims = NULL;
+    set->claims_cap = 0;
+    set->claims_count = 0;
+}
+
+int rules_sort(struct ruleset *set, int (*rank)(const struct rule *))
+{
+    struct rule_key *keys;
+    uint32_t *new_order;
+    size_t nkeys = 0;
+
+    if (set->map) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (set->count >= UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    if ((keys = malloc((set->count + 1) * sizeof(struct rule_key))) == NULL)
+        return -1;
+
+    if ((new_order = malloc((set->count + 1) * sizeof(uint32_t))) == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    for (size_t i = 0; i < set->count; i++) {
+        const struct rule *ent = &set->rules[i];
+
+        if ((keys[nkeys].rank = rank(ent)) == -1)
+            continue;
+
+        keys[nkeys].idx = i;
+        keys[nkeys].path = ent->path == RULE_NO_STR ? "" : set->strs + ent->path;
+        nkeys++;
+    }
+
+    qsort(keys, nkeys, sizeof(struct rule_key), rule_key_cmp);
+
+    for (size_t i = 0; i < nkeys; i++)
+        new_order[i] = keys[i].idx;
+
+    free(keys);
+    free(set->order);
+    set->order = new_order;
+    set->order_count = nkeys;
+
+    return 0;
+}
+
+/* returns NULL for RULE_NO_STR */
+const char *rules_str(const struct ruleset *set, uint32_t off)
+{
+    return off == RULE_NO_STR ? NULL : set->strs + off;
+}
+
+void rules_clear(struct ruleset *set)
+{
+    if (set->map)
+        munmap(set->map, set->map_len);
+    else {
+        free(set->rules);
+        free(set->order);
+        free(set->strs);
+    }
+
+    rules_claims_clear(set);
+
+    memset(set, 0, sizeof(struct ruleset));
+}
+
+/* replaces set with the rules saved at path, if saved under key */
+int rules_load(struct ruleset *set, const char *path, uint64_t key)
+{
+    const struct rules_header *hdr;
+    struct ruleset new_set;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+        return -1;
+
+    if (fstat(fd, &sb) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if ((size_t)sb.st_size < sizeof(struct rules_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = map;
+    memset(&new_set, 0, sizeof(new_set));
+    new_set.map = map;
+    new_set.map_len = sb.st_size;
+
+    if (memcmp(hdr->magic, RULES_MAGIC, sizeof(hdr->magic)) ||
+            hdr->rule_size != sizeof(struct rule)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    if (hdr->key != key) {
+        errno = ESTALE;
+        goto fail;
+    }
+
+    if (hdr->count > (new_set.map_len - sizeof(struct rules_header)) / sizeof(struct rule) ||
+            hdr->order_count > hdr->count ||
+            hdr->extra_len > new_set.map_len || hdr->strs_len > new_set.map_len ||
+            sizeof(struct rules_header) + hdr->count * sizeof(struct rule) +
+            hdr->order_count * sizeof(uint32_t) + hdr->extra_len +
+            hdr->strs_len != new_set.map_len ||
+            (hdr->strs_len && ((const char *)map)[new_set.map_len - 1] != '\0')) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    new_set.rules = (struct rule *)(hdr + 1);
+    new_set.count = new_set.cap = hdr->count;
+    new_set.order = (uint32_t *)(new_set.rules + hdr->count);
+    new_set.order_count = hdr->order_count;
+    new_set.extra = new_set.order + hdr->order_count;
+    new_set.extra_len = hdr->extra_len;
+    new_set.strs = (char *)new_set.extra + hdr->extra_len;
+    new_set.strs_len = new_set.strs_cap = hdr->strs_len;
+
+    for (size_t i = 0; i < new_set.count; i++)
+        if (!valid_str(&new_set, new_set.rules[i].path) ||
+                !valid_str(&new_set, new_set.rules[i].arg)) {
+            errno = EINVAL;
+            goto fail;
+        }
+
+    for (size_t i = 0; i < new_set.order_count; i++)
+        if (new_set.order[i] >= new_set.count) {
+            errno = EINVAL;
+            goto fail;
+        }
+
+    rules_clear(set);
+    *set = new_set;
+
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        munmap(map, new_set.map_len);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+int rules_save(const struct ruleset *set, const char *path, uint64_t key,
+        const void *extra, size_t extra_len)
+{
+    const size_t len = strlen(path) + 5;
+    struct rules_header hdr;
+    char *tmp, *dir;
+    FILE *fp;
+
+    if ((tmp = malloc(len)) == NULL)
+        return -1;
+
+    snprintf(tmp, len, "%s.tmp", path);
+
+    if ((dir = strdup(path)) != NULL) {
+        mkpath(dirname(dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+        free(dir);
+    }
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+        goto fail;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RULES_MAGIC, sizeof(hdr.magic));
+    hdr.rule_size = sizeof(struct rule);
+    hdr.key = key;
+    hdr.count = set->count;
+    hdr.order_count = set->order_count;
+    hdr.extra_len = extra ? extra_len : 0;
+    hdr.strs_len = set->strs_len;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            (set->count && fwrite(set->rules, sizeof(struct rule), set->count, fp) != set->count) ||
+            (set->order_count && fwrite(set->order, sizeof(uint32_t),
+                                        set->order_count, fp) != set->order_count) ||
+            (hdr.extra_len && fwrite(extra, hdr.extra_len, 1, fp) != 1) ||
+            (set->strs_len && fwrite(set->strs, set->strs_len, 1, fp) != 1))
+        goto fail;
+
+    if (fclose(fp)) {
+        fp = NULL;
+        goto fail;
+    }
+    fp = NULL;
+
+    if (rename(tmp, path) == -1)
+        goto fail;
+
+    free(tmp);
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        if (fp)
+            fclose(fp);
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/* FNV-1a, for building a key from what the rules were parsed from */
+uint64_t rules_hash(uint64_t hash, const void *buf, size_t len)
+{
+    const unsigned char *ptr = buf;
+
+    while (len--) {
+        hash ^= *ptr++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
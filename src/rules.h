@@ -0,0 +1,94 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/* the lines of every config file, parsed and vetted, in the order read.
+ *
+ * strings are kept with their NULs in a single pool and referred to by
+ * offset, so the same records can be saved as a binary cache and mapped
+ * straight back in by a later run, which then need not read the config
+ * files at all, provided the key the cache was saved under still matches.
+ *
+ * rules_load() fails with ENOENT if there is no cache, ESTALE if it was
+ * saved under a different key and EINVAL if it is damaged.
+ *
+ * rules_claim() records which rule first created a path, so that later
+ * duplicates can be found and dropped with rules_pop(). it is only kept
+ * while parsing, not in a cache.
+ *
+ * rules_sort() fills order with the rules to apply: by the rank the caller
+ * gives each, then by path, so that a directory's rules are next to those
+ * of everything beneath it, then in the order they were read. the order is
+ * saved in, and loaded from, a cache with the rules.
+ *
+ * the caller may save anything else it needs alongside the rules as extra,
+ * which is then set by rules_load() */
+
+#define RULE_NO_STR UINT32_MAX
+#define RULES_HASH_INIT 0xcbf29ce484222325ULL
+
+struct rule {
+    char type;          /* '\0' marks the start of a config file */
+    int mod;
+    mode_t mode;
+    mode_t mask;
+    bool defmode;
+    uid_t uid;
+    bool defuid;
+    gid_t gid;
+    bool defgid;
+    bool has_age;
+    bool subonly;
+    struct timeval age;
+    uint32_t path;      /* as written, before specifiers are expanded */
+    uint32_t arg;       /* or RULE_NO_STR */
+};
+
+struct ruleset {
+    struct rule *rules;
+    size_t count;
+    size_t cap;
+    char *strs;
+    size_t strs_len;
+    size_t strs_cap;
+    void *map;          /* set if loaded from a cache, and read only */
+    size_t map_len;
+    const void *extra;
+    size_t extra_len;
+    uint32_t *order;    /* indices into rules */
+    size_t order_count;
+    size_t *claims;     /* open addressed, indices into rules + 1 */
+    size_t claims_cap;
+    size_t claims_count;
+};
+
+extern int rules_add(struct ruleset *set, const struct rule *rule,
+        const char *path, const char *arg)
+    __attribute__((nonnull(1,2), warn_unused_result));
+extern int rules_claim(struct ruleset *set, size_t idx, size_t *owner)
+    __attribute__((nonnull, warn_unused_result));
+extern void rules_pop(struct ruleset *set)
+    __attribute__((nonnull));
+extern void rules_claims_clear(struct ruleset *set)
+    __attribute__((nonnull));
+/* rank returns -1 to leave a rule out */
+extern int rules_sort(struct ruleset *set, int (*rank)(const struct rule *))
+    __attribute__((nonnull, warn_unused_result));
+extern const char *rules_str(const struct ruleset *set, uint32_t off)
+    __attribute__((nonnull, warn_unused_result));
+extern void rules_clear(struct ruleset *set)
+    __attribute__((nonnull));
+extern int rules_load(struct ruleset *set, const char *path, uint64_t key)
+    __attribute__((nonnull, warn_unused_result));
+extern int rules_save(const struct ruleset *set, const char *path, uint64_t key,
+        const void *extra, size_t extra_len)
+    __attribute__((nonnull(1,2), warn_unused_result));
+extern uint64_t rules_hash(uint64_t hash, const void *buf, size_t len)
+    __attribute__((nonnull, warn_unused_result));
+
+#endif
@@ -0,0 +1,367 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#if defined(HAVE_LINUX_BTRFS_H) && defined(HAVE_LINUX_BTRFS_TREE_H)
+# define USE_BTRFS
+# include <sys/ioctl.h>
+# include <sys/vfs.h>
+# include <linux/magic.h>
+# include <linux/btrfs.h>
+# include <linux/btrfs_tree.h>
+#endif
+
+#include "subvol.h"
+
+/* macros and defines */
+
+/* a quota group id is its level in the top 16 bits, and an id below */
+#define QGROUP_LEVEL(qgroupid) ((qgroupid) >> 48)
+#define QGROUP_ID(level, id) (((uint64_t)(level) << 48) | (id))
+
+
+
+/* private functions */
+
+#ifdef USE_BTRFS
+__attribute__((warn_unused_result))
+static bool on_btrfs(int fd)
+{
+    struct statfs sfs;
+
+    return fstatfs(fd, &sfs) == 0 && sfs.f_type == BTRFS_SUPER_MAGIC;
+}
+
+/* opens the directory above path, if it is on btrfs. *name is the last
+ * component of path, in *copy, which is to be freed */
+__attribute__((nonnull, warn_unused_result))
+static int open_parent(const char *path, char **copy, const char **name)
+{
+    char *slash;
+    size_t len;
+    int fd;
+
+    if ((*copy = strdup(path)) == NULL)
+        return -1;
+
+    for (len = strlen(*copy); len > 1 && (*copy)[len - 1] == '/'; len--)
+        (*copy)[len - 1] = '\0';
+
+    if ((slash = strrchr(*copy, '/')) == NULL) {
+        *name = *copy;
+        fd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    } else {
+        *slash = '\0';
+        *name = slash + 1;
+        fd = open(slash == *copy ? "/" : *copy, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    }
+
+    if (fd == -1)
+        goto fail;
+
+    if (!**name || strlen(*name) > BTRFS_SUBVOL_NAME_MAX) {
+        errno = EINVAL;
+        goto fail_fd;
+    }
+
+    if (!on_btrfs(fd)) {
+        errno = ENOTTY;
+        goto fail_fd;
+    }
+
+    return fd;
+
+fail_fd:
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+fail:
+    {
+        int saved = errno;
+        free(*copy);
+        *copy = NULL;
+        errno = saved;
+    }
+    return -1;
+}
+
+/* the id of the subvolume fd is in, which is also that of its leaf quota
+ * group */
+__attribute__((nonnull, warn_unused_result))
+static int subvol_id(int fd, uint64_t *id)
+{
+    struct btrfs_ioctl_ino_lookup_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+
+    if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) == -1)
+        return -1;
+
+    *id = args.treeid;
+    return 0;
+}
+
+/* the quota groups qgroupid is directly in, read from the quota tree, which
+ * there is none of if quotas are not enabled */
+__attribute__((nonnull, warn_unused_result))
+static int qgroup_parents(int fd, uint64_t qgroupid, uint64_t **parents, size_t *count)
+{
+    struct btrfs_ioctl_search_args args;
+    struct btrfs_ioctl_search_key *sk = &args.key;
+    struct btrfs_ioctl_search_header sh;
+    size_t cap = 0, off;
+    uint64_t *tmp;
+
+    *parents = NULL;
+    *count = 0;
+
+    memset(&args, 0, sizeof(args));
+    sk->tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+    sk->min_objectid = sk->max_objectid = qgroupid;
+    sk->min_type = sk->max_type = BTRFS_QGROUP_RELATION_KEY;
+    /* each relation is kept both ways round, and those above have the
+     * higher ids */
+    sk->min_offset = qgroupid + 1;
+    sk->max_offset = UINT64_MAX;
+    sk->max_transid = UINT64_MAX;
+
+    while (true)
+    {
+        sk->nr_items = 4096;
+
+        if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) == -1) {
+            if (errno == ENOENT)
+                return 0;
+            goto fail;
+        }
+
+        if (sk->nr_items == 0)
+            return 0;
+
+        off = 0;
+        for (uint32_t i = 0; i < sk->nr_items; i++)
+        {
+            memcpy(&sh, args.buf + off, sizeof(sh));
+            off += sizeof(sh) + sh.len;
+
+            if (*count == cap) {
+                cap = cap ? cap * 2 : 8;
+                if ((tmp = realloc(*parents, cap * sizeof(uint64_t))) == NULL)
+                    goto fail;
+                *parents = tmp;
+            }
+
+            (*parents)[(*count)++] = sh.offset;
+        }
+
+        if (sh.offset == UINT64_MAX)
+            return 0;
+        sk->min_offset = sh.offset + 1;
+    }
+
+fail:
+    {
+        int saved = errno;
+        free(*parents);
+        *parents = NULL;
+        *count = 0;
+        errno = saved;
+    }
+    return -1;
+}
+
+__attribute__((warn_unused_result))
+static int qgroup_assign(int fd, uint64_t src, uint64_t dst)
+{
+    struct btrfs_ioctl_qgroup_assign_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.assign = 1;
+    args.src = src;
+    args.dst = dst;
+
+    /* > 0 only means a rescan is needed for the numbers to be right */
+    if (ioctl(fd, BTRFS_IOC_QGROUP_ASSIGN, &args) == -1 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+/* Q: makes the quota group the subvolume id (open on fd) goes in, below the
+ * lowest of those its parent is in, parents */
+__attribute__((warn_unused_result))
+static int qgroup_own(int fd, uint64_t id, const uint64_t *parents, size_t count)
+{
+    struct btrfs_ioctl_qgroup_create_args args;
+    uint64_t level = UINT64_MAX;
+
+    for (size_t i = 0; i < count; i++)
+        if (QGROUP_LEVEL(parents[i]) - 1 < level)
+            level = QGROUP_LEVEL(parents[i]) - 1;
+
+    if (count == 0)
+        level = 255;
+
+    /* no level between the leaf and the parent's lowest, so as q */
+    if (level == 0) {
+        for (size_t i = 0; i < count; i++)
+            if (qgroup_assign(fd, id, parents[i]))
+                return -1;
+        return 0;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.create = 1;
+    args.qgroupid = QGROUP_ID(level, id);
+
+    if (ioctl(fd, BTRFS_IOC_QGROUP_CREATE, &args) == -1) {
+        /* quotas are not enabled */
+        if (errno == ENOTCONN)
+            return 0;
+        if (errno != EEXIST)
+            return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        if (qgroup_assign(fd, args.qgroupid, parents[i]))
+            return -1;
+
+    return qgroup_assign(fd, id, args.qgroupid);
+}
+#endif
+
+
+
+/* public functions */
+
+int subvol_create(const char *path, mode_t mode, subvol_qgroup_t qgroup)
+{
+#ifdef USE_BTRFS
+    struct btrfs_ioctl_vol_args_v2 args;
+    struct btrfs_qgroup_inherit *inherit = NULL;
+    uint64_t parent_id, id, *parents = NULL;
+    size_t count = 0, size;
+    const char *name;
+    char *copy;
+    int dirfd, fd = -1, rc = -1;
+
+    if ((dirfd = open_parent(path, &copy, &name)) == -1)
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+    strcpy(args.name, name);
+
+    /* the parent may not be a subvolume's top, but is in one */
+    if (qgroup != SUBVOL_QGROUP_NONE && subvol_id(dirfd, &parent_id) == 0 &&
+            qgroup_parents(dirfd, parent_id, &parents, &count))
+        goto done;
+
+    /* q is in its parent's groups from the start */
+    if (qgroup == SUBVOL_QGROUP_INHERIT && count) {
+        size = sizeof(struct btrfs_qgroup_inherit) + count * sizeof(uint64_t);
+
+        if ((inherit = calloc(1, size)) == NULL)
+            goto done;
+
+        inherit->num_qgroups = count;
+        memcpy(inherit->qgroups, parents, count * sizeof(uint64_t));
+
+        args.flags = BTRFS_SUBVOL_QGROUP_INHERIT;
+        args.size = size;
+        args.qgroup_inherit = inherit;
+    }
+
+    if (ioctl(dirfd, BTRFS_IOC_SUBVOL_CREATE_V2, &args) == -1)
+        goto done;
+
+    if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1 ||
+            fchmod(fd, mode) == -1)
+        goto done;
+
+    if (qgroup == SUBVOL_QGROUP_OWN &&
+            (subvol_id(fd, &id) || qgroup_own(fd, id, parents, count)))
+        goto done;
+
+    rc = 0;
+
+done:
+    {
+        int saved = errno;
+        if (fd != -1)
+            close(fd);
+        close(dirfd);
+        free(copy);
+        free(parents);
+        free(inherit);
+        errno = saved;
+    }
+    return rc;
+#else
+    (void)path;
+    (void)mode;
+    (void)qgroup;
+    errno = ENOTTY;
+    return -1;
+#endif
+}
+
+int subvol_destroy(const char *path)
+{
+#ifdef USE_BTRFS
+    struct btrfs_ioctl_vol_args args;
+    const char *name;
+    char *copy;
+    int dirfd, rc;
+
+    if ((dirfd = open_parent(path, &copy, &name)) == -1)
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+    strcpy(args.name, name);
+
+    rc = ioctl(dirfd, BTRFS_IOC_SNAP_DESTROY, &args);
+
+    {
+        int saved = errno;
+        close(dirfd);
+        free(copy);
+        errno = saved;
+    }
+    return rc;
+#else
+    (void)path;
+    errno = ENOTTY;
+    return -1;
+#endif
+}
+
+bool subvol_is(const char *path)
+{
+#ifdef USE_BTRFS
+    struct stat sb;
+    struct statfs sfs;
+
+    if (lstat(path, &sb) == -1 || !S_ISDIR(sb.st_mode) ||
+            sb.st_ino != BTRFS_FIRST_FREE_OBJECTID)
+        return false;
+
+    return statfs(path, &sfs) == 0 && sfs.f_type == BTRFS_SUPER_MAGIC;
+#else
+    (void)path;
+    return false;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef SUBVOL_H
+#define SUBVOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* btrfs subvolumes, for v, q and Q lines, and so that D and R can remove a
+ * subvolume whole, with one ioctl, rather than by walking it.
+ *
+ * where path is not on btrfs, or this was built without the btrfs headers,
+ * subvol_create() and subvol_destroy() fail with ENOTTY and subvol_is() is
+ * false, so that the caller can fall back to a directory */
+
+typedef enum {
+    SUBVOL_QGROUP_NONE = 0,
+    /* q: the new subvolume joins the higher-level quota groups its parent
+     * subvolume is in */
+    SUBVOL_QGROUP_INHERIT,
+    /* Q: a quota group is made for the new subvolume, one level below the
+     * lowest of its parent's (or at level 255 if it has none), and it is
+     * put in that, and that in its parent's */
+    SUBVOL_QGROUP_OWN,
+} subvol_qgroup_t;
+
+/* the directory above path must exist, and path must not */
+extern int subvol_create(const char *path, mode_t mode, subvol_qgroup_t qgroup)
+    __attribute__((nonnull, warn_unused_result));
+/* any subvolume below path is not destroyed, and so neither is path */
+extern int subvol_destroy(const char *path)
+    __attribute__((nonnull, warn_unused_result));
+/* is path (not followed if a symlink) the top of a subvolume */
+extern bool subvol_is(const char *path)
+    __attribute__((nonnull, warn_unused_result));
+
+#endif
@@ -0,0 +1,475 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "trash.h"
+
+extern int mkpath(char *dir, mode_t mode) __attribute__((nonnull));
+
+/* macros and defines */
+
+#define TRASH_NAME "/.tmpfilesd-trash"
+
+/* ioprio_set(2), as <linux/ioprio.h> is not in older kernel headers */
+#define IOPRIO_WHO_PID   1
+#define IOPRIO_IDLE      (3 << 13)
+
+
+
+/* type defintions */
+
+struct trash_dir {
+    dev_t dev;
+    char *path;
+};
+
+struct trash {
+    pthread_mutex_t lock;
+    char *list;             /* the file the directories are listed in */
+    char *root;
+    struct trash_dir *dirs;
+    size_t count;
+    size_t cap;
+    atomic_ulong moved;
+    atomic_ulong seq;
+};
+
+
+
+/* private functions */
+
+/* a trash directory is only used if it is this user's, and nobody else can
+ * get into it (0700), as everything in it is deleted */
+__attribute__((nonnull, warn_unused_result))
+static bool trash_safe(const struct stat *sb)
+{
+    return S_ISDIR(sb->st_mode) && sb->st_uid == geteuid() &&
+        !(sb->st_mode & (S_IRWXG|S_IRWXO));
+}
+
+__attribute__((nonnull, warn_unused_result))
+static int trash_add(struct trash *trash, dev_t dev, const char *path)
+{
+    if (trash->count == trash->cap) {
+        size_t new_cap = trash->cap ? trash->cap * 2 : 8;
+        struct trash_dir *tmp;
+
+        if ((tmp = realloc(trash->dirs, new_cap * sizeof(struct trash_dir))) == NULL)
+            return -1;
+
+        trash->dirs = tmp;
+        trash->cap = new_cap;
+    }
+
+    if ((trash->dirs[trash->count].path = strdup(path)) == NULL)
+        return -1;
+
+    trash->dirs[trash->count++].dev = dev;
+    return 0;
+}
+
+/* the trash directory for path, on dev, found by going up from path for as
+ * long as the directory above is on the same file system, and made if need
+ * be. called with the lock held */
+__attribute__((nonnull, warn_unused_result))
+static const char *trash_dir(struct trash *trash, const char *path, dev_t dev)
+{
+    const size_t min = strlen(trash->root);
+    struct stat sb;
+    char *top, *dir, *slash, save;
+    size_t len, plen;
+    bool moved = false;
+    int fd;
+
+    for (size_t i = 0; i < trash->count; i++)
+        if (trash->dirs[i].dev == dev)
+            return trash->dirs[i].path;
+
+    if ((top = malloc(strlen(path) + sizeof(TRASH_NAME))) == NULL)
+        return NULL;
+
+    strcpy(top, path);
+    for (len = strlen(top); len > 1 && top[len - 1] == '/'; len--)
+        top[len - 1] = '\0';
+
+    while ((slash = strrchr(top, '/')) != NULL)
+    {
+        plen = slash == top ? 1 : (size_t)(slash - top);
+
+        /* the root itself may be used, but not what is above it */
+        if (plen < min)
+            break;
+
+        save = top[plen];
+        top[plen] = '\0';
+        if (lstat(top, &sb) == -1 || sb.st_dev != dev) {
+            top[plen] = save;
+            break;
+        }
+
+        moved = true;
+        if (plen == 1)
+            break;
+    }
+
+    /* path is the top of its file system, so cannot be renamed in it */
+    if (!moved) {
+        free(top);
+        errno = EXDEV;
+        return NULL;
+    }
+
+    strcpy(top + (strcmp(top, "/") ? strlen(top) : 0), TRASH_NAME);
+    dir = top;
+
+    if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST)
+        goto fail;
+
+    /* not following a link, in case one was already there */
+    if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        goto fail;
+
+    if (fstat(fd, &sb) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        goto fail;
+    }
+    close(fd);
+
+    if (!trash_safe(&sb)) {
+        errno = EPERM;
+        goto fail;
+    }
+
+    if (sb.st_dev != dev) {
+        errno = EXDEV;
+        goto fail;
+    }
+
+    if (trash_add(trash, dev, dir))
+        goto fail;
+
+    free(dir);
+    return trash->dirs[trash->count - 1].path;
+
+fail:
+    {
+        int saved = errno;
+        free(dir);
+        errno = saved;
+    }
+    return NULL;
+}
+
+/* deletes name in dirfd, and everything below it */
+__attribute__((nonnull))
+static void rm_tree_at(int dirfd, const char *name)
+{
+    struct dirent *ent;
+    DIR *dirp;
+    int fd;
+
+    if (unlinkat(dirfd, name, 0) == 0 || (errno != EISDIR && errno != EPERM))
+        return;
+
+    if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1)
+        return;
+
+    if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dirp)) != NULL)
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        rm_tree_at(fd, ent->d_name);
+    }
+
+    closedir(dirp);
+
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) == -1 && errno != ENOENT)
+        warn("trash: rmdir %s", name);
+}
+
+/* is there anything in the directory at path */
+__attribute__((nonnull, warn_unused_result))
+static bool trash_full(const char *path)
+{
+    struct dirent *ent;
+    DIR *dirp;
+    bool ret = false;
+
+    if ((dirp = opendir(path)) == NULL)
+        return false;
+
+    while ((ent = readdir(dirp)) != NULL)
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+            ret = true;
+            break;
+        }
+
+    closedir(dirp);
+    return ret;
+}
+
+/* the detached child. anything a later run moves in while it is deleting is
+ * left to the child of that run */
+__attribute__((noreturn, nonnull))
+static void trash_child(struct trash *trash)
+{
+    struct dirent *ent;
+    DIR *dirp;
+
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PID, 0, IOPRIO_IDLE);
+#endif
+    if (setpriority(PRIO_PROCESS, 0, 19) == -1)
+        warn("trash: setpriority");
+
+    for (size_t i = 0; i < trash->count; i++)
+    {
+        if ((dirp = opendir(trash->dirs[i].path)) == NULL)
+            continue;
+
+        while ((ent = readdir(dirp)) != NULL)
+        {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            rm_tree_at(dirfd(dirp), ent->d_name);
+        }
+
+        closedir(dirp);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+
+
+/* public functions */
+
+struct trash *trash_create(const char *path, const char *root)
+{
+    struct trash *trash;
+    struct stat sb;
+    char line[PATH_MAX + 2];
+    size_t len;
+    FILE *fp;
+
+    if ((trash = calloc(1, sizeof(struct trash))) == NULL)
+        return NULL;
+
+    pthread_mutex_init(&trash->lock, NULL);
+    atomic_init(&trash->moved, 0);
+    atomic_init(&trash->seq, 0);
+
+    if ((trash->list = strdup(path)) == NULL || (trash->root = strdup(root)) == NULL)
+        goto fail;
+
+    /* those that have gone, or are no longer safe to empty, are dropped
+     * from the list */
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp))
+        {
+            if ((len = strlen(line)) && line[len - 1] == '\n')
+                line[--len] = '\0';
+
+            if (!len || lstat(line, &sb) == -1 || !trash_safe(&sb))
+                continue;
+
+            if (trash_add(trash, sb.st_dev, line)) {
+                fclose(fp);
+                goto fail;
+            }
+        }
+        fclose(fp);
+    } else if (errno != ENOENT)
+        goto fail;
+
+    return trash;
+
+fail:
+    {
+        int saved = errno;
+        trash_destroy(trash);
+        errno = saved;
+    }
+    return NULL;
+}
+
+void trash_destroy(struct trash *trash)
+{
+    for (size_t i = 0; i < trash->count; i++)
+        free(trash->dirs[i].path);
+
+    pthread_mutex_destroy(&trash->lock);
+    free(trash->dirs);
+    free(trash->list);
+    free(trash->root);
+    free(trash);
+}
+
+int trash_move(struct trash *trash, const char *path)
+{
+    struct stat sb;
+    const char *dir;
+    char *dst;
+    size_t len;
+    int rc = -1;
+
+    if (lstat(path, &sb) == -1)
+        return -1;
+
+    pthread_mutex_lock(&trash->lock);
+
+    if ((dir = trash_dir(trash, path, sb.st_dev)) == NULL)
+        goto done;
+
+    len = strlen(dir) + 48;
+    if ((dst = malloc(len)) == NULL)
+        goto done;
+
+    snprintf(dst, len, "%s/%u.%lu", dir, (unsigned)getpid(),
+            atomic_fetch_add(&trash->seq, 1));
+
+    if ((rc = rename(path, dst)) == 0)
+        atomic_fetch_add(&trash->moved, 1);
+
+    free(dst);
+
+done:
+    {
+        int saved = errno;
+        pthread_mutex_unlock(&trash->lock);
+        errno = saved;
+    }
+    return rc;
+}
+
+int trash_save(struct trash *trash)
+{
+    const size_t len = strlen(trash->list) + 5;
+    char *tmp, *dir;
+    FILE *fp;
+
+    if ((tmp = malloc(len)) == NULL)
+        return -1;
+
+    snprintf(tmp, len, "%s.tmp", trash->list);
+
+    if ((dir = strdup(trash->list)) != NULL) {
+        mkpath(dirname(dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+        free(dir);
+    }
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+        goto fail;
+
+    pthread_mutex_lock(&trash->lock);
+    for (size_t i = 0; i < trash->count; i++)
+        fprintf(fp, "%s\n", trash->dirs[i].path);
+    pthread_mutex_unlock(&trash->lock);
+
+    if (fclose(fp) || rename(tmp, trash->list) == -1)
+        goto fail;
+
+    free(tmp);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+    }
+    return -1;
+}
+
+pid_t trash_empty(struct trash *trash)
+{
+    int pipefd[2], status;
+    bool full = false;
+    pid_t pid, child = 0;
+
+    for (size_t i = 0; i < trash->count && !full; i++)
+        full = trash_full(trash->dirs[i].path);
+
+    if (!full)
+        return 0;
+
+    /* the grandchild's pid, as the child exits at once so that it is not
+     * left for this process (which may be --daemon) to reap */
+    if (pipe(pipefd) == -1)
+        return -1;
+
+    fflush(NULL);
+
+    if ((pid = fork()) == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null;
+
+        close(pipefd[0]);
+        setsid();
+
+        /* nothing waiting on the output of this process waits for it */
+        if ((null = open("/dev/null", O_RDWR|O_CLOEXEC)) != -1) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            if (null > STDERR_FILENO)
+                close(null);
+        }
+
+        if ((child = fork()) == 0) {
+            close(pipefd[1]);
+            trash_child(trash);
+        }
+
+        if (write(pipefd[1], &child, sizeof(child)) == -1)
+            _exit(EXIT_FAILURE);
+        _exit(child == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0], &child, sizeof(child)) != sizeof(child))
+        child = -1;
+    close(pipefd[0]);
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+
+    return child;
+}
+
+void trash_stats(struct trash *trash, unsigned long *moved)
+{
+    *moved = atomic_load(&trash->moved);
+}
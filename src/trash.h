@@ -0,0 +1,37 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+#include <sys/types.h>
+
+/* --trash: rather than be deleted where it is, a tree that D or R removes
+ * is renamed into the trash directory of its file system, which is made as
+ * ".tmpfilesd-trash" (0700) at the highest directory of the same file system
+ * (and not above the root). one that is already there is only used if it
+ * is this user's and closed to everyone else. the trash is emptied later,
+ * by a detached child at idle I/O priority, so that nothing waits for it.
+ *
+ * the trash directories used are listed in a file, so that anything left
+ * in them by a child that did not finish is deleted on the next run. all
+ * but trash_empty() may be called from any thread */
+
+struct trash;
+
+/* reads the list at path, which need not exist, and keeps it to save to.
+ * trash directories are made no higher than root */
+extern struct trash *trash_create(const char *path, const char *root)
+    __attribute__((nonnull, warn_unused_result));
+extern void trash_destroy(struct trash *trash)
+    __attribute__((nonnull));
+/* fails with EXDEV if path is the top of its file system */
+extern int trash_move(struct trash *trash, const char *path)
+    __attribute__((nonnull, warn_unused_result));
+extern int trash_save(struct trash *trash)
+    __attribute__((nonnull, warn_unused_result));
+/* forks the child that empties every trash directory listed, if any has
+ * anything in it. returns its pid, or 0 if there was nothing to do */
+extern pid_t trash_empty(struct trash *trash)
+    __attribute__((nonnull, warn_unused_result));
+extern void trash_stats(struct trash *trash, unsigned long *moved)
+    __attribute__((nonnull));
+
+#endif
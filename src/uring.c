@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+/* macros and defines */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+
+/* type defintions */
+
+/* an operation in flight, indexed by its submission queue slot */
+struct uring_slot {
+    uint64_t data;
+    struct stat *sb;
+    struct statx stx;
+};
+
+struct uring {
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* prepared, but not yet visible to the kernel */
+    unsigned local_tail;
+    unsigned queued;
+
+    struct uring_slot *slots;
+};
+
+
+
+/* private functions */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* check the kernel knows every opcode we use */
+__attribute__((nonnull, warn_unused_result))
+static bool uring_probe(const struct uring *ring)
+{
+    static const int needed[] = { IORING_OP_STATX, IORING_OP_UNLINKAT };
+    struct io_uring_probe *probe;
+    const size_t len = sizeof(struct io_uring_probe) +
+        IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    bool ret = true;
+
+    if ((probe = calloc(1, len)) == NULL)
+        return false;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe,
+                IORING_OP_LAST) == -1) {
+        free(probe);
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(needed)/sizeof(needed[0]); i++)
+        if (needed[i] > probe->last_op ||
+                !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            ret = false;
+
+    free(probe);
+
+    if (!ret)
+        errno = ENOTSUP;
+
+    return ret;
+}
+
+__attribute__((nonnull(1), warn_unused_result))
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, uint64_t data,
+        struct stat *sb)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (ring->queued == ring->sq_entries) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    idx = ring->local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = idx;
+
+    ring->slots[idx].data = data;
+    ring->slots[idx].sb = sb;
+    ring->sq_array[idx] = idx;
+    ring->local_tail++;
+    ring->queued++;
+
+    return sqe;
+}
+
+__attribute__((nonnull))
+static void statx_to_stat(const struct statx *stx, struct stat *sb)
+{
+    memset(sb, 0, sizeof(struct stat));
+
+    sb->st_dev          = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino          = stx->stx_ino;
+    sb->st_mode         = stx->stx_mode;
+    sb->st_nlink        = stx->stx_nlink;
+    sb->st_uid          = stx->stx_uid;
+    sb->st_gid          = stx->stx_gid;
+    sb->st_rdev         = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    sb->st_size         = stx->stx_size;
+    sb->st_blksize      = stx->stx_blksize;
+    sb->st_blocks       = stx->stx_blocks;
+    sb->st_atim.tv_sec  = stx->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec  = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec  = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+
+
+/* public functions */
+
+struct uring *uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+
+    if ((ring = calloc(1, sizeof(struct uring))) == NULL)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = -1;
+    ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+
+    if ((ring->fd = sys_io_uring_setup(entries, &p)) == -1)
+        goto fail;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = 0;
+    }
+
+    if ((ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto fail;
+
+    if (ring->cq_len == 0)
+        ring->cq_ptr = ring->sq_ptr;
+    else if ((ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED)
+        goto fail;
+
+    ring->sq_head    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+
+    ring->cq_head    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    ring->local_tail = *ring->sq_tail;
+
+    if ((ring->slots = calloc(p.sq_entries, sizeof(struct uring_slot))) == NULL)
+        goto fail;
+
+    if (!uring_probe(ring))
+        goto fail;
+
+    return ring;
+
+fail:
+    {
+        int saved_errno = errno;
+        uring_destroy(ring);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd != -1)
+        close(ring->fd);
+
+    free(ring->slots);
+    free(ring);
+}
+
+unsigned uring_space(const struct uring *ring)
+{
+    return ring->sq_entries - ring->queued;
+}
+
+/* fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW), sb is filled on completion */
+int uring_prep_stat(struct uring *ring, int dirfd, const char *name,
+        struct stat *sb, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(ring, data, sb)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t)(uintptr_t)&ring->slots[sqe->user_data].stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+
+    return 0;
+}
+
+int uring_prep_unlinkat(struct uring *ring, int dirfd, const char *name,
+        int flags, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(ring, data, NULL)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->unlink_flags = flags;
+
+    return 0;
+}
+
+int uring_run(struct uring *ring, uring_cb_t cb, void *ctx)
+{
+    unsigned to_submit = ring->queued;
+    unsigned done = 0;
+    int rc;
+
+    if (to_submit == 0)
+        return 0;
+
+    __atomic_store_n(ring->sq_tail, ring->local_tail, __ATOMIC_RELEASE);
+
+    while (done < ring->queued)
+    {
+        if ((rc = sys_io_uring_enter(ring->fd, to_submit, 1,
+                        IORING_ENTER_GETEVENTS)) == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            /* the state of the ring is now unknown */
+            return -1;
+        }
+
+        to_submit -= MIN((unsigned)rc, to_submit);
+
+        unsigned head = *ring->cq_head;
+        const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++, done++)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct uring_slot *slot = &ring->slots[cqe->user_data];
+
+            if (slot->sb && cqe->res == 0)
+                statx_to_stat(&slot->stx, slot->sb);
+
+            cb(ctx, slot->data, cqe->res);
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    ring->queued = 0;
+    return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct uring *uring_create(unsigned entries)
+{
+    (void)entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    (void)ring;
+}
+
+unsigned uring_space(const struct uring *ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int uring_prep_stat(struct uring *ring, int dirfd, const char *name,
+        struct stat *sb, uint64_t data)
+{
+    (void)ring; (void)dirfd; (void)name; (void)sb; (void)data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_unlinkat(struct uring *ring, int dirfd, const char *name,
+        int flags, uint64_t data)
+{
+    (void)ring; (void)dirfd; (void)name; (void)flags; (void)data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_run(struct uring *ring, uring_cb_t cb, void *ctx)
+{
+    (void)ring; (void)cb; (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
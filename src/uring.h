@@ -0,0 +1,36 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* a minimal io_uring(7) submission ring for batching metadata syscalls.
+ *
+ * operations are queued with uring_prep_*() and then submitted together by
+ * uring_run(), which waits for every completion. uring_create() returns NULL
+ * if io_uring, or any of the operations used, is not available at build or
+ * run time, in which case callers use the plain syscalls. if uring_run()
+ * fails the ring must be destroyed */
+
+struct uring;
+
+/* called by uring_run() for each completion, res is as per the syscall but
+ * with -errno on failure */
+typedef void (*uring_cb_t)(void *ctx, uint64_t data, int res);
+
+extern struct uring *uring_create(unsigned entries)
+    __attribute__((warn_unused_result));
+extern void uring_destroy(struct uring *ring)
+    __attribute__((nonnull));
+extern unsigned uring_space(const struct uring *ring)
+    __attribute__((nonnull));
+extern int uring_prep_stat(struct uring *ring, int dirfd, const char *name,
+        struct stat *sb, uint64_t data)
+    __attribute__((nonnull(1,3,4), warn_unused_result));
+extern int uring_prep_unlinkat(struct uring *ring, int dirfd, const char *name,
+        int flags, uint64_t data)
+    __attribute__((nonnull(1,3), warn_unused_result));
+extern int uring_run(struct uring *ring, uring_cb_t cb, void *ctx)
+    __attribute__((nonnull(1,2), warn_unused_result));
+
+#endif
@@ -0,0 +1,283 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "watch.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+
+/* macros and defines */
+
+/* only new names are of interest: a write can only push an expiry back,
+ * which is found when it falls due, but a touch(1) can bring one forward */
+#define WATCH_MASK (IN_CREATE|IN_MOVED_TO|IN_ATTRIB|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+
+
+
+/* type defintions */
+
+/* the ignores in force when a directory was walked, shared between every
+ * directory walked with the same ones */
+struct ignore_snap {
+    struct ignore_set set;
+    unsigned refs;
+};
+
+struct watch_set {
+    int fd;
+    size_t max;
+    size_t count;
+    struct watch_dir **dirs;    /* indexed by watch descriptor */
+    size_t ndirs;
+    struct ignore_snap *last;
+};
+
+
+
+/* private functions */
+
+static void snap_put(struct watch_set *set, struct ignore_set *ignores)
+{
+    struct ignore_snap *snap = (struct ignore_snap *)ignores;
+
+    if (snap == NULL || --snap->refs)
+        return;
+
+    if (set->last == snap)
+        set->last = NULL;
+
+    ignore_clear(&snap->set);
+    free(snap);
+}
+
+__attribute__((nonnull, warn_unused_result))
+static struct ignore_set *snap_get(struct watch_set *set, const struct ignore_set *ignores)
+{
+    struct ignore_snap *snap = set->last;
+
+    if (snap && snap->set.hash == ignores->hash && snap->set.count == ignores->count) {
+        snap->refs++;
+        return &snap->set;
+    }
+
+    if ((snap = calloc(1, sizeof(struct ignore_snap))) == NULL)
+        return NULL;
+
+    if (ignore_copy(&snap->set, ignores)) {
+        free(snap);
+        return NULL;
+    }
+
+    snap->refs = 1;
+    set->last = snap;
+
+    return &snap->set;
+}
+
+static void dir_free(struct watch_set *set, int wd)
+{
+    struct watch_dir *dir = set->dirs[wd];
+
+    snap_put(set, dir->ignores);
+    free(dir->path);
+    free(dir);
+
+    set->dirs[wd] = NULL;
+    set->count--;
+}
+
+
+
+/* public functions */
+
+struct watch_set *watch_create(size_t max_watches)
+{
+    struct watch_set *set;
+
+    if ((set = calloc(1, sizeof(struct watch_set))) == NULL)
+        return NULL;
+
+    if ((set->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) {
+        free(set);
+        return NULL;
+    }
+
+    set->max = max_watches;
+
+    return set;
+}
+
+void watch_destroy(struct watch_set *set)
+{
+    for (size_t i = 0; i < set->ndirs; i++)
+        if (set->dirs[i])
+            dir_free(set, i);
+
+    close(set->fd);
+    free(set->dirs);
+    free(set);
+}
+
+int watch_fd(const struct watch_set *set)
+{
+    return set->fd;
+}
+
+/* watching a directory again replaces the age and ignores it is cleaned
+ * with. ignores may be NULL */
+int watch_add(struct watch_set *set, const char *path, uint64_t dev,
+        uint64_t ino, time_t age, const struct ignore_set *ignores)
+{
+    struct watch_dir *dir;
+    size_t len = strlen(path);
+    char *new_path;
+    int wd;
+
+    if ((wd = inotify_add_watch(set->fd, path, WATCH_MASK)) == -1)
+        return -1;
+
+    if ((size_t)wd >= set->ndirs) {
+        size_t new_ndirs = set->ndirs ? set->ndirs : 64;
+        struct watch_dir **new_dirs;
+
+        while (new_ndirs <= (size_t)wd)
+            new_ndirs *= 2;
+
+        if ((new_dirs = realloc(set->dirs, new_ndirs * sizeof(struct watch_dir *))) == NULL)
+            goto fail;
+
+        memset(new_dirs + set->ndirs, 0, (new_ndirs - set->ndirs) * sizeof(struct watch_dir *));
+        set->dirs = new_dirs;
+        set->ndirs = new_ndirs;
+    }
+
+    if ((dir = set->dirs[wd]) == NULL) {
+        if (set->count >= set->max) {
+            errno = ENOSPC;
+            goto fail;
+        }
+
+        if ((dir = calloc(1, sizeof(struct watch_dir))) == NULL)
+            goto fail;
+
+        set->dirs[wd] = dir;
+        set->count++;
+    }
+
+    if ((new_path = malloc(len + 2)) == NULL)
+        goto fail_dir;
+
+    memcpy(new_path, path, len + 1);
+    if (len == 0 || path[len - 1] != '/')
+        strcat(new_path, "/");
+
+    free(dir->path);
+    dir->path = new_path;
+
+    snap_put(set, dir->ignores);
+    dir->ignores = NULL;
+
+    if (ignores && (dir->ignores = snap_get(set, ignores)) == NULL)
+        goto fail_dir;
+
+    dir->dev = dev;
+    dir->ino = ino;
+    dir->age = age;
+
+    return 0;
+
+fail_dir:
+    dir_free(set, wd);
+fail:
+    {
+        int saved_errno = errno;
+        inotify_rm_watch(set->fd, wd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/* reads every pending event, returns 1 if any were lost */
+int watch_read(struct watch_set *set, watch_cb_t cb, void *ctx)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    int lost = 0;
+
+    while (true)
+    {
+        if ((len = read(set->fd, buf, sizeof(buf))) == -1) {
+            if (errno == EAGAIN)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event *)ptr;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                lost = 1;
+                continue;
+            }
+
+            if (ev->wd < 0 || (size_t)ev->wd >= set->ndirs || set->dirs[ev->wd] == NULL)
+                continue;
+
+            if (ev->mask & IN_IGNORED)
+                dir_free(set, ev->wd);
+            else if (ev->len && ev->name[0])
+                cb(ctx, set->dirs[ev->wd], ev->name);
+        }
+    }
+
+    return lost;
+}
+
+#else /* !HAVE_SYS_INOTIFY_H */
+
+struct watch_set *watch_create(size_t max_watches)
+{
+    (void)max_watches;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void watch_destroy(struct watch_set *set)
+{
+    (void)set;
+}
+
+int watch_fd(const struct watch_set *set)
+{
+    (void)set;
+    return -1;
+}
+
+int watch_add(struct watch_set *set, const char *path, uint64_t dev,
+        uint64_t ino, time_t age, const struct ignore_set *ignores)
+{
+    (void)set; (void)path; (void)dev; (void)ino; (void)age; (void)ignores;
+    errno = ENOSYS;
+    return -1;
+}
+
+int watch_read(struct watch_set *set, watch_cb_t cb, void *ctx)
+{
+    (void)set; (void)cb; (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ignore.h"
+
+/* inotify(7) watches on the directories of aged cleans, so that --daemon
+ * hears of new files rather than having to walk again to find them.
+ *
+ * watch_create() returns NULL if inotify is not available at build or run
+ * time. watch_read() returns 1 if the kernel dropped events, in which case
+ * the caller has to walk everything again */
+
+struct watch_set;
+
+struct watch_dir {
+    char *path;                 /* with a trailing '/' */
+    uint64_t dev;
+    uint64_t ino;
+    time_t age;
+    struct ignore_set *ignores; /* NULL if the clean did not check them */
+};
+
+/* called by watch_read() for each name created in, or moved into, dir */
+typedef void (*watch_cb_t)(void *ctx, const struct watch_dir *dir, const char *name);
+
+extern struct watch_set *watch_create(size_t max_watches)
+    __attribute__((warn_unused_result));
+extern void watch_destroy(struct watch_set *set)
+    __attribute__((nonnull));
+extern int watch_fd(const struct watch_set *set)
+    __attribute__((nonnull));
+extern int watch_add(struct watch_set *set, const char *path, uint64_t dev,
+        uint64_t ino, time_t age, const struct ignore_set *ignores)
+    __attribute__((nonnull(1,2), warn_unused_result));
+extern int watch_read(struct watch_set *set, watch_cb_t cb, void *ctx)
+    __attribute__((nonnull(1,2), warn_unused_result));
+
+#endif
@@ -0,0 +1,306 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+/* macros and defines */
+
+#define DEQUE_INITIAL 64
+
+
+
+/* type defintions */
+
+struct work_item {
+    workpool_fn_t fn;
+    void *arg;
+};
+
+/* a ring buffer, the owning worker uses the tail and thieves use the head */
+struct work_deque {
+    pthread_mutex_t lock;
+    struct work_item *items;
+    size_t cap;
+    size_t head;
+    size_t len;
+};
+
+struct workpool {
+    int nthreads;
+    int started;
+    pthread_t *threads;
+    struct work_deque *deques;
+
+    /* work submitted and not yet finished, and work sitting in a deque */
+    atomic_size_t pending;
+    atomic_size_t queued;
+    atomic_uint next;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    int sleeping;
+    bool shutdown;
+};
+
+struct worker {
+    struct workpool *pool;
+    int id;
+};
+
+/* private global variables */
+
+static _Thread_local struct workpool *self_pool = NULL;
+static _Thread_local int self_id = -1;
+
+
+
+/* private functions */
+
+__attribute__((nonnull, warn_unused_result))
+static int deque_push(struct work_deque *dq, const struct work_item *item,
+        atomic_size_t *queued)
+{
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->len == dq->cap) {
+        size_t new_cap = dq->cap ? dq->cap * 2 : DEQUE_INITIAL;
+        struct work_item *new_items;
+
+        if ((new_items = malloc(new_cap * sizeof(struct work_item))) == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+
+        for (size_t i = 0; i < dq->len; i++)
+            new_items[i] = dq->items[(dq->head + i) % dq->cap];
+
+        free(dq->items);
+        dq->items = new_items;
+        dq->cap = new_cap;
+        dq->head = 0;
+    }
+
+    dq->items[(dq->head + dq->len) % dq->cap] = *item;
+    dq->len++;
+    atomic_fetch_add(queued, 1);
+
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* pop from the tail (owner) or head (thief). queued is counted under the
+ * lock with the push and pop, so that it never goes below zero */
+__attribute__((nonnull, warn_unused_result))
+static bool deque_pop(struct work_deque *dq, struct work_item *item, bool steal,
+        atomic_size_t *queued)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->len) {
+        if (steal) {
+            *item = dq->items[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        } else
+            *item = dq->items[(dq->head + dq->len - 1) % dq->cap];
+
+        dq->len--;
+        atomic_fetch_sub(queued, 1);
+        ret = true;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+__attribute__((nonnull, warn_unused_result))
+static bool find_work(struct workpool *pool, int id, struct work_item *item)
+{
+    if (deque_pop(&pool->deques[id], item, false, &pool->queued))
+        return true;
+
+    for (int i = 1; i < pool->nthreads; i++)
+        if (deque_pop(&pool->deques[(id + i) % pool->nthreads], item, true,
+                    &pool->queued))
+            return true;
+
+    return false;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *self = arg;
+    struct workpool *pool = self->pool;
+    struct work_item item;
+
+    self_pool = pool;
+    self_id = self->id;
+    free(self);
+
+    while (true)
+    {
+        if (!find_work(pool, self_id, &item)) {
+            pthread_mutex_lock(&pool->lock);
+
+            while (!pool->shutdown && atomic_load(&pool->queued) == 0) {
+                pool->sleeping++;
+                pthread_cond_wait(&pool->work_cv, &pool->lock);
+                pool->sleeping--;
+            }
+
+            if (pool->shutdown) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        item.fn(item.arg);
+
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->done_cv);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/* public functions */
+
+struct workpool *workpool_create(int nthreads)
+{
+    struct workpool *pool;
+
+    if (nthreads < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((pool = calloc(1, sizeof(struct workpool))) == NULL)
+        return NULL;
+
+    if ((pool->threads = calloc(nthreads, sizeof(pthread_t))) == NULL ||
+            (pool->deques = calloc(nthreads, sizeof(struct work_deque))) == NULL) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->next, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    pool->nthreads = nthreads;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct worker *worker;
+        int rc;
+
+        if ((worker = malloc(sizeof(struct worker))) == NULL)
+            rc = errno;
+        else {
+            worker->pool = pool;
+            worker->id = i;
+
+            if ((rc = pthread_create(&pool->threads[i], NULL, worker_main, worker)))
+                free(worker);
+            else
+                pool->started++;
+        }
+
+        if (rc) {
+            workpool_destroy(pool);
+            errno = rc;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/* queue fn(arg), on the calling worker's own deque if called from within
+ * the pool, otherwise spread round-robin over the workers */
+int workpool_submit(struct workpool *pool, workpool_fn_t fn, void *arg)
+{
+    const struct work_item item = { fn, arg };
+    int id;
+
+    if (self_pool == pool)
+        id = self_id;
+    else
+        id = atomic_fetch_add(&pool->next, 1) % pool->nthreads;
+
+    atomic_fetch_add(&pool->pending, 1);
+
+    if (deque_push(&pool->deques[id], &item, &pool->queued)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->sleeping)
+        pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+size_t workpool_queued(struct workpool *pool)
+{
+    return atomic_load(&pool->queued);
+}
+
+/* wait for all submitted work, including anything it submits, to finish */
+void workpool_wait(struct workpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending))
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_destroy(struct workpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->started; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->done_cv);
+
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,26 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stddef.h>
+
+/* a fixed size pool of threads, each with its own deque of work items.
+ *
+ * items submitted from inside a worker are pushed on to that worker's
+ * deque and popped LIFO, idle workers steal FIFO from the others */
+
+struct workpool;
+
+typedef void (*workpool_fn_t)(void *arg);
+
+extern struct workpool *workpool_create(int nthreads)
+    __attribute__((warn_unused_result));
+extern int workpool_submit(struct workpool *pool, workpool_fn_t fn, void *arg)
+    __attribute__((nonnull(1,2), warn_unused_result));
+extern size_t workpool_queued(struct workpool *pool)
+    __attribute__((nonnull));
+extern void workpool_wait(struct workpool *pool)
+    __attribute__((nonnull));
+extern void workpool_destroy(struct workpool *pool)
+    __attribute__((nonnull));
+
+#endif